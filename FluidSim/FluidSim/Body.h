@@ -1,17 +1,20 @@
 #pragma once
 
 #include <glm/glm.hpp>
-#include <glload/gl_3_3.h>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
 
 // super for rigid bodies
 class Body {
 public:
+	Body() : center(0.f), velocity(0.f), forceAccum(0.f), rotation(0.f), omega(0.f), mass(1.f), localToWorld(1.f), worldToLocal(1.f) {}
+
 	virtual glm::vec3 GetAngularVelocity(glm::vec3 contactpoint) = 0;
 	virtual glm::vec3 GetVelocity() = 0;
 	virtual glm::vec3 AbsoluteContactPoint(glm::vec3& relposition) = 0;
 	virtual bool collision(const glm::vec3& position, const glm::vec3& newposition, glm::vec3& contactPoint, float& penDepth, glm::vec3& normal) = 0;
+	// Axis aligned box around the body at its current position, every hit found by collision lies within it
+	virtual void GetBounds(glm::vec3& low, glm::vec3& high) = 0;
 
 
 	glm::vec3	center;
@@ -20,4 +23,16 @@ public:
 	glm::vec3	rotation;
 	glm::vec3	omega;
 	float		mass;
+
+	// Recomputes localToWorld and worldToLocal from rotation, call it whenever rotation changes
+	void UpdateTransform() {
+		const float angle = glm::length(rotation);
+		localToWorld = angle > 0 ? glm::mat3(glm::rotate(glm::mat4(1.f), angle, rotation / angle)) : glm::mat3(1.f);
+		worldToLocal = glm::transpose(localToWorld);
+	}
+
+	// Rotation from the body's axes to the world's and back, around center
+	// A world point p is at worldToLocal * (p - center) in the body's frame
+	glm::mat3	localToWorld;
+	glm::mat3	worldToLocal;
 };
\ No newline at end of file
@@ -0,0 +1,464 @@
+// Benchmark suite for the solver, on five levels:
+//   kernel      - single kernel evaluations, per call and in batches with each available instruction set
+//   neighbours  - grid build with and without reordering, grid query, both again with a hashed grid,
+//                 and the full neighbour list update
+//   pass        - every SPH pass and the collision pass on its own
+//   step        - whole ExplicitEulerStep iterations
+//   insert      - adding the particles of a scene to an empty simulator in one bulk call
+// Every measurement is the median over several runs after a warm-up run, on a fixed scene,
+// and is written as JSON or CSV with ns per item and neighbour pairs per second
+//
+// Usage: FluidSimBench [options]
+//   --sizes N,N,...    Particle counts of the scenes (default 1000,10000,100000,1000000)
+//   --groups G,G,...   Levels to run out of kernel, neighbours, pass, step and insert (default all)
+//   --repeat N         Runs per measurement, the median is reported (default 5)
+//   --steps N          Steps per run for the step level (default: about 2 million particle steps)
+//   --threads N        Solver threads, 0 uses all hardware threads (default 1)
+//   --spacing X        Distance between the particles of the scene (default 12.5, about 30 neighbours)
+//   --format json|csv  Output format (default json)
+//   --output FILE      Write the results to FILE instead of stdout
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "fluidsimulator.h"
+#include "kernels.h"
+#include "kernelbatch.h"
+#include "profiler.h"
+#include "sphkernelset.h"
+
+// Keeps the compiler from optimising away results that are never used
+volatile float benchSink;
+
+// Combines both outputs of a gradient and laplacian kernel, laplacian is read only after the call
+inline float Sum(const glm::vec3& gradient, const float& laplacian) {
+	return gradient.x + laplacian;
+}
+
+struct BenchOptions {
+	std::vector<unsigned>	sizes;
+	std::vector<std::string>	groups;
+	unsigned	repeat;
+	unsigned	steps;			// 0 picks a count per size
+	unsigned	threads;
+	float		spacing;
+	std::string	format;
+	std::string	output;
+};
+
+struct BenchResult {
+	std::string	group;
+	std::string	name;
+	unsigned	particles;		// Particles in the scene, or evaluations per run for the kernel level
+	double		seconds;		// Median time of one run
+	double		nsPerItem;		// Per kernel evaluation, per particle, or per particle per step
+	double		pairsPerSecond;	// Neighbour pairs handled per second, 0 where it does not apply
+};
+
+// Runs f once to warm up and then repeat times, returns the median time of a run in seconds
+template <typename F>
+double Measure(unsigned repeat, F f) {
+	f();
+	std::vector<double> times;
+	for (unsigned r = 0; r < repeat; r++) {
+		const double start = ProfileTime();
+		f();
+		times.push_back(ProfileTime() - start);
+	}
+	std::sort(times.begin(), times.end());
+	return times[times.size() / 2];
+}
+
+BenchResult MakeResult(const std::string& group, const std::string& name, unsigned particles, double seconds, double items, double pairs) {
+	BenchResult result;
+	result.group = group;
+	result.name = name;
+	result.particles = particles;
+	result.seconds = seconds;
+	result.nsPerItem = items > 0.0 ? seconds * 1e9 / items : 0.0;
+	result.pairsPerSecond = pairs > 0.0 && seconds > 0.0 ? pairs / seconds : 0.0;
+	return result;
+}
+
+// The passes are private to the simulator, this class is a friend so it can time them one by one
+class SolverBench {
+public:
+	SolverBench(const BenchOptions& options, std::vector<BenchResult>& results) : options(options), results(results) {}
+
+	void		RunKernels();
+	void		RunNeighbours(unsigned size);
+	void		RunPasses(unsigned size);
+	void		RunSteps(unsigned size);
+	void		RunInsert(unsigned size);
+
+private:
+	// Fills simulator with size particles on a lattice, in a bounding box with room to spare
+	// The simulator is created here, because the bounding box depends on the size
+	std::unique_ptr<FluidSimulator>	CreateScene(unsigned size) const;
+	void		AddLattice(FluidSimulator& simulator, unsigned size) const;
+	unsigned	CountPairs(const FluidSimulator& simulator) const;
+
+	const BenchOptions&			options;
+	std::vector<BenchResult>&	results;
+};
+
+std::unique_ptr<FluidSimulator> SolverBench::CreateScene(unsigned size) const {
+	const unsigned side = (unsigned)ceil(pow((double)size, 1.0 / 3.0));
+	const float extent = side * options.spacing;
+
+	std::unique_ptr<FluidSimulator> simulator(new FluidSimulator(AABoundingBox(glm::vec3(0.f, 0.f, 0.f), 1.5f * extent + 100.f)));
+	simulator->SetThreadCount(options.threads);
+	simulator->ToggleUseOctree();
+	AddLattice(*simulator, size);
+	return simulator;
+}
+
+void SolverBench::AddLattice(FluidSimulator& simulator, unsigned size) const {
+	const unsigned side = (unsigned)ceil(pow((double)size, 1.0 / 3.0));
+
+	// A small deterministic jitter keeps the lattice from being unrealistically regular
+	unsigned seed = 12345;
+	simulator.AddParticles(size, [&](unsigned i, ParticleRef p) {
+		glm::vec3 position((float)(i % side), (float)(i / side % side), (float)(i / (side * side)));
+		position = (position - glm::vec3(0.5f * side)) * options.spacing;
+		for (int a = 0; a < 3; a++) {
+			seed = seed * 1664525u + 1013904223u;
+			position[a] += ((float)(seed >> 8) / 16777216.f - 0.5f) * 0.1f * options.spacing;
+		}
+		p.position = position;
+	});
+}
+
+unsigned SolverBench::CountPairs(const FluidSimulator& simulator) const {
+	unsigned pairs = 0;
+	for (unsigned i = 0; i < simulator.particles.Size(); i++)
+		pairs += simulator.neighbours.End(i) - simulator.neighbours.Begin(i);
+	return pairs;
+}
+
+void SolverBench::RunKernels() {
+	const unsigned count = 1 << 16;
+	const unsigned rounds = 32;
+	const float h = 25.f;
+	const SphKernelSet kernels(h);
+
+	// Lengths spread over [0, 1.1 h], so some pairs fall outside the kernel support like in the solver
+	std::vector<float> lr(count), out(count), out2(count);
+	std::vector<glm::vec3> r(count);
+	unsigned seed = 54321;
+	for (unsigned i = 0; i < count; i++) {
+		seed = seed * 1664525u + 1013904223u;
+		lr[i] = (float)(seed >> 8) / 16777216.f * 1.1f * h;
+		r[i] = glm::vec3(lr[i], 0.f, 0.f);
+	}
+
+	const double evaluations = (double)count * rounds;
+	double t;
+	float sum;
+
+#define BENCH_KERNEL(name, expression) \
+	t = Measure(options.repeat, [&]() { \
+		sum = 0.f; \
+		for (unsigned round = 0; round < rounds; round++) \
+			for (unsigned i = 0; i < count; i++) \
+				sum += expression; \
+		benchSink = sum; \
+	}); \
+	results.push_back(MakeResult("kernel", name, count * rounds, t, evaluations, 0.0));
+
+	float laplacian;
+	BENCH_KERNEL("KernelPoly6", KernelPoly6(lr[i]*lr[i], h))
+	BENCH_KERNEL("KernelSpikyGradient", KernelSpikyGradient(r[i], lr[i], h).x)
+	BENCH_KERNEL("KernelViscosityLaplacian", KernelViscosityLaplacian(lr[i], h))
+	BENCH_KERNEL("KernelPoly6GradientLaplacian", Sum(KernelPoly6GradientLaplacian(r[i], lr[i], h, laplacian), laplacian))
+	BENCH_KERNEL("SphKernelSet::Poly6", kernels.Poly6(lr[i]*lr[i]))
+	BENCH_KERNEL("SphKernelSet::SpikyGradient", kernels.SpikyGradient(r[i], lr[i]).x)
+	BENCH_KERNEL("SphKernelSet::ViscosityLaplacian", kernels.ViscosityLaplacian(lr[i]))
+	BENCH_KERNEL("SphKernelSet::Poly6GradientLaplacian", Sum(kernels.Poly6GradientLaplacian(r[i], lr[i], laplacian), laplacian))
+#undef BENCH_KERNEL
+
+#define BENCH_BATCH(name, call) \
+	t = Measure(options.repeat, [&]() { \
+		for (unsigned round = 0; round < rounds; round++) \
+			call; \
+		benchSink = out[count / 2]; \
+	}); \
+	results.push_back(MakeResult("kernel", std::string(name) + " " + KernelBatchIsaName(isa), count * rounds, t, evaluations, 0.0));
+
+	// Every instruction set this build and processor have, then back to the one the solver uses
+	const KernelBatchIsa solverIsa = GetKernelBatchIsa();
+	for (int i = KernelBatchScalar; i <= KernelBatchAvx512; i++) {
+		const KernelBatchIsa isa = (KernelBatchIsa)i;
+		if (!SetKernelBatchIsa(isa)) continue;
+		BENCH_BATCH("KernelPoly6Batch", KernelPoly6Batch(&lr[0], &out[0], count, kernels))
+		BENCH_BATCH("KernelSpikyGradientBatch", KernelSpikyGradientBatch(&lr[0], &out[0], count, kernels))
+		BENCH_BATCH("KernelViscosityLaplacianBatch", KernelViscosityLaplacianBatch(&lr[0], &out[0], count, kernels))
+		BENCH_BATCH("KernelPoly6GradientLaplacianBatch", KernelPoly6GradientLaplacianBatch(&lr[0], &out[0], &out2[0], count, kernels))
+	}
+	SetKernelBatchIsa(solverIsa);
+#undef BENCH_BATCH
+}
+
+void SolverBench::RunNeighbours(unsigned size) {
+	std::unique_ptr<FluidSimulator> simulator = CreateScene(size);
+	FluidSimulator& s = *simulator;
+	const float h = s.kernels.GetH();
+	const float hs = h*h;
+
+	double t = Measure(options.repeat, [&]() { s.grid.Build(s.particles, false); });
+	results.push_back(MakeResult("neighbours", "grid build", size, t, size, 0.0));
+	t = Measure(options.repeat, [&]() { s.grid.Build(s.particles, true); });
+	results.push_back(MakeResult("neighbours", "grid build and reorder", size, t, size, 0.0));
+
+	// Query every particle's 27 cells and count the pairs within h
+	unsigned pairs = 0;
+	const auto query = [&]() {
+		pairs = 0;
+		for (unsigned i = 0; i < s.particles.Size(); i++) {
+			const glm::vec3 pi = s.particles.position[i];
+			s.grid.ForEachNeighbour(pi, [&](unsigned j) {
+				const glm::vec3 rij = pi - s.particles.position[j];
+				if (j != i && glm::dot(rij, rij) <= hs) pairs++;
+			});
+		}
+	};
+	t = Measure(options.repeat, query);
+	results.push_back(MakeResult("neighbours", "grid query", size, t, size, pairs));
+
+	// The same with the occupied cells in a hash table
+	s.SetGridStorage(HashedGrid);
+	t = Measure(options.repeat, [&]() { s.grid.Build(s.particles, false); });
+	results.push_back(MakeResult("neighbours", "hashed grid build", size, t, size, 0.0));
+	t = Measure(options.repeat, query);
+	results.push_back(MakeResult("neighbours", "hashed grid query", size, t, size, pairs));
+	s.SetGridStorage(DenseGrid);
+
+	// Without a skin the neighbour list searches the candidates again on every update
+	s.SetNeighbourSkin(0.f);
+	t = Measure(options.repeat, [&]() { s.UpdateNeighbours(); });
+	results.push_back(MakeResult("neighbours", "neighbour list", size, t, size, CountPairs(s)));
+
+	// Half pairs search half of the cells and list every pair once; counted as both of its sides, like above
+	s.SetPairMode(HalfPairs);
+	t = Measure(options.repeat, [&]() { s.UpdateNeighbours(); });
+	results.push_back(MakeResult("neighbours", "half pair neighbour list", size, t, size, 2.0 * CountPairs(s)));
+}
+
+void SolverBench::RunPasses(unsigned size) {
+	std::unique_ptr<FluidSimulator> simulator = CreateScene(size);
+	FluidSimulator& s = *simulator;
+	s.UpdateNeighbours();
+	s.CalculateDensities();
+	s.CalculatePressures();
+	const unsigned pairs = CountPairs(s);
+
+	struct Pass {
+		const char*	name;
+		void		(FluidSimulator::*run)();
+		bool		perPair;	// Loops over the neighbour list
+	};
+	const Pass passes[] = {
+		{ "CalculateDensities", &FluidSimulator::CalculateDensities, true },
+		{ "CalculatePressures", &FluidSimulator::CalculatePressures, false },
+		{ "ApplyPressureForces", &FluidSimulator::ApplyPressureForces, true },
+		{ "ApplyViscosityForces", &FluidSimulator::ApplyViscosityForces, true },
+		{ "ApplySurfaceTensionForces", &FluidSimulator::ApplySurfaceTensionForces, true },
+		{ "ApplyGravityForces", &FluidSimulator::ApplyGravityForces, false },
+		{ "ApplyWindForces", &FluidSimulator::ApplyWindForces, false },
+	};
+	for (unsigned p = 0; p < sizeof(passes) / sizeof(passes[0]); p++) {
+		const Pass& pass = passes[p];
+		const double t = Measure(options.repeat, [&]() { (s.*pass.run)(); });
+		results.push_back(MakeResult("pass", pass.name, size, t, size, pass.perPair ? pairs : 0.0));
+	}
+
+	// The passes over the neighbours again with every pair listed once, for the same pairs as above
+	s.SetPairMode(HalfPairs);
+	s.UpdateNeighbours();
+	s.CalculateDensities();
+	s.CalculatePressures();
+	for (unsigned p = 0; p < sizeof(passes) / sizeof(passes[0]); p++) {
+		const Pass& pass = passes[p];
+		if (!pass.perPair) continue;
+		const double t = Measure(options.repeat, [&]() { (s.*pass.run)(); });
+		results.push_back(MakeResult("pass", std::string(pass.name) + " (half pairs)", size, t, size, pairs));
+	}
+	s.SetPairMode(FullPairs);
+	s.UpdateNeighbours();
+
+	const double t = Measure(options.repeat, [&]() { s.DetectAndRespondCollisions(0.1f); });
+	results.push_back(MakeResult("pass", "DetectAndRespondCollisions", size, t, size, 0.0));
+}
+
+void SolverBench::RunSteps(unsigned size) {
+	std::unique_ptr<FluidSimulator> simulator = CreateScene(size);
+	FluidSimulator& s = *simulator;
+
+	unsigned steps = options.steps;
+	if (steps == 0) steps = std::max(2u, std::min(50u, 2000000u / size));
+
+	const double t = Measure(options.repeat, [&]() {
+		for (unsigned step = 0; step < steps; step++)
+			s.ExplicitEulerStep(0.1f);
+	});
+	std::ostringstream name;
+	name << "ExplicitEulerStep x" << steps;
+	results.push_back(MakeResult("step", name.str(), size, t, (double)size * steps, (double)CountPairs(s) * steps));
+
+	// From the same start with half pairs
+	std::unique_ptr<FluidSimulator> halfSimulator = CreateScene(size);
+	FluidSimulator& half = *halfSimulator;
+	half.SetPairMode(HalfPairs);
+	const double th = Measure(options.repeat, [&]() {
+		for (unsigned step = 0; step < steps; step++)
+			half.ExplicitEulerStep(0.1f);
+	});
+	name << " (half pairs)";
+	results.push_back(MakeResult("step", name.str(), size, th, (double)size * steps, 2.0 * CountPairs(half) * steps));
+}
+
+void SolverBench::RunInsert(unsigned size) {
+	std::unique_ptr<FluidSimulator> simulator = CreateScene(size);
+	FluidSimulator& s = *simulator;
+
+	// The storage is released before every run, so each one allocates it from scratch
+	const double t = Measure(options.repeat, [&]() {
+		s.Clear();
+		s.particles = ParticleStore();
+		AddLattice(s, size);
+	});
+	results.push_back(MakeResult("insert", "AddParticles", size, t, (double)size, 0.0));
+}
+
+// Splits a comma separated list
+std::vector<std::string> SplitList(const std::string& list) {
+	std::vector<std::string> items;
+	std::stringstream ss(list);
+	std::string item;
+	while (std::getline(ss, item, ','))
+		if (!item.empty()) items.push_back(item);
+	return items;
+}
+
+void PrintUsage() {
+	std::cerr << "Usage: FluidSimBench [--sizes N,N,...] [--groups kernel,neighbours,pass,step,insert] [--repeat N] [--steps N]" << std::endl
+		<< "                     [--threads N] [--spacing X] [--format json|csv] [--output FILE]" << std::endl;
+}
+
+// Returns false if the arguments could not be parsed
+bool ParseOptions(int argc, char** argv, BenchOptions& options) {
+	options.sizes.push_back(1000);
+	options.sizes.push_back(10000);
+	options.sizes.push_back(100000);
+	options.sizes.push_back(1000000);
+	options.groups = SplitList("kernel,neighbours,pass,step,insert");
+	options.repeat = 5;
+	options.steps = 0;
+	options.threads = 1;
+	options.spacing = 12.5f;
+	options.format = "json";
+
+	for (int i = 1; i < argc; i++) {
+		const std::string arg = argv[i];
+		const bool hasValue = i + 1 < argc;
+
+		if (arg == "--sizes" && hasValue) {
+			options.sizes.clear();
+			const std::vector<std::string> sizes = SplitList(argv[++i]);
+			for (auto si = sizes.begin(); si != sizes.end(); si++)
+				options.sizes.push_back((unsigned)atoi(si->c_str()));
+		}
+		else if (arg == "--groups" && hasValue) options.groups = SplitList(argv[++i]);
+		else if (arg == "--repeat" && hasValue) options.repeat = (unsigned)atoi(argv[++i]);
+		else if (arg == "--steps" && hasValue) options.steps = (unsigned)atoi(argv[++i]);
+		else if (arg == "--threads" && hasValue) options.threads = (unsigned)atoi(argv[++i]);
+		else if (arg == "--spacing" && hasValue) options.spacing = (float)atof(argv[++i]);
+		else if (arg == "--format" && hasValue) options.format = argv[++i];
+		else if (arg == "--output" && hasValue) options.output = argv[++i];
+		else {
+			std::cerr << "Unknown or incomplete option " << arg << std::endl;
+			return false;
+		}
+	}
+
+	if (options.format != "json" && options.format != "csv") {
+		std::cerr << "--format has to be json or csv" << std::endl;
+		return false;
+	}
+	if (options.repeat == 0) options.repeat = 1;
+	for (auto si = options.sizes.begin(); si != options.sizes.end(); si++) {
+		if (*si == 0) {
+			std::cerr << "--sizes has to list positive particle counts" << std::endl;
+			return false;
+		}
+	}
+	return options.spacing > 0.f;
+}
+
+void WriteJson(std::ostream& out, const BenchOptions& options, unsigned threads, const std::vector<BenchResult>& results) {
+	out << "{\n\t\"threads\": " << threads << ",\n\t\"repeat\": " << options.repeat
+		<< ",\n\t\"spacing\": " << options.spacing << ",\n\t\"results\": [\n";
+	for (unsigned i = 0; i < results.size(); i++) {
+		const BenchResult& r = results[i];
+		out << "\t\t{ \"group\": \"" << r.group << "\", \"name\": \"" << r.name << "\", \"particles\": " << r.particles
+			<< ", \"seconds\": " << r.seconds << ", \"ns_per_item\": " << r.nsPerItem
+			<< ", \"pairs_per_second\": " << r.pairsPerSecond << " }" << (i + 1 < results.size() ? "," : "") << "\n";
+	}
+	out << "\t]\n}\n";
+}
+
+void WriteCsv(std::ostream& out, unsigned threads, const std::vector<BenchResult>& results) {
+	out << "group,name,particles,threads,seconds,ns_per_item,pairs_per_second\n";
+	for (auto ri = results.begin(); ri != results.end(); ri++) {
+		out << ri->group << ',' << ri->name << ',' << ri->particles << ',' << threads << ','
+			<< ri->seconds << ',' << ri->nsPerItem << ',' << ri->pairsPerSecond << '\n';
+	}
+}
+
+int main(int argc, char** argv) {
+	BenchOptions options;
+	if (!ParseOptions(argc, argv, options)) {
+		PrintUsage();
+		return 1;
+	}
+
+	std::vector<BenchResult> results;
+	SolverBench bench(options, results);
+	const auto has = [&](const char* group) {
+		return std::find(options.groups.begin(), options.groups.end(), group) != options.groups.end();
+	};
+
+	if (has("kernel")) bench.RunKernels();
+	for (auto si = options.sizes.begin(); si != options.sizes.end(); si++) {
+		std::cerr << "Running " << *si << " particles" << std::endl;
+		if (has("neighbours")) bench.RunNeighbours(*si);
+		if (has("pass")) bench.RunPasses(*si);
+		if (has("step")) bench.RunSteps(*si);
+		if (has("insert")) bench.RunInsert(*si);
+	}
+
+	// Report the thread count the simulator actually used, 0 resolves to the hardware thread count
+	FluidSimulator probe(AABoundingBox(glm::vec3(0.f, 0.f, 0.f), 100.f));
+	probe.SetThreadCount(options.threads);
+	const unsigned threads = probe.GetThreadCount();
+
+	std::ofstream file;
+	if (!options.output.empty()) {
+		file.open(options.output.c_str());
+		if (!file) {
+			std::cerr << "Could not open " << options.output << " for writing" << std::endl;
+			return 1;
+		}
+	}
+	std::ostream& out = file.is_open() ? file : std::cout;
+	if (options.format == "json")
+		WriteJson(out, options, threads, results);
+	else
+		WriteCsv(out, threads, results);
+	return 0;
+}
@@ -0,0 +1,111 @@
+#include "bodybroadphase.h"
+
+#include <algorithm>
+
+// Margin around the swept bounds, so the narrow phase's rounding cannot find hits just outside of them
+const float boundsMargin = 1e-3f;
+// Most cells the broad phase lays over the bounding box, whatever the grid's cell size
+const unsigned maxBroadPhaseCells = 1 << 18;
+
+BodyBroadPhase::BodyBroadPhase() :
+	built(false),
+	origin(0.f, 0.f, 0.f),
+	invCellSize(1.f),
+	dimensions(0, 0, 0) {
+}
+
+// Cell that contains position, clamped to the border cells
+glm::ivec3 BodyBroadPhase::CellCoord(const glm::vec3& position) const {
+	const glm::vec3 local = (position - origin) * invCellSize;
+	glm::ivec3 cell;
+	for (int a = 0; a < 3; a++) {
+		// Compare as float first, so huge or non-finite positions cannot overflow the int cast
+		const float c = local[a];
+		if (!(c >= 0.f)) cell[a] = 0;
+		else if (c >= (float)(dimensions[a] - 1)) cell[a] = dimensions[a] - 1;
+		else cell[a] = (int)c;
+	}
+	return cell;
+}
+
+void BodyBroadPhase::Build(const std::vector<Body*>& bodies, const UniformGrid& grid) {
+	const unsigned count = (unsigned)bodies.size();
+	built = true;
+
+	// The grid's cells, doubled in size until there are few enough of them
+	float cellSize = grid.GetCellSize();
+	origin = grid.GetOrigin();
+	dimensions = grid.GetDimensions();
+	while ((unsigned long long)dimensions.x * dimensions.y * dimensions.z > maxBroadPhaseCells) {
+		cellSize *= 2.f;
+		for (int a = 0; a < 3; a++)
+			dimensions[a] = (dimensions[a] + 1) / 2;
+	}
+	invCellSize = 1.f / cellSize;
+
+	// A body moving with velocity u is tested against segments relative to it, p + (v - u) t for t in [0, 1]
+	// That point lies within the body exactly when p + v t lies within the body moved by u t,
+	// so the bounds at t = 0 and t = 1 together cover every hit of the segment p to p + v
+	boundsLow.resize(count);
+	boundsHigh.resize(count);
+	for (unsigned b = 0; b < count; b++) {
+		glm::vec3 low, high;
+		bodies[b]->GetBounds(low, high);
+		const glm::vec3 u = bodies[b]->GetVelocity();
+		boundsLow[b] = glm::min(low, low + u) - glm::vec3(boundsMargin);
+		boundsHigh[b] = glm::max(high, high + u) + glm::vec3(boundsMargin);
+	}
+
+	// Count the bodies per cell, then fill the cells in order of body index
+	const unsigned cells = (unsigned)(dimensions.x * dimensions.y * dimensions.z);
+	cellStart.assign(cells + 1, 0);
+	for (unsigned pass = 0; pass < 2; pass++) {
+		if (pass == 1) {
+			for (unsigned c = 0; c < cells; c++)
+				cellStart[c + 1] += cellStart[c];
+			cellBodies.resize(cellStart[cells]);
+		}
+		for (unsigned b = 0; b < count; b++) {
+			const glm::ivec3 lowCell = CellCoord(boundsLow[b]);
+			const glm::ivec3 highCell = CellCoord(boundsHigh[b]);
+			for (int z = lowCell.z; z <= highCell.z; z++)
+				for (int y = lowCell.y; y <= highCell.y; y++)
+					for (int x = lowCell.x; x <= highCell.x; x++) {
+						const unsigned c = (unsigned)(x + (y + z * dimensions.y) * dimensions.x);
+						if (pass == 0) cellStart[c + 1]++;
+						else cellBodies[cellStart[c]++] = b;
+					}
+		}
+	}
+	// Filling moved every start to the end of its cell, shift them back
+	for (unsigned c = cells; c > 0; c--)
+		cellStart[c] = cellStart[c - 1];
+	cellStart[0] = 0;
+}
+
+bool BodyBroadPhase::NextCandidate(const glm::vec3& low, const glm::vec3& high, unsigned first, unsigned& body) const {
+	if (!built || first >= boundsLow.size()) return false;
+
+	const glm::ivec3 lowCell = CellCoord(low);
+	const glm::ivec3 highCell = CellCoord(high);
+	unsigned best = (unsigned)boundsLow.size();
+	for (int z = lowCell.z; z <= highCell.z; z++)
+		for (int y = lowCell.y; y <= highCell.y; y++)
+			for (int x = lowCell.x; x <= highCell.x; x++) {
+				const unsigned c = (unsigned)(x + (y + z * dimensions.y) * dimensions.x);
+				for (unsigned k = cellStart[c]; k < cellStart[c + 1]; k++) {
+					const unsigned b = cellBodies[k];
+					if (b >= best) break;	// Sorted per cell, nothing lower follows
+					if (b < first) continue;
+					if (low.x > boundsHigh[b].x || high.x < boundsLow[b].x ||
+						low.y > boundsHigh[b].y || high.y < boundsLow[b].y ||
+						low.z > boundsHigh[b].z || high.z < boundsLow[b].z) continue;
+					best = b;
+					break;
+				}
+			}
+
+	if (best == boundsLow.size()) return false;
+	body = best;
+	return true;
+}
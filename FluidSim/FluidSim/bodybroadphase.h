@@ -0,0 +1,35 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <vector>
+#include "Body.h"
+#include "uniformgrid.h"
+
+// Broad phase for particle versus body collisions
+// Every body's bounds, swept over one unit of its velocity, are binned into the cells of the fluid grid over the bounding box,
+// merged into larger cells if the box would need too many; bounds outside of the box are clamped to its border cells
+// A particle moving from p to p + v can only hit a body whose swept bounds overlap the box around that segment,
+// so the narrow phase only has to run for those bodies
+class BodyBroadPhase {
+public:
+	BodyBroadPhase();
+
+	// Bins the bodies into the cells of grid, the bodies must not move until the next Build
+	void		Build(const std::vector<Body*>& bodies, const UniformGrid& grid);
+
+	// Finds the lowest body index >= first whose swept bounds overlap the box [low, high]
+	// Returns false if there is none; calling it again with body + 1 visits the candidates in index order
+	bool		NextCandidate(const glm::vec3& low, const glm::vec3& high, unsigned first, unsigned& body) const;
+
+private:
+	glm::ivec3	CellCoord(const glm::vec3& position) const;
+
+	bool					built;
+	glm::vec3				origin;			// Corner of the first cell
+	float					invCellSize;
+	glm::ivec3				dimensions;
+	std::vector<glm::vec3>	boundsLow;		// Swept bounds of every body
+	std::vector<glm::vec3>	boundsHigh;
+	std::vector<unsigned>	cellStart;		// Bodies of cell c are cellBodies[cellStart[c], cellStart[c+1])
+	std::vector<unsigned>	cellBodies;		// Body indices, in increasing order per cell
+};
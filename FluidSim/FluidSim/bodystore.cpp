@@ -0,0 +1,39 @@
+#include "bodystore.h"
+
+BodyStore::BodyStore() :
+	last(0) {
+}
+
+void BodyStore::Clear() {
+	spheres.clear();
+	boxes.clear();
+	rotatingBoxes.clear();
+	all.clear();
+	last = 0;
+}
+
+void BodyStore::Add(const Sphere& sphere) {
+	spheres.push_back(sphere);
+	Relink(&spheres.back());
+}
+
+void BodyStore::Add(const Box& box) {
+	boxes.push_back(box);
+	Relink(&boxes.back());
+}
+
+void BodyStore::Add(const BoxRotating& box) {
+	rotatingBoxes.push_back(box);
+	Relink(&rotatingBoxes.back());
+}
+
+void BodyStore::Relink(Body* added) {
+	all.clear();
+	for (unsigned i = 0; i < spheres.size(); i++)
+		all.push_back(&spheres[i]);
+	for (unsigned i = 0; i < boxes.size(); i++)
+		all.push_back(&boxes[i]);
+	for (unsigned i = 0; i < rotatingBoxes.size(); i++)
+		all.push_back(&rotatingBoxes[i]);
+	last = added;
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <vector>
+#include "Body.h"
+#include "sphere.h"
+#include "box.h"
+#include "boxRotating.h"
+
+// Storage for the rigid bodies, one contiguous array per body type
+// Code that knows the type walks the arrays directly, so the body functions are called without going through the vtable
+// GetAll lists every body as a Body*: the spheres first, then the boxes, then the rotating boxes
+// A body's index in that list is the one BodyBroadPhase reports
+class BodyStore {
+public:
+	BodyStore();
+
+	unsigned	Size() const { return (unsigned)all.size(); }
+	bool		Empty() const { return all.empty(); }
+	void		Clear();
+
+	// Appends a copy of the body
+	// Adding can move the arrays, so earlier Body pointers have to be fetched again
+	void		Add(const Sphere& sphere);
+	void		Add(const Box& box);
+	void		Add(const BoxRotating& box);
+
+	const std::vector<Body*>&	GetAll() const { return all; }
+
+	// Index in GetAll of the first box and of the first rotating box
+	unsigned	BoxesBegin() const { return (unsigned)spheres.size(); }
+	unsigned	RotatingBoxesBegin() const { return (unsigned)(spheres.size() + boxes.size()); }
+
+	// The body that was added last, null if there are none
+	Body*		GetLast() const { return last; }
+
+	// Add bodies through Add, it keeps GetAll up to date
+	std::vector<Sphere>			spheres;
+	std::vector<Box>			boxes;
+	std::vector<BoxRotating>	rotatingBoxes;
+
+private:
+	// Points all and last at the bodies again
+	void		Relink(Body* added);
+
+	std::vector<Body*>	all;
+	Body*				last;
+};
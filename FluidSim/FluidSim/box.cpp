@@ -1,6 +1,5 @@
 #include "box.h"
 #include "util.h"
-#include <glload/gl_3_3.h>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
 
@@ -68,6 +67,11 @@ bool Box::collision(const glm::vec3& position, const glm::vec3& displacement, gl
 }
 
 
+void Box::GetBounds(glm::vec3& low, glm::vec3& high){
+	low = center - 0.5f*size;
+	high = center + 0.5f*size;
+}
+
 glm::vec3 Box::AbsoluteContactPoint(glm::vec3& relposition){
 	return center + relposition;
 
@@ -1,6 +1,5 @@
 #include "boxRotating.h"
 #include "util.h"
-#include <glload/gl_3_3.h>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
 
@@ -19,10 +18,7 @@ glm::vec3 BoxRotating::GetAngularVelocity(glm::vec3 contactpoint){
 	if (glm::length(rotation)>=0){
 		return glm::vec3(0, 0, 0);
 	}
-	glm::mat4 RotationMatrix(1);
-	RotationMatrix = glm::rotate(RotationMatrix, glm::length(rotation), glm::normalize(rotation));
-
-	return glm::vec3(RotationMatrix * glm::vec4(contactpoint, 1.0)) - contactpoint;
+	return localToWorld * contactpoint - contactpoint;
 }
 
 glm::vec3 BoxRotating::GetVelocity(){
@@ -32,24 +28,15 @@ glm::vec3 BoxRotating::GetVelocity(){
 
 
 bool BoxRotating::collision(const glm::vec3& position, const glm::vec3& displacement, glm::vec3& contactPoint, float& penDepth, glm::vec3& normal){
-	glm::vec3 pos = position;
-	glm::vec3 dis = displacement;
-	glm::mat4 RotationMatrix(1);
-	if (glm::length(rotation)>0){
-		RotationMatrix = glm::rotate(RotationMatrix, glm::length(rotation), glm::normalize(rotation));
-		glm::mat4 iRotationMatrix(1);
-		iRotationMatrix = glm::translate(iRotationMatrix, -.5f*size);
-		iRotationMatrix = glm::translate(iRotationMatrix, -center);
-		iRotationMatrix = glm::rotate(iRotationMatrix, -glm::length(rotation), glm::normalize(rotation));
-		glm::vec3 pos = glm::vec3(iRotationMatrix * glm::vec4(position, 1.0));
-		glm::vec3 dis = glm::vec3(iRotationMatrix * glm::vec4(displacement, 1.0));
-	}
+	// Test in the box's own frame, where it is axis aligned around the origin
+	const glm::vec3 pos = worldToLocal * (position - center);
+	const glm::vec3 dis = worldToLocal * displacement;
 	float fLow = 0;
 	float fHi = 1;
 	int dir = -1;
 	for (int i = 0; i < 3;i++){
-		float newLow = ((center[i]- 0.5f*size[i]) - pos[i]) / (dis[i]);
-		float newHi = ((center[i]+ 0.5f*size[i]) - pos[i]) / (dis[i]);
+		float newLow = (-0.5f*size[i] - pos[i]) / (dis[i]);
+		float newHi = (0.5f*size[i] - pos[i]) / (dis[i]);
 
 		if (newLow>newHi){
 			float temp = newLow;
@@ -70,29 +57,31 @@ bool BoxRotating::collision(const glm::vec3& position, const glm::vec3& displace
 			return false;
 		}
 	}
-	//printf("%f\t%f\n",fLow,fHi);
 
 	if (fLow<fHi && fLow<1 && fHi>0 && dir!=-1){
-		//printf("%f\t%d\n",fLow,dir);
-		contactPoint = (pos + dis*fLow)-center;
-		printf("%f\n",glm::length(contactPoint));
+		contactPoint = localToWorld * (pos + dis*fLow);
 		penDepth = glm::length(dis*(fHi-fLow));
 		normal = glm::vec3(0.f,0.f,0.f);
-		if (position[dir]>center[dir]){
+		if (pos[dir]>0){
 			normal[dir] = 1;
 		}
 		else{
 			normal[dir] = -1;
 		}
-		if (glm::length(rotation) > 0){
-			normal = glm::vec3(RotationMatrix * glm::vec4(normal, 1.0));
-		}
+		normal = localToWorld * normal;
 		return true;
 	}
 	return false;
 }
 
 
+// The box fits in a sphere of half its diagonal around the center, whatever the rotation
+void BoxRotating::GetBounds(glm::vec3& low, glm::vec3& high){
+	const float radius = 0.5f*glm::length(size);
+	low = center - glm::vec3(radius);
+	high = center + glm::vec3(radius);
+}
+
 glm::vec3 BoxRotating::AbsoluteContactPoint(glm::vec3& relposition){
 	return center + relposition;
 
@@ -1,10 +1,10 @@
 #pragma once
 
 #include <glm/glm.hpp>
-#include "body.h"
+#include "Body.h"
 
 // rigid body box
-class BoxRotating : public Body {
+class BoxRotating final : public Body {
 public:
 	BoxRotating(glm::vec3 pos, glm::vec3 size, float m);
 
@@ -13,6 +13,7 @@ public:
 	glm::vec3 AbsoluteContactPoint(glm::vec3& relposition);
 
 	bool collision(const glm::vec3& position, const glm::vec3& displacement, glm::vec3& contactPoint, float& penDepth, glm::vec3& normal);
+	void GetBounds(glm::vec3& low, glm::vec3& high);
 
 	glm::vec3 size;
 	
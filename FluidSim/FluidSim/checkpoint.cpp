@@ -0,0 +1,317 @@
+// Checkpoints of the whole simulator state
+//
+// The file is a fixed header followed by the arrays, all in the byte order of the machine that wrote it:
+//   char[8]	"FLUIDCHK"
+//   uint32		version (checkpointVersion)
+//   uint32		toggles, bit 0 fluid gravity, 1 body gravity, 2 wind, 3 surface tension, 4 grid, 5 hashed grid,
+//				6 half pairs, 7 reorder due
+//   float[4]	bounding box center and size
+//   float[2]	smoothing length and neighbour skin, which together fix the grid
+//   float[4]	fluid parameters: k, mu, bounce, sigma
+//   uint32		collision iterations, integrator
+//   float[5]	time step limits: cfl, force and viscosity factor, minDt, maxDt
+//   uint32		most substeps
+//   uint32[3]	reorders, neighbour searches since and between the last two reorders
+//   float[2]	neighbour locality at the last search and right after the last reorder
+//   uint32		pressure solver, 0 equation of state, 1 PCISPH
+//   float		PCISPH tolerance, 0 for the equation of state
+//   uint32[3]	PCISPH least and most iterations, 0 for the equation of state; 1 if the reference density was measured
+//   float[2]	reference density excess, PCISPH delta
+//   uint32		particle count n, next particle id
+//   uint32		sphere, box and rotating box count
+//   n x vec3 positions, n x vec3 velocities, n x float masses, n x float rest densities, n x uint32 ids
+//   per sphere:			vec3 center, velocity, rotation, omega, float mass, float radius
+//   per (rotating) box:	vec3 center, velocity, rotation, omega, float mass, vec3 size
+//
+// Densities, pressures and forces are recomputed by every step, so they are not saved
+// The reorder state and what the pressure solver measured are, since a resumed run has to reorder the particles at the
+// same searches and solve against the same reference density as one that ran through
+// The arrays are written straight from the stores and copied straight back out of the mapped file
+
+#include "fluidsimulator.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include "mappedfile.h"
+
+typedef unsigned int uint32;
+
+const char checkpointMagic[8] = { 'F', 'L', 'U', 'I', 'D', 'C', 'H', 'K' };
+const uint32 checkpointVersion = 4;
+
+enum CheckpointToggle {
+	toggleFluidGravity = 1 << 0,
+	toggleBodyGravity = 1 << 1,
+	toggleWind = 1 << 2,
+	toggleSurfaceTension = 1 << 3,
+	toggleGrid = 1 << 4,
+	toggleHashedGrid = 1 << 5,
+	toggleHalfPairs = 1 << 6,
+	toggleReorderDue = 1 << 7
+};
+
+enum CheckpointSolver {
+	solverEquationOfState = 0,
+	solverPcisph = 1
+};
+
+const size_t checkpointHeaderSize = sizeof(checkpointMagic) + 2 * sizeof(uint32) + 10 * sizeof(float) + 2 * sizeof(uint32)
+	+ 5 * sizeof(float) + 4 * sizeof(uint32) + 2 * sizeof(float) + sizeof(uint32) + sizeof(float) + 3 * sizeof(uint32)
+	+ 2 * sizeof(float) + 5 * sizeof(uint32);
+const size_t checkpointParticleSize = 2 * sizeof(glm::vec3) + 2 * sizeof(float) + sizeof(uint32);
+const size_t checkpointSphereSize = 4 * sizeof(glm::vec3) + 2 * sizeof(float);
+const size_t checkpointBoxSize = 5 * sizeof(glm::vec3) + sizeof(float);
+
+template <typename T>
+static void Write(std::ostream& out, const T& value) {
+	out.write((const char*)&value, sizeof(T));
+}
+
+template <typename T>
+static void WriteArray(std::ostream& out, const std::vector<T>& values) {
+	if (!values.empty()) out.write((const char*)&values[0], values.size() * sizeof(T));
+}
+
+static void WriteBody(std::ostream& out, const Body& body) {
+	Write(out, body.center);
+	Write(out, body.velocity);
+	Write(out, body.rotation);
+	Write(out, body.omega);
+	Write(out, body.mass);
+}
+
+bool FluidSimulator::SaveCheckpoint(const std::string& path) const {
+	// Written next to path first, so a crash halfway leaves the previous checkpoint intact
+	const std::string partial = path + ".partial";
+	{
+		std::ofstream out(partial.c_str(), std::ios::binary | std::ios::trunc);
+		if (!out) return false;
+
+		const uint32 toggles = (fluidgravity ? toggleFluidGravity : 0) | (bodygravity ? toggleBodyGravity : 0) | (wind ? toggleWind : 0)
+			| (surfaceTension ? toggleSurfaceTension : 0) | (useOctree ? toggleGrid : 0)
+			| (grid.GetStorage() == HashedGrid ? toggleHashedGrid : 0) | (pairMode == HalfPairs ? toggleHalfPairs : 0)
+			| (reorderDue ? toggleReorderDue : 0);
+		out.write(checkpointMagic, sizeof(checkpointMagic));
+		Write(out, checkpointVersion);
+		Write(out, toggles);
+		Write(out, boundingBox.center);
+		Write(out, boundingBox.size);
+		Write(out, kernels.GetH());
+		Write(out, neighbours.GetSkin());
+		Write(out, parameters.k);
+		Write(out, parameters.mu);
+		Write(out, parameters.bounce);
+		Write(out, parameters.sigma);
+		Write(out, (uint32)collisionIterations);
+		Write(out, (uint32)integrator);
+		Write(out, timeStepSettings.cflFactor);
+		Write(out, timeStepSettings.forceFactor);
+		Write(out, timeStepSettings.viscosityFactor);
+		Write(out, timeStepSettings.minDt);
+		Write(out, timeStepSettings.maxDt);
+		Write(out, (uint32)timeStepSettings.maxSubsteps);
+		Write(out, (uint32)reorderStats.reorders);
+		Write(out, (uint32)reorderStats.searches);
+		Write(out, (uint32)reorderStats.interval);
+		Write(out, reorderStats.locality);
+		Write(out, reorderStats.baseline);
+		const PcisphSolver* pcisph = dynamic_cast<const PcisphSolver*>(pressureSolver.get());
+		Write(out, (uint32)(pcisph ? solverPcisph : solverEquationOfState));
+		Write(out, pcisph ? pcisph->tolerance : 0.f);
+		Write(out, (uint32)(pcisph ? pcisph->minIterations : 0));
+		Write(out, (uint32)(pcisph ? pcisph->maxIterations : 0));
+		Write(out, (uint32)(pressureSolver->measured ? 1 : 0));
+		Write(out, pressureSolver->referenceExcess);
+		Write(out, pcisph ? pcisph->delta : 0.f);
+		Write(out, (uint32)particles.Size());
+		Write(out, (uint32)particles.GetNextId());
+		Write(out, (uint32)bodies.spheres.size());
+		Write(out, (uint32)bodies.boxes.size());
+		Write(out, (uint32)bodies.rotatingBoxes.size());
+
+		WriteArray(out, particles.position);
+		WriteArray(out, particles.velocity);
+		WriteArray(out, particles.mass);
+		WriteArray(out, particles.restDensity);
+		WriteArray(out, particles.id);
+
+		for (auto si = bodies.spheres.begin(); si != bodies.spheres.end(); si++) {
+			WriteBody(out, *si);
+			Write(out, si->size);
+		}
+		for (auto bi = bodies.boxes.begin(); bi != bodies.boxes.end(); bi++) {
+			WriteBody(out, *bi);
+			Write(out, bi->size);
+		}
+		for (auto bi = bodies.rotatingBoxes.begin(); bi != bodies.rotatingBoxes.end(); bi++) {
+			WriteBody(out, *bi);
+			Write(out, bi->size);
+		}
+
+		out.flush();
+		if (!out) {
+			out.close();
+			std::remove(partial.c_str());
+			return false;
+		}
+	}
+
+#ifdef _WIN32
+	// rename does not replace existing files on Windows
+	std::remove(path.c_str());
+#endif
+	if (std::rename(partial.c_str(), path.c_str()) != 0) {
+		std::remove(partial.c_str());
+		return false;
+	}
+	return true;
+}
+
+// Copies values out of a mapped checkpoint; the caller has checked the size of the whole file up front
+class CheckpointReader {
+public:
+	explicit CheckpointReader(const unsigned char* data) : data(data) {}
+
+	template <typename T>
+	T Read() {
+		T value;
+		memcpy(&value, data, sizeof(T));
+		data += sizeof(T);
+		return value;
+	}
+
+	template <typename T>
+	void ReadArray(std::vector<T>& values) {
+		if (values.empty()) return;
+		memcpy(&values[0], data, values.size() * sizeof(T));
+		data += values.size() * sizeof(T);
+	}
+
+	void ReadBody(Body& body) {
+		body.center = Read<glm::vec3>();
+		body.velocity = Read<glm::vec3>();
+		body.rotation = Read<glm::vec3>();
+		body.omega = Read<glm::vec3>();
+		body.mass = Read<float>();
+		body.UpdateTransform();
+	}
+
+private:
+	const unsigned char*	data;
+};
+
+bool FluidSimulator::LoadCheckpoint(const std::string& path) {
+	MappedFile file;
+	if (!file.Open(path) || file.Size() < checkpointHeaderSize) return false;
+	if (memcmp(file.Data(), checkpointMagic, sizeof(checkpointMagic)) != 0) return false;
+
+	CheckpointReader reader(file.Data() + sizeof(checkpointMagic));
+	if (reader.Read<uint32>() != checkpointVersion) return false;
+	const uint32 toggles = reader.Read<uint32>();
+	const glm::vec3 boxCenter = reader.Read<glm::vec3>();
+	const float boxSize = reader.Read<float>();
+	const float h = reader.Read<float>();
+	const float skin = reader.Read<float>();
+	FluidParameters fluidParameters;
+	fluidParameters.k = reader.Read<float>();
+	fluidParameters.mu = reader.Read<float>();
+	fluidParameters.bounce = reader.Read<float>();
+	fluidParameters.sigma = reader.Read<float>();
+	const uint32 iterations = reader.Read<uint32>();
+	const uint32 integratorValue = reader.Read<uint32>();
+	TimeStepSettings settings;
+	settings.cflFactor = reader.Read<float>();
+	settings.forceFactor = reader.Read<float>();
+	settings.viscosityFactor = reader.Read<float>();
+	settings.minDt = reader.Read<float>();
+	settings.maxDt = reader.Read<float>();
+	settings.maxSubsteps = reader.Read<uint32>();
+	ReorderStats reorder;
+	reorder.reorders = reader.Read<uint32>();
+	reorder.searches = reader.Read<uint32>();
+	reorder.interval = reader.Read<uint32>();
+	reorder.locality = reader.Read<float>();
+	reorder.baseline = reader.Read<float>();
+	const uint32 solverKind = reader.Read<uint32>();
+	const float tolerance = reader.Read<float>();
+	const uint32 minIterations = reader.Read<uint32>();
+	const uint32 maxIterations = reader.Read<uint32>();
+	const uint32 measured = reader.Read<uint32>();
+	const float referenceExcess = reader.Read<float>();
+	const float delta = reader.Read<float>();
+	const uint32 particleCount = reader.Read<uint32>();
+	const uint32 nextId = reader.Read<uint32>();
+	const uint32 sphereCount = reader.Read<uint32>();
+	const uint32 boxCount = reader.Read<uint32>();
+	const uint32 rotatingBoxCount = reader.Read<uint32>();
+
+	// Everything after the header is fixed size records, so the counts have to add up to the file size exactly
+	// The sums are done in 64 bits, so corrupt counts cannot wrap around to a matching size
+	const unsigned long long expected = checkpointHeaderSize + (unsigned long long)particleCount * checkpointParticleSize
+		+ (unsigned long long)sphereCount * checkpointSphereSize + ((unsigned long long)boxCount + rotatingBoxCount) * checkpointBoxSize;
+	if (expected != file.Size()) return false;
+	if (!(h > 0.f) || !(skin >= 0.f) || !(boxSize > 0.f) || integratorValue > SymplecticEuler || solverKind > solverPcisph) return false;
+
+	// From here on nothing can fail, so the current state can go
+	Clear();
+	boundingBox = AABoundingBox(boxCenter, boxSize);
+	fluidgravity = (toggles & toggleFluidGravity) != 0;
+	bodygravity = (toggles & toggleBodyGravity) != 0;
+	wind = (toggles & toggleWind) != 0;
+	surfaceTension = (toggles & toggleSurfaceTension) != 0;
+	useOctree = (toggles & toggleGrid) != 0;
+	parameters = fluidParameters;
+	SetCollisionIterations(iterations);
+	integrator = (Integrator)integratorValue;
+	timeStepSettings = settings;
+	neighbours.SetSkin(skin);
+	// Before the smoothing length lays out the grid, so a hashed grid is never laid out densely over a large box
+	SetGridStorage((toggles & toggleHashedGrid) != 0 ? HashedGrid : DenseGrid);
+	SetSmoothingLength(h);
+	SetPairMode((toggles & toggleHalfPairs) != 0 ? HalfPairs : FullPairs);
+	// Clear asked for a reorder, which the run that wrote the file would not have done
+	reorderStats = reorder;
+	reorderDue = (toggles & toggleReorderDue) != 0;
+
+	// The solver goes on with the reference it measured instead of measuring the resumed particles again
+	if (solverKind == solverPcisph) {
+		std::unique_ptr<PcisphSolver> pcisph(new PcisphSolver(tolerance, minIterations, maxIterations));
+		pcisph->delta = delta;
+		pressureSolver = std::move(pcisph);
+	} else {
+		pressureSolver.reset(new EquationOfStateSolver());
+	}
+	pressureSolver->measured = measured != 0;
+	pressureSolver->referenceExcess = referenceExcess;
+
+	particles.Resize(particleCount);
+	reader.ReadArray(particles.position);
+	reader.ReadArray(particles.velocity);
+	reader.ReadArray(particles.mass);
+	reader.ReadArray(particles.restDensity);
+	reader.ReadArray(particles.id);
+	particles.SetNextId(nextId);
+
+	for (uint32 i = 0; i < sphereCount; i++) {
+		Sphere sphere(glm::vec3(0.f), 0.f, 0.f);
+		reader.ReadBody(sphere);
+		sphere.size = reader.Read<float>();
+		bodies.Add(sphere);
+	}
+	for (uint32 i = 0; i < boxCount; i++) {
+		Box box(glm::vec3(0.f), glm::vec3(0.f), 0.f);
+		reader.ReadBody(box);
+		box.size = reader.Read<glm::vec3>();
+		bodies.Add(box);
+	}
+	for (uint32 i = 0; i < rotatingBoxCount; i++) {
+		BoxRotating box(glm::vec3(0.f), glm::vec3(0.f), 0.f);
+		reader.ReadBody(box);
+		box.size = reader.Read<glm::vec3>();
+		bodies.Add(box);
+	}
+
+	neighbours.Invalidate();
+	return true;
+}
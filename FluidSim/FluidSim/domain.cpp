@@ -0,0 +1,311 @@
+#include "domain.h"
+
+#include <algorithm>
+#include <cstring>
+
+// A particle in a message: id, position, velocity, mass and rest density; densities, pressures and forces are
+// recomputed by every step, so they are not sent
+const size_t particleRecordSize = sizeof(unsigned) + 2 * sizeof(glm::vec3) + 2 * sizeof(float);
+
+template <typename T>
+static void Put(std::vector<unsigned char>& message, const T& value) {
+	const unsigned char* bytes = (const unsigned char*)&value;
+	message.insert(message.end(), bytes, bytes + sizeof(T));
+}
+
+// Reads the values of a message in order, failing instead of running past its end
+class MessageReader {
+public:
+	explicit MessageReader(const std::vector<unsigned char>& message) : message(message), at(0) {}
+
+	template <typename T>
+	bool Get(T& value) {
+		if (message.size() - at < sizeof(T)) return false;
+		memcpy(&value, &message[at], sizeof(T));
+		at += sizeof(T);
+		return true;
+	}
+
+	size_t Left() const { return message.size() - at; }
+
+private:
+	const std::vector<unsigned char>&	message;
+	size_t								at;
+};
+
+FluidDomain::FluidDomain(const AABoundingBox& boundingBox, DomainTransport& transport) :
+	simulator(boundingBox),
+	transport(transport),
+	cuts(transport.GetSize() + 1, 0.f),
+	steps(0) {
+}
+
+bool FluidDomain::Start() {
+	const AABoundingBox& box = simulator.GetBoundingBox();
+	const float low = std::min(box.left, box.right);
+	const float high = std::max(box.left, box.right);
+	const unsigned size = transport.GetSize();
+	if ((high - low) / size < 2.f * simulator.GetSmoothingLength() || simulator.isBodyGravity()) return false;
+
+	for (unsigned d = 0; d < size; d++)
+		cuts[d] = low + (high - low) * d / size;
+	cuts[size] = high;
+	steps = 0;
+	stats = DomainStats();
+
+	ParticleStore& particles = simulator.GetParticles();
+	const unsigned rank = transport.GetRank();
+	for (unsigned i = 0; i < particles.Size(); i++) {
+		const float x = particles.position[i].x;
+		if (Below(x, rank) || !Below(x, rank + 1)) simulator.KillParticle(simulator.GetParticleHandle(i));
+	}
+	simulator.RemoveKilledParticles();
+	return true;
+}
+
+// True if x lies on the side of cut c towards the domain with the lower rank
+// The outermost cuts are at minus and plus infinity, so particles that got past the walls still belong to a domain
+bool FluidDomain::Below(float x, unsigned c) const {
+	if (c == 0) return false;
+	if (c == transport.GetSize()) return true;
+	return x < cuts[c];
+}
+
+template <typename F>
+void FluidDomain::Pack(std::vector<unsigned char>& message, F pick) {
+	const ParticleStore& particles = simulator.GetParticles();
+	unsigned count = 0;
+	for (unsigned i = 0; i < particles.Size(); i++)
+		if (pick(particles.position[i].x)) count++;
+
+	message.clear();
+	message.reserve(sizeof(count) + count * particleRecordSize);
+	Put(message, count);
+	for (unsigned i = 0; i < particles.Size(); i++) {
+		if (!pick(particles.position[i].x)) continue;
+		Put(message, particles.id[i]);
+		Put(message, particles.position[i]);
+		Put(message, particles.velocity[i]);
+		Put(message, particles.mass[i]);
+		Put(message, particles.restDensity[i]);
+	}
+}
+
+unsigned FluidDomain::Unpack(const std::vector<unsigned char>& message) {
+	MessageReader reader(message);
+	unsigned count = 0;
+	if (!reader.Get(count) || reader.Left() != count * particleRecordSize) return 0;
+
+	// The particles keep the ids they had in the domain they came from
+	simulator.AddParticles(count, [&](unsigned, ParticleRef p) {
+		reader.Get(p.id);
+		reader.Get(p.position);
+		reader.Get(p.velocity);
+		reader.Get(p.mass);
+		reader.Get(p.restDensity);
+	});
+	return count;
+}
+
+// Copies in the particles within 2h of the slab from both neighbours
+bool FluidDomain::ExchangeGhosts() {
+	const unsigned rank = transport.GetRank();
+	const unsigned size = transport.GetSize();
+	const float halo = 2.f * simulator.GetSmoothingLength();
+
+	if (rank > 0) {
+		const float cut = cuts[rank] + halo;
+		Pack(outgoing, [=](float x) { return x < cut; });
+		if (!transport.Send(rank - 1, outgoing)) return false;
+	}
+	if (rank + 1 < size) {
+		const float cut = cuts[rank + 1] - halo;
+		Pack(outgoing, [=](float x) { return x >= cut; });
+		if (!transport.Send(rank + 1, outgoing)) return false;
+	}
+
+	ParticleStore& particles = simulator.GetParticles();
+	const unsigned first = particles.Size();
+	if (rank > 0) {
+		if (!transport.Receive(rank - 1, incoming)) return false;
+		Unpack(incoming);
+	}
+	if (rank + 1 < size) {
+		if (!transport.Receive(rank + 1, incoming)) return false;
+		Unpack(incoming);
+	}
+
+	// The grid reorders the particles during the step, so the ghosts are remembered by handle
+	ghosts.clear();
+	for (unsigned i = first; i < particles.Size(); i++)
+		ghosts.push_back(simulator.GetParticleHandle(i));
+	stats.ghosts = (unsigned)ghosts.size();
+	return true;
+}
+
+// Sends the particles outside of the slab to the neighbour on their side
+// Particles more than a slab away reach their domain over several calls
+bool FluidDomain::Migrate(unsigned& moved) {
+	const unsigned rank = transport.GetRank();
+	const unsigned size = transport.GetSize();
+	ParticleStore& particles = simulator.GetParticles();
+	moved = 0;
+
+	if (rank > 0) {
+		Pack(outgoing, [&](float x) { return Below(x, rank); });
+		if (!transport.Send(rank - 1, outgoing)) return false;
+	}
+	if (rank + 1 < size) {
+		Pack(outgoing, [&](float x) { return !Below(x, rank + 1); });
+		if (!transport.Send(rank + 1, outgoing)) return false;
+	}
+	for (unsigned i = 0; i < particles.Size(); i++) {
+		const float x = particles.position[i].x;
+		if (Below(x, rank) || !Below(x, rank + 1)) {
+			simulator.KillParticle(simulator.GetParticleHandle(i));
+			moved++;
+		}
+	}
+	simulator.RemoveKilledParticles();
+	stats.sent += moved;
+
+	if (rank > 0) {
+		if (!transport.Receive(rank - 1, incoming)) return false;
+		stats.received += Unpack(incoming);
+	}
+	if (rank + 1 < size) {
+		if (!transport.Receive(rank + 1, incoming)) return false;
+		stats.received += Unpack(incoming);
+	}
+	return true;
+}
+
+bool FluidDomain::Step(float dt) {
+	// Ghosts and migrants draw fresh ids from the store before their own are copied in, so the counter is put back
+	ParticleStore& particles = simulator.GetParticles();
+	const unsigned nextId = particles.GetNextId();
+
+	if (!ExchangeGhosts()) return false;
+	if (simulator.GetIntegrator() == SymplecticEuler) simulator.SymplecticEulerStep(dt);
+	else simulator.ExplicitEulerStep(dt);
+	for (auto gi = ghosts.begin(); gi != ghosts.end(); gi++)
+		simulator.KillParticle(*gi);
+	ghosts.clear();
+	simulator.RemoveKilledParticles();
+
+	unsigned moved;
+	if (!Migrate(moved)) return false;
+	particles.SetNextId(nextId);
+
+	steps++;
+	if (settings.rebalanceInterval > 0 && steps % settings.rebalanceInterval == 0) return Rebalance();
+	return true;
+}
+
+bool FluidDomain::Sum(unsigned value, unsigned& total) {
+	const unsigned rank = transport.GetRank();
+	const unsigned size = transport.GetSize();
+	if (rank != 0) {
+		outgoing.clear();
+		Put(outgoing, value);
+		if (!transport.Send(0, outgoing) || !transport.Receive(0, incoming)) return false;
+		MessageReader reader(incoming);
+		return reader.Get(total);
+	}
+
+	total = value;
+	for (unsigned d = 1; d < size; d++) {
+		if (!transport.Receive(d, incoming)) return false;
+		MessageReader reader(incoming);
+		unsigned other = 0;
+		if (!reader.Get(other)) return false;
+		total += other;
+	}
+	outgoing.clear();
+	Put(outgoing, total);
+	for (unsigned d = 1; d < size; d++)
+		if (!transport.Send(d, outgoing)) return false;
+	return true;
+}
+
+// Every domain sends the first a histogram of its particles along x, which places the cuts and sends them back
+bool FluidDomain::Rebalance() {
+	const unsigned rank = transport.GetRank();
+	const unsigned size = transport.GetSize();
+	const AABoundingBox& box = simulator.GetBoundingBox();
+	const float low = std::min(box.left, box.right);
+	const float high = std::max(box.left, box.right);
+	const unsigned bins = std::max(settings.histogramBins, 1u);
+	const float binWidth = (high - low) / bins;
+
+	// Particles beyond the walls count towards the outermost bins
+	std::vector<unsigned> histogram(bins, 0);
+	const ParticleStore& particles = simulator.GetParticles();
+	for (unsigned i = 0; i < particles.Size(); i++) {
+		const float b = (particles.position[i].x - low) / binWidth;
+		histogram[b >= 0.f ? std::min((unsigned)b, bins - 1) : 0]++;
+	}
+
+	std::vector<float> newCuts(cuts);
+	if (rank != 0) {
+		outgoing.clear();
+		for (unsigned b = 0; b < bins; b++)
+			Put(outgoing, histogram[b]);
+		if (!transport.Send(0, outgoing) || !transport.Receive(0, incoming)) return false;
+		MessageReader reader(incoming);
+		for (unsigned c = 0; c <= size; c++)
+			if (!reader.Get(newCuts[c])) return false;
+	} else {
+		std::vector<unsigned> counts(size, 0);
+		counts[0] = particles.Size();
+		for (unsigned d = 1; d < size; d++) {
+			if (!transport.Receive(d, incoming)) return false;
+			MessageReader reader(incoming);
+			for (unsigned b = 0; b < bins; b++) {
+				unsigned count;
+				if (!reader.Get(count)) return false;
+				histogram[b] += count;
+				counts[d] += count;
+			}
+		}
+
+		unsigned total = 0, most = 0;
+		for (unsigned d = 0; d < size; d++) {
+			total += counts[d];
+			most = std::max(most, counts[d]);
+		}
+		if (total > 0 && most > (1.f + settings.imbalance) * total / size) {
+			// Cut where the running count passes each domain's share, in between the bin edges
+			unsigned bin = 0, below = 0;
+			for (unsigned c = 1; c < size; c++) {
+				const double share = (double)total * c / size;
+				while (bin + 1 < bins && below + histogram[bin] < share) below += histogram[bin++];
+				const double within = histogram[bin] > 0 ? (share - below) / histogram[bin] : 0.0;
+				newCuts[c] = low + binWidth * (float)(bin + std::min(std::max(within, 0.0), 1.0));
+			}
+
+			// Keep every slab wide enough for the ghosts to come from the neighbours alone
+			const float minWidth = 2.f * simulator.GetSmoothingLength();
+			for (unsigned c = 1; c < size; c++)
+				newCuts[c] = std::max(newCuts[c], newCuts[c - 1] + minWidth);
+			for (unsigned c = size - 1; c > 0; c--)
+				newCuts[c] = std::min(newCuts[c], newCuts[c + 1] - minWidth);
+		}
+
+		outgoing.clear();
+		for (unsigned c = 0; c <= size; c++)
+			Put(outgoing, newCuts[c]);
+		for (unsigned d = 1; d < size; d++)
+			if (!transport.Send(d, outgoing)) return false;
+	}
+
+	// Every domain got the same cuts, so they all agree on whether anything has to move
+	if (newCuts == cuts) return true;
+	cuts = newCuts;
+	stats.rebalances++;
+	for (;;) {
+		unsigned moved, total;
+		if (!Migrate(moved) || !Sum(moved, total)) return false;
+		if (total == 0) return true;
+	}
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <vector>
+#include "domaintransport.h"
+#include "fluidsimulator.h"
+
+// How the domains of a decomposed run share the work, the same on every domain
+struct DomainSettings {
+	unsigned	rebalanceInterval;	// Steps between load checks, 0 never moves the cuts
+	float		imbalance;			// Move the cuts once the fullest domain holds this much more than the average, 0.1 is 10%
+	unsigned	histogramBins;		// Resolution of the particle distribution the new cuts are placed by
+
+	DomainSettings() : rebalanceInterval(50), imbalance(0.1f), histogramBins(1024) {}
+};
+
+// What a domain has done so far
+struct DomainStats {
+	unsigned	ghosts;				// Ghost particles at the last step
+	unsigned	sent;				// Particles that left for another domain
+	unsigned	received;			// Particles that came from another domain
+	unsigned	rebalances;			// Times the cuts were moved
+
+	DomainStats() : ghosts(0), sent(0), received(0), rebalances(0) {}
+};
+
+// One domain of a simulation split along x into slabs, one slab per domain, each domain in its own thread or process
+//
+// A domain is a whole FluidSimulator over the whole bounding box that only holds the particles of its slab.
+// Every step it receives copies of the particles within 2h of its slab from its neighbours: ghosts within h give
+// the particles at the border all their neighbours, and the ghosts from h to 2h give those ghosts their full density,
+// so the densities and forces of the particles of the slab come out as they would in a single simulator.
+// After the step the ghosts are dropped and particles that crossed a cut move to the domain next to it. Every
+// rebalanceInterval steps the domains count their particles, and if they differ by more than imbalance the cuts
+// move to split the particles evenly, keeping every slab at least 2h wide.
+//
+// Every domain has to be set up the same way and load the same scene, Start then drops the particles of the other slabs.
+// Steps are of fixed length, as adaptive ones would differ between the domains. Bodies are copied into every domain,
+// which only works while the fluid does not push them, so body gravity has to stay off. Use a hashed grid, so each
+// domain's memory follows its own particles rather than the whole box
+class FluidDomain {
+public:
+	FluidDomain(const AABoundingBox& boundingBox, DomainTransport& transport);
+
+	FluidSimulator&			GetSimulator() { return simulator; }
+	DomainSettings&			GetSettings() { return settings; }
+	const DomainStats&		GetStats() const { return stats; }
+	unsigned				GetRank() const { return transport.GetRank(); }
+
+	// Cuts the box into equal slabs and keeps the particles of this domain's slab; every domain has to call it
+	// Returns false if the slabs would be narrower than 2h or body gravity is on
+	bool		Start();
+
+	// One step of the whole simulation, every domain has to call it with the same dt
+	// Returns false if a message could not be sent or received
+	bool		Step(float dt);
+
+	// Slab of this domain, [low, high) along x; the outer domains also own whatever lies beyond the box
+	float		GetLow() const { return cuts[transport.GetRank()]; }
+	float		GetHigh() const { return cuts[transport.GetRank() + 1]; }
+
+	// Sum of value over all domains, every domain has to call it
+	bool		Sum(unsigned value, unsigned& total);
+
+private:
+	FluidDomain(const FluidDomain&);
+	FluidDomain& operator=(const FluidDomain&);
+
+	// True if x lies on the side of cut c towards the domain with the lower rank
+	bool		Below(float x, unsigned c) const;
+	// Copies particles into message, the ones with pick(x) set
+	template <typename F>
+	void		Pack(std::vector<unsigned char>& message, F pick);
+	// Adds the particles of message, returns how many
+	unsigned	Unpack(const std::vector<unsigned char>& message);
+
+	bool		ExchangeGhosts();
+	// Sends the particles outside of the slab to the neighbour on their side, sets moved to how many left
+	bool		Migrate(unsigned& moved);
+	bool		Rebalance();
+
+	FluidSimulator			simulator;
+	DomainTransport&		transport;
+	DomainSettings			settings;
+	DomainStats				stats;
+	std::vector<float>		cuts;			// Slab d is [cuts[d], cuts[d + 1])
+	unsigned				steps;
+	std::vector<ParticleHandle>	ghosts;		// Of the current step
+	std::vector<unsigned char>	outgoing;	// Scratch for the messages
+	std::vector<unsigned char>	incoming;
+};
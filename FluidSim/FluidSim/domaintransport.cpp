@@ -0,0 +1,489 @@
+#include "domaintransport.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <thread>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Writing to a domain that has hung up should fail, not raise SIGPIPE
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+#endif
+
+ThreadExchange::ThreadExchange(unsigned size) :
+	size(size),
+	mailboxes(size * size) {
+}
+
+void ThreadExchange::Post(unsigned from, unsigned to, const std::vector<unsigned char>& message) {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		mailboxes[from * size + to].push_back(message);
+	}
+	posted.notify_all();
+}
+
+void ThreadExchange::Take(unsigned from, unsigned to, std::vector<unsigned char>& message) {
+	std::unique_lock<std::mutex> lock(mutex);
+	std::deque<std::vector<unsigned char>>& mailbox = mailboxes[from * size + to];
+	posted.wait(lock, [&]() { return !mailbox.empty(); });
+	message.swap(mailbox.front());
+	mailbox.pop_front();
+}
+
+ThreadTransport::ThreadTransport(ThreadExchange& exchange, unsigned rank) :
+	exchange(exchange),
+	rank(rank) {
+}
+
+bool ThreadTransport::Send(unsigned to, const std::vector<unsigned char>& message) {
+	if (to >= GetSize() || to == rank) return false;
+	exchange.Post(rank, to, message);
+	return true;
+}
+
+bool ThreadTransport::Receive(unsigned from, std::vector<unsigned char>& message) {
+	if (from >= GetSize() || from == rank) return false;
+	exchange.Take(from, rank, message);
+	return true;
+}
+
+SocketTransport::SocketTransport() :
+	rank(0) {
+}
+
+SocketTransport::~SocketTransport() {
+	Close();
+}
+
+#ifdef _WIN32
+
+// Winsock has to be started once in the process before the first socket; it stays up until the process ends
+// Only Open calls this, from one thread
+static bool StartWinsock() {
+	static bool started = false;
+	WSADATA data;
+	if (!started) started = WSAStartup(MAKEWORD(2, 2), &data) == 0;
+	return started;
+}
+
+// File domain rank writes its port to
+static std::string PortFile(const std::string& path, unsigned rank) {
+	return path + "." + std::to_string(rank);
+}
+
+// Writes the port through a partial file, so the others never read half of it
+static bool WritePort(const std::string& name, unsigned short port) {
+	const std::string partial = name + ".partial";
+	{
+		std::ofstream out(partial.c_str(), std::ios::trunc);
+		out << port << std::endl;
+		if (!out) return false;
+	}
+	// rename does not replace existing files on Windows
+	std::remove(name.c_str());
+	if (std::rename(partial.c_str(), name.c_str()) != 0) {
+		std::remove(partial.c_str());
+		return false;
+	}
+	return true;
+}
+
+// Loopback address of the port in the file, false while the file is not there yet
+static bool ReadPort(const std::string& name, sockaddr_in& address) {
+	std::ifstream in(name.c_str());
+	unsigned port = 0;
+	in >> port;
+	if (!in || port == 0 || port > 65535) return false;
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	address.sin_port = htons((unsigned short)port);
+	return true;
+}
+
+// Reads or writes exactly bytes on a blocking socket, only used while connecting
+static bool ReadAll(SOCKET socket, void* data, int bytes) {
+	char* at = (char*)data;
+	while (bytes > 0) {
+		const int done = recv(socket, at, bytes, 0);
+		if (done <= 0) return false;
+		at += done;
+		bytes -= done;
+	}
+	return true;
+}
+
+static bool WriteAll(SOCKET socket, const void* data, int bytes) {
+	const char* at = (const char*)data;
+	while (bytes > 0) {
+		const int done = send(socket, at, bytes, 0);
+		if (done <= 0) return false;
+		at += done;
+		bytes -= done;
+	}
+	return true;
+}
+
+// Socket handles fit in 32 bits, so Peer keeps them in an int like the descriptors elsewhere
+static SOCKET Handle(int socket) {
+	return (SOCKET)(unsigned)socket;
+}
+
+bool SocketTransport::Open(const std::string& path, unsigned rank, unsigned size, unsigned timeoutSeconds) {
+	Close();
+	if (rank >= size || !StartWinsock()) return false;
+	this->rank = rank;
+	peers.resize(size);
+	for (unsigned p = 0; p < size; p++) {
+		peers[p].socket = -1;
+		peers[p].closed = false;
+		peers[p].written = 0;
+	}
+
+	// Listen on a free loopback port and tell the others which one through the file
+	const SOCKET listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	sockaddr_in address;
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	address.sin_port = 0;
+	int addressSize = sizeof(address);
+	const std::string name = PortFile(path, rank);
+	if (listener == INVALID_SOCKET || bind(listener, (const sockaddr*)&address, sizeof(address)) != 0 || listen(listener, (int)size) != 0
+		|| getsockname(listener, (sockaddr*)&address, &addressSize) != 0 || !WritePort(name, ntohs(address.sin_port))) {
+		if (listener != INVALID_SOCKET) closesocket(listener);
+		Close();
+		return false;
+	}
+	listenPath = name;
+
+	// Connect to the lower ranks, retrying until their files name a port that takes the connection
+	// Each connection starts with the rank of the one connecting and is answered with the rank of the one accepting,
+	// so a port left in the file by an earlier run is not taken for the domain
+	const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(timeoutSeconds);
+	bool connected = true;
+	for (unsigned p = 0; p < rank && connected; p++) {
+		for (;;) {
+			const SOCKET s = ReadPort(PortFile(path, p), address) ? socket(AF_INET, SOCK_STREAM, IPPROTO_TCP) : INVALID_SOCKET;
+			if (s != INVALID_SOCKET && connect(s, (const sockaddr*)&address, sizeof(address)) == 0) {
+				const long long left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+				const DWORD timeout = (DWORD)std::max(left, 1LL);
+				setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+				const unsigned hello = rank;
+				unsigned answer = size;
+				if (WriteAll(s, &hello, sizeof(hello)) && ReadAll(s, &answer, sizeof(answer)) && answer == p) {
+					peers[p].socket = (int)s;
+					break;
+				}
+			}
+			if (s != INVALID_SOCKET) closesocket(s);
+			if (std::chrono::steady_clock::now() > deadline) {
+				connected = false;
+				break;
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(20));
+		}
+	}
+
+	// Accept the higher ranks, waiting no longer than the deadline
+	for (unsigned accepted = rank + 1; accepted < size && connected; accepted++) {
+		WSAPOLLFD wait = { listener, POLLRDNORM, 0 };
+		const long long left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+		unsigned hello = size;
+		const SOCKET s = left > 0 && WSAPoll(&wait, 1, (int)left) == 1 ? accept(listener, 0, 0) : INVALID_SOCKET;
+		if (s == INVALID_SOCKET || !ReadAll(s, &hello, sizeof(hello)) || hello <= rank || hello >= size || peers[hello].socket >= 0
+			|| !WriteAll(s, &rank, sizeof(rank))) {
+			if (s != INVALID_SOCKET) closesocket(s);
+			connected = false;
+			break;
+		}
+		peers[hello].socket = (int)s;
+	}
+
+	// Everyone is connected, the port file is not needed any more
+	closesocket(listener);
+	std::remove(listenPath.c_str());
+	listenPath.clear();
+	if (!connected) {
+		Close();
+		return false;
+	}
+	// Messages are small and answered right away, so they should not wait for more to fill a packet
+	for (unsigned p = 0; p < size; p++) {
+		if (peers[p].socket < 0) continue;
+		u_long nonBlocking = 1;
+		const BOOL noDelay = TRUE;
+		ioctlsocket(Handle(peers[p].socket), FIONBIO, &nonBlocking);
+		setsockopt(Handle(peers[p].socket), IPPROTO_TCP, TCP_NODELAY, (const char*)&noDelay, sizeof(noDelay));
+	}
+	return true;
+}
+
+void SocketTransport::Close() {
+	// Let the others have what was sent to them before going away
+	bool pending = true;
+	while (pending) {
+		pending = false;
+		for (unsigned p = 0; p < peers.size(); p++)
+			if (peers[p].socket >= 0 && !peers[p].closed && peers[p].written < peers[p].outgoing.size()) pending = true;
+		if (pending && !Pump(true)) break;
+	}
+	for (unsigned p = 0; p < peers.size(); p++)
+		if (peers[p].socket >= 0) closesocket(Handle(peers[p].socket));
+	peers.clear();
+	if (!listenPath.empty()) std::remove(listenPath.c_str());
+	listenPath.clear();
+}
+
+// Writes and reads whatever the sockets take and have; with wait set, blocks until one of them does something
+bool SocketTransport::Pump(bool wait) {
+	std::vector<WSAPOLLFD> polls;
+	std::vector<unsigned> polled;
+	for (unsigned p = 0; p < peers.size(); p++) {
+		if (peers[p].socket < 0 || peers[p].closed) continue;
+		WSAPOLLFD entry = { Handle(peers[p].socket), POLLRDNORM, 0 };
+		if (peers[p].written < peers[p].outgoing.size()) entry.events |= POLLWRNORM;
+		polls.push_back(entry);
+		polled.push_back(p);
+	}
+	if (polls.empty()) return false;
+	if (WSAPoll(&polls[0], (ULONG)polls.size(), wait ? -1 : 0) == SOCKET_ERROR) return false;
+
+	char buffer[65536];
+	for (unsigned k = 0; k < polls.size(); k++) {
+		Peer& peer = peers[polled[k]];
+		if (polls[k].revents & POLLNVAL) return false;
+		if (polls[k].revents & POLLWRNORM) {
+			const int done = send(polls[k].fd, (const char*)&peer.outgoing[peer.written], (int)(peer.outgoing.size() - peer.written), 0);
+			const int error = done < 0 ? WSAGetLastError() : 0;
+			if (error == WSAECONNRESET || error == WSAECONNABORTED || error == WSAESHUTDOWN) peer.closed = true;
+			else if (done < 0 && error != WSAEWOULDBLOCK && error != WSAEINTR) return false;
+			if (done > 0) peer.written += done;
+			if (peer.written == peer.outgoing.size()) {
+				peer.outgoing.clear();
+				peer.written = 0;
+			}
+		}
+		if (polls[k].revents & (POLLRDNORM | POLLHUP | POLLERR)) {
+			const int done = recv(polls[k].fd, buffer, sizeof(buffer), 0);
+			const int error = done < 0 ? WSAGetLastError() : 0;
+			if (done == 0 || error == WSAECONNRESET || error == WSAECONNABORTED) peer.closed = true;
+			else if (done < 0 && error != WSAEWOULDBLOCK && error != WSAEINTR) return false;
+			if (done > 0) peer.incoming.insert(peer.incoming.end(), buffer, buffer + done);
+		}
+	}
+	return true;
+}
+
+#else
+
+// Address of the socket of domain rank
+static bool SocketAddress(const std::string& path, unsigned rank, sockaddr_un& address, std::string& name) {
+	name = path + "." + std::to_string(rank);
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (name.size() >= sizeof(address.sun_path)) return false;
+	memcpy(address.sun_path, name.c_str(), name.size());
+	return true;
+}
+
+// Reads or writes exactly bytes on a blocking socket, only used while connecting
+static bool ReadAll(int socket, void* data, size_t bytes) {
+	unsigned char* at = (unsigned char*)data;
+	while (bytes > 0) {
+		const ssize_t done = read(socket, at, bytes);
+		if (done <= 0) return false;
+		at += done;
+		bytes -= done;
+	}
+	return true;
+}
+
+static bool WriteAll(int socket, const void* data, size_t bytes) {
+	const unsigned char* at = (const unsigned char*)data;
+	while (bytes > 0) {
+		const ssize_t done = write(socket, at, bytes);
+		if (done <= 0) return false;
+		at += done;
+		bytes -= done;
+	}
+	return true;
+}
+
+bool SocketTransport::Open(const std::string& path, unsigned rank, unsigned size, unsigned timeoutSeconds) {
+	Close();
+	if (rank >= size) return false;
+	this->rank = rank;
+	peers.resize(size);
+	for (unsigned p = 0; p < size; p++) {
+		peers[p].socket = -1;
+		peers[p].closed = false;
+		peers[p].written = 0;
+	}
+
+	const int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	sockaddr_un address;
+	std::string name;
+	if (listener < 0 || !SocketAddress(path, rank, address, name)) {
+		if (listener >= 0) close(listener);
+		Close();
+		return false;
+	}
+	unlink(name.c_str());
+	if (bind(listener, (const sockaddr*)&address, sizeof(address)) != 0 || listen(listener, (int)size) != 0) {
+		close(listener);
+		Close();
+		return false;
+	}
+	listenPath = name;
+
+	// Connect to the lower ranks, retrying until they listen; each connection starts with the rank of the one connecting
+	const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(timeoutSeconds);
+	bool connected = true;
+	for (unsigned p = 0; p < rank && connected; p++) {
+		if (!SocketAddress(path, p, address, name)) {
+			connected = false;
+			break;
+		}
+		for (;;) {
+			const int s = socket(AF_UNIX, SOCK_STREAM, 0);
+			if (s >= 0 && connect(s, (const sockaddr*)&address, sizeof(address)) == 0) {
+				const unsigned hello = rank;
+				peers[p].socket = s;
+				connected = WriteAll(s, &hello, sizeof(hello));
+				break;
+			}
+			if (s >= 0) close(s);
+			if (std::chrono::steady_clock::now() > deadline) {
+				connected = false;
+				break;
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(20));
+		}
+	}
+
+	// Accept the higher ranks, waiting no longer than the deadline
+	for (unsigned accepted = rank + 1; accepted < size && connected; accepted++) {
+		pollfd wait = { listener, POLLIN, 0 };
+		const long long left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+		unsigned hello = size;
+		const int s = left > 0 && poll(&wait, 1, (int)left) == 1 ? accept(listener, 0, 0) : -1;
+		if (s < 0 || !ReadAll(s, &hello, sizeof(hello)) || hello <= rank || hello >= size || peers[hello].socket >= 0) {
+			if (s >= 0) close(s);
+			connected = false;
+			break;
+		}
+		peers[hello].socket = s;
+	}
+
+	// Everyone is connected, the socket file is not needed any more
+	close(listener);
+	unlink(listenPath.c_str());
+	listenPath.clear();
+	if (!connected) {
+		Close();
+		return false;
+	}
+	for (unsigned p = 0; p < size; p++)
+		if (peers[p].socket >= 0) fcntl(peers[p].socket, F_SETFL, fcntl(peers[p].socket, F_GETFL) | O_NONBLOCK);
+	return true;
+}
+
+void SocketTransport::Close() {
+	// Let the others have what was sent to them before going away
+	bool pending = true;
+	while (pending) {
+		pending = false;
+		for (unsigned p = 0; p < peers.size(); p++)
+			if (peers[p].socket >= 0 && !peers[p].closed && peers[p].written < peers[p].outgoing.size()) pending = true;
+		if (pending && !Pump(true)) break;
+	}
+	for (unsigned p = 0; p < peers.size(); p++)
+		if (peers[p].socket >= 0) close(peers[p].socket);
+	peers.clear();
+	if (!listenPath.empty()) unlink(listenPath.c_str());
+	listenPath.clear();
+}
+
+// Writes and reads whatever the sockets take and have; with wait set, blocks until one of them does something
+bool SocketTransport::Pump(bool wait) {
+	std::vector<pollfd> polls;
+	std::vector<unsigned> polled;
+	for (unsigned p = 0; p < peers.size(); p++) {
+		if (peers[p].socket < 0 || peers[p].closed) continue;
+		pollfd entry = { peers[p].socket, POLLIN, 0 };
+		if (peers[p].written < peers[p].outgoing.size()) entry.events |= POLLOUT;
+		polls.push_back(entry);
+		polled.push_back(p);
+	}
+	if (polls.empty()) return false;
+	if (poll(&polls[0], (nfds_t)polls.size(), wait ? -1 : 0) < 0) return errno == EINTR;
+
+	unsigned char buffer[65536];
+	for (unsigned k = 0; k < polls.size(); k++) {
+		Peer& peer = peers[polled[k]];
+		if (polls[k].revents & POLLNVAL) return false;
+		if (polls[k].revents & POLLOUT) {
+			const ssize_t done = send(peer.socket, &peer.outgoing[peer.written], peer.outgoing.size() - peer.written, MSG_NOSIGNAL);
+			if (done < 0 && errno == EPIPE) peer.closed = true;
+			else if (done < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) return false;
+			if (done > 0) peer.written += done;
+			if (peer.written == peer.outgoing.size()) {
+				peer.outgoing.clear();
+				peer.written = 0;
+			}
+		}
+		if (polls[k].revents & (POLLIN | POLLHUP | POLLERR)) {
+			const ssize_t done = read(peer.socket, buffer, sizeof(buffer));
+			if (done == 0 || (done < 0 && errno == ECONNRESET)) peer.closed = true;
+			else if (done < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) return false;
+			if (done > 0) peer.incoming.insert(peer.incoming.end(), buffer, buffer + done);
+		}
+	}
+	return true;
+}
+
+#endif
+
+bool SocketTransport::Send(unsigned to, const std::vector<unsigned char>& message) {
+	if (to >= peers.size() || peers[to].socket < 0 || peers[to].closed) return false;
+	const unsigned length = (unsigned)message.size();
+	std::vector<unsigned char>& outgoing = peers[to].outgoing;
+	outgoing.insert(outgoing.end(), (const unsigned char*)&length, (const unsigned char*)&length + sizeof(length));
+	outgoing.insert(outgoing.end(), message.begin(), message.end());
+	return Pump(false);
+}
+
+bool SocketTransport::Receive(unsigned from, std::vector<unsigned char>& message) {
+	if (from >= peers.size() || peers[from].socket < 0) return false;
+	while (!TakeMessage(peers[from], message))
+		if (peers[from].closed || !Pump(true)) return false;
+	return true;
+}
+
+// Moves the first message out of the bytes read so far, returns false if it has not fully arrived
+bool SocketTransport::TakeMessage(Peer& peer, std::vector<unsigned char>& message) {
+	unsigned length;
+	if (peer.incoming.size() < sizeof(length)) return false;
+	memcpy(&length, &peer.incoming[0], sizeof(length));
+	if (peer.incoming.size() - sizeof(length) < length) return false;
+	message.assign(peer.incoming.begin() + sizeof(length), peer.incoming.begin() + sizeof(length) + length);
+	peer.incoming.erase(peer.incoming.begin(), peer.incoming.begin() + sizeof(length) + length);
+	return true;
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Carries messages between the domains of a decomposed run, see FluidDomain
+// Messages from one domain to another arrive in the order they were sent; Send never waits for the receiver,
+// so every domain can send to all of its neighbours before it receives from any of them
+class DomainTransport {
+public:
+	virtual ~DomainTransport() {}
+
+	// This domain's rank in [0, GetSize())
+	virtual unsigned	GetRank() const = 0;
+	virtual unsigned	GetSize() const = 0;
+
+	// Returns false if the link to the other domain is broken
+	virtual bool		Send(unsigned to, const std::vector<unsigned char>& message) = 0;
+	// Waits for the next message from the other domain
+	virtual bool		Receive(unsigned from, std::vector<unsigned char>& message) = 0;
+};
+
+// The mailboxes of domains running on threads of one process, shared by their ThreadTransports
+class ThreadExchange {
+public:
+	explicit ThreadExchange(unsigned size);
+
+	unsigned	GetSize() const { return size; }
+
+	void		Post(unsigned from, unsigned to, const std::vector<unsigned char>& message);
+	void		Take(unsigned from, unsigned to, std::vector<unsigned char>& message);
+
+private:
+	ThreadExchange(const ThreadExchange&);
+	ThreadExchange& operator=(const ThreadExchange&);
+
+	unsigned	size;
+	std::mutex	mutex;
+	std::condition_variable	posted;
+	std::vector<std::deque<std::vector<unsigned char>>>	mailboxes;	// Messages from a to b in mailboxes[a * size + b]
+};
+
+// Transport between domains on threads of one process
+class ThreadTransport : public DomainTransport {
+public:
+	ThreadTransport(ThreadExchange& exchange, unsigned rank);
+
+	unsigned	GetRank() const override { return rank; }
+	unsigned	GetSize() const override { return exchange.GetSize(); }
+	bool		Send(unsigned to, const std::vector<unsigned char>& message) override;
+	bool		Receive(unsigned from, std::vector<unsigned char>& message) override;
+
+private:
+	ThreadExchange&	exchange;
+	unsigned		rank;
+};
+
+// Transport between domains in separate processes on one machine, over UNIX domain sockets named path.0, path.1, ...
+// On Windows, whose SDKs for the toolsets used here have no UNIX domain sockets, over loopback TCP instead: every
+// domain listens on a free port and writes its number to the file path.rank, which the others read to connect.
+// Every domain listens on its own socket and connects to those of the lower ranks, so the processes can start in any order.
+// Outgoing messages are buffered and written whenever the socket takes them, also while waiting in Receive,
+// so two domains sending each other large messages cannot block each other
+class SocketTransport : public DomainTransport {
+public:
+	SocketTransport();
+	~SocketTransport();
+
+	// Connects to the other size - 1 domains, waiting up to timeoutSeconds for them to come up
+	// Returns false if they could not all be reached
+	bool		Open(const std::string& path, unsigned rank, unsigned size, unsigned timeoutSeconds);
+	// Writes out what is still buffered and disconnects
+	void		Close();
+
+	unsigned	GetRank() const override { return rank; }
+	unsigned	GetSize() const override { return (unsigned)peers.size(); }
+	bool		Send(unsigned to, const std::vector<unsigned char>& message) override;
+	bool		Receive(unsigned from, std::vector<unsigned char>& message) override;
+
+private:
+	SocketTransport(const SocketTransport&);
+	SocketTransport& operator=(const SocketTransport&);
+
+	// A connection to one other domain
+	struct Peer {
+		int		socket;						// -1 for this domain itself; Windows socket handles fit in an int as well
+		bool	closed;						// The other domain has hung up, what it sent before can still be received
+		std::vector<unsigned char>	outgoing;	// Length prefixed messages not written yet
+		size_t	written;					// Bytes of outgoing already written
+		std::vector<unsigned char>	incoming;	// Bytes read but not taken by Receive yet
+	};
+
+	// Writes and reads whatever the sockets take and have; with wait set, blocks until one of them does something
+	bool		Pump(bool wait);
+	bool		TakeMessage(Peer& peer, std::vector<unsigned char>& message);
+
+	unsigned			rank;
+	std::vector<Peer>	peers;
+	std::string			listenPath;			// Socket file to remove, while it exists
+};
@@ -1,19 +1,17 @@
 #include "fluidsimulator.h"
 
 #include <algorithm>
+#include <cmath>
 #include <glm/gtx/norm.hpp>
-#include "kernels.h"
-#include <windows.h>
-#include <sstream>
+#include "kernelbatch.h"
+#include "profiler.h"
 #include <vector>
 //#include <stdio.h>
 #include <iostream>
 
-const float h = 25.f;			// SPH radius
-const float k = 3e8f;			// Pressure constant
-const float mu = 6e4f;			// Viscosity constant
-const float bounce = 0.4f;		// Collision response factor
-const float sigma = 10.f;		// Surface tension coefficient
+const float defaultH = 25.f;	// Default SPH radius
+const unsigned particleBlockSize = 256;	// Particles per block when a pass is split over threads
+const unsigned slicesPerThread = 4;		// Of the half pair passes, so that stealing evens out slices with more pairs
 
 FluidSimulator::FluidSimulator(const AABoundingBox& boundingBox) {
 	this->boundingBox = boundingBox;
@@ -21,134 +19,93 @@ FluidSimulator::FluidSimulator(const AABoundingBox& boundingBox) {
 	bodygravity = false;
 	wind = false;
 	surfaceTension = false;
-	initOctree();
+	useOctree = false;
+	collisionIterations = 100;
+	integrator = ExplicitEuler;
+	reorderDue = true;
+	pairMode = FullPairs;
+	pairSlices = 0;
+	pressureSolver.reset(new EquationOfStateSolver());
+	SetSmoothingLength(defaultH);
 }
 
 FluidSimulator::~FluidSimulator() {
 	Clear();
 }
 
-void FluidSimulator::initOctree(){
-	d1 = 3 + (int)floor(abs(boundingBox.right - boundingBox.left)/h);
-	d2 = 3 + (int)floor(abs(boundingBox.top - boundingBox.bottom)/h);
-	d3 = 3 + (int)floor(abs(boundingBox.front - boundingBox.back)/h);
-	c1 = (std::min(boundingBox.right, boundingBox.left));
-	c2 = (std::min(boundingBox.top, boundingBox.bottom));
-	c3 = (std::min(boundingBox.front, boundingBox.back));
-
-	this->octree.resize(d1*d2*d3);
-	//std::ostringstream os_;
-	//os_ << "initoctree : " << d1 << " " << d2 << " " << d3 << " " << this->octree.size();
-	//OutputDebugString(os_.str().c_str());
-	//for (unsigned i=0;i<octree.size();i++)
-		//this->octree[i].resize(0);
-	//OutputDebugString("initoctree : \n");
-
-	/*for (auto pi = particles.begin(); pi != particles.end(); pi++){
-
-		int pos = 1+(int)floor(((*pi)->position.x-c1)/h) + (1+(int)floor(((*pi)->position.y-c2)/h) + (1+(int)floor(((*pi)->position.z-c3)/h))*d2 )*d1;
-		
-		if (d1*d2*d3<=pos){
-			OutputDebugString("Hello world!");
-			std::cout << "hello ";
-			continue;
-		}
+// Particles are copied into the simulator's own storage
+ParticleHandle FluidSimulator::AddParticle(const Particle& particle) {
+	const unsigned i = particles.Add(particle);
+	ParticlesAdded();
+	return particles.GetHandle(i);
+}
 
-		(this->octree.at(pos)).push_back(*pi);
-		(*pi)->hashOctree = pos;
-		std::cout << "start ";
-		std::cout << " ; " << pos;
-
-		os_ << pos << " ; ";
-		OutputDebugString(os_.str().c_str());
-	}*/
-}
-
-void FluidSimulator::calculateOctree(){
-	for (auto pi = particles.begin(); pi != particles.end(); pi++){
-
-		int pos = 1+(int)floor(((*pi)->position.x-c1)/h) + (1+(int)floor(((*pi)->position.y-c2)/h) + (1+(int)floor(((*pi)->position.z-c3)/h))*d2 )*d1;
-		if (pos == (*pi)->hashOctree) continue;
-		/*std::ostringstream os_;
-		os_ << "pos " << pos << " octrr: " << (this->octree).size();
-		outputdebugstring(os_.str().c_str());*/
-		
-		/*if (d1*d2*d3<=pos){
-			OutputDebugString("Hello world!");
-			continue;
-		}*/
-		//char    buf[128];
-		//sprintf(buf, "Var: %d", pos);
-		//OutputDebugString(buf);
-		/*std::cout << "Pos: " << pos << ";" << std::endl;
-		std::cout << "size: " << this->octree.size() << std::endl;
-		std::cout << "curPos: " << (*pi)->hashOctree << std::endl;
-		if ((*pi)->hashOctree >= 0) std::cout << "octree(pos)Size" << (this->octree.at((*pi)->hashOctree)).size() << std::endl;
-		std::cout << "4: " << std::endl;*/
-
-		/*for (auto pip = this->octree.at((*pi)->hashOctree).begin(); pi != this->octree.at((*pi)->hashOctree).end(); pi++){
-			std::cout << (*pip)->hashOctree << " - ";
-		}
-		std::cout << std::endl;*/
+void FluidSimulator::AddParticles(const std::vector<Particle>& particles) {
+	if (!particles.empty()) AddParticles(&particles[0], (unsigned)particles.size());
+}
 
-		//std::cout << ""<<(*pi)->hashOctree << " - " << std::endl;
-		//std::cout << ""<<(((*pi)->hashOctree) >= 0) << " - " << std::endl;
-		//std::cout << ""<<(*pi)->hashOctree << " - " << std::endl;
+void FluidSimulator::AddParticles(const Particle* particles, unsigned count) {
+	AddParticles(count, [&](unsigned i, ParticleRef p) {
+		const Particle& particle = particles[i];
+		p.position = particle.position;
+		p.velocity = particle.velocity;
+		p.forceAccum = particle.forceAccum;
+		p.mass = particle.mass;
+		p.density = particle.density;
+		p.restDensity = particle.restDensity;
+		p.pressure = particle.pressure;
+		p.collision = particle.collision ? 1 : 0;
+	});
+}
 
-		if (((*pi)->hashOctree) >= 0){
-			//std::cout << (*pi)->hashOctree << std::endl;
-			(this->octree.at((*pi)->hashOctree)).erase(std::remove(this->octree.at((*pi)->hashOctree).begin(), this->octree.at((*pi)->hashOctree).end(), (*pi)), this->octree.at((*pi)->hashOctree).end());
-		}
+void FluidSimulator::ReserveParticles(unsigned count) {
+	particles.Reserve(count);
+}
 
-		(this->octree.at(pos)).push_back(*pi);
-		(*pi)->hashOctree = pos;
-	}
-	std::cout << std::endl;
-}
-
-void FluidSimulator::GetParticlesClose(Particle* pi, std::vector<Particle*>& particles){
-	//int pos = 1+(int)floor(pi->position.x/h) + (1+(int)floor(pi->position.y/h) + (1+(int)floor(pi->position.z/h))*d2 )*d1;
-	int pos = 1+(int)floor(((pi)->position.x-c1)/h) + (1+(int)floor(((pi)->position.y-c2)/h) + (1+(int)floor(((pi)->position.z-c3)/h))*d2 )*d1;
-	int pos2;
-	for (int i = -1; i <= 1; i++){
-		for (int j = -1; j <= 1; j++){
-			for (int k = -1; k <= 1; k++){
-				pos2 = pos + i + (j + k*d2 )*d1;
-				//int pos2 = 1+(int)floor(pi->position.x/h)+i + (1+(int)floor(pi->position.y/h)+j + (1+(int)floor(pi->position.z/h)+k)*d2 )*d1;
-				/*std::ostringstream os_;
-				os_ << "pos2 " << pos2 << " ijk: " << i << " " << j << " " << k << " posHash: " << (int)floor(pi->position.x/h) << " " << (int)floor(pi->position.y/h) << " " << (int)floor(pi->position.z/h);
-				OutputDebugString(os_.str().c_str());*/
-				for (auto p2 = octree.at(pos2).begin(); p2 != octree.at(pos2).end(); p2++)
-					particles.push_back(*p2);
-				
-				particles.reserve( particles.size() + octree.at(pos2).size() ); // preallocate memory
-				particles.insert( particles.end(), octree.at(pos2).begin(), octree.at(pos2).end() );
-			}
+void FluidSimulator::KillParticle(ParticleHandle handle) {
+	killed.push_back(handle);
+}
+
+void FluidSimulator::RemoveKilledParticles() {
+	if (killed.empty()) return;
+	PROFILE_SCOPE("RemoveKilledParticles");
+
+	// Handles of particles that are already gone, or killed twice, are skipped
+	killedMask.assign(particles.Size(), 0);
+	unsigned count = 0;
+	for (auto ki = killed.begin(); ki != killed.end(); ki++) {
+		unsigned i;
+		if (particles.Find(*ki, i) && !killedMask[i]) {
+			killedMask[i] = 1;
+			count++;
 		}
-	}
-	//particles = this->particles;
-//	return std::vector<Particle*>(); // TEMP FIX
+	}
+	killed.clear();
+	if (count == 0) return;
+	PROFILE_COUNT("particles removed", count);
+
+	particles.Remove(killedMask, remap);
+	neighbours.Remove(remap, particles.Size());
+	grid.Remove(remap);
 }
 
-// This class takes ownership of the particle pointers and will be the one to destroy them
-void FluidSimulator::AddParticle(Particle* particle) {
-	particles.push_back(particle);
+// New particles have no neighbours in the list yet; the pressure solver keeps the reference density it measured
+// The grid is a counting sort that the next neighbour update redoes in linear time, so that is all adding costs
+void FluidSimulator::ParticlesAdded() {
+	neighbours.Invalidate();
 }
 
-void FluidSimulator::AddParticles(const std::vector<Particle*>& particles) {
-	for (auto pi = particles.begin(); pi != particles.end(); pi++)
-		this->particles.push_back(*pi);
+// Bodies are copied into the simulator's own storage
+void FluidSimulator::AddBody(const Sphere& sphere) {
+	bodies.Add(sphere);
 }
 
-// This class takes ownership of the body pointers and will be the one to destroy them
-void FluidSimulator::AddBody(Body* body) {
-	bodies.push_back(body);
-	movingBody = body;
+void FluidSimulator::AddBody(const Box& box) {
+	bodies.Add(box);
 }
 
-void FluidSimulator::AddBodies(const std::vector<Body*>& bodies) {
-	for (auto pi = bodies.begin(); pi != bodies.end(); pi++)
-		this->bodies.push_back(*pi);
+void FluidSimulator::AddBody(const BoxRotating& box) {
+	bodies.Add(box);
 }
 
 void FluidSimulator::ToggleFluidGravity() {
@@ -159,12 +116,91 @@ void FluidSimulator::ToggleBodyGravity() {
 	bodygravity = !bodygravity;
 }
 
+void FluidSimulator::SetParameters(const FluidParameters& parameters) {
+	this->parameters = parameters;
+}
+
+void FluidSimulator::SetBoundingBox(const AABoundingBox& boundingBox) {
+	this->boundingBox = boundingBox;
+	grid.Init(boundingBox, kernels.GetH() + neighbours.GetSkin(), grid.GetStorage());
+	neighbours.Invalidate();
+}
+
+void FluidSimulator::SetGridStorage(GridStorage storage) {
+	grid.Init(boundingBox, kernels.GetH() + neighbours.GetSkin(), storage);
+	neighbours.Invalidate();
+}
+
+GridStorage FluidSimulator::GetGridStorage() const {
+	return grid.GetStorage();
+}
+
 void FluidSimulator::ToggleWind() {
 	wind = !wind;
 }
 
 void FluidSimulator::ToggleUseOctree() {
 	useOctree = !useOctree;
+	neighbours.Invalidate();
+}
+
+void FluidSimulator::SetSmoothingLength(float h) {
+	kernels.SetH(h);
+	grid.Init(boundingBox, h + neighbours.GetSkin(), grid.GetStorage());
+	neighbours.Invalidate();
+	pressureSolver->Reset();
+}
+
+float FluidSimulator::GetSmoothingLength() const {
+	return kernels.GetH();
+}
+
+// Neighbour candidates are searched within h + skin and reused until a particle moved more than skin / 2
+void FluidSimulator::SetNeighbourSkin(float skin) {
+	neighbours.SetSkin(skin);
+	grid.Init(boundingBox, kernels.GetH() + neighbours.GetSkin(), grid.GetStorage());
+}
+
+float FluidSimulator::GetNeighbourSkin() const {
+	return neighbours.GetSkin();
+}
+
+// The neighbour list only holds the pairs of one mode, so it is searched again
+void FluidSimulator::SetPairMode(PairMode mode) {
+	if (mode == pairMode) return;
+	pairMode = mode;
+	neighbours.Invalidate();
+}
+
+// Taken up by the next step
+void FluidSimulator::SetPairSlices(unsigned count) {
+	pairSlices = count;
+}
+
+// Number of threads the solver passes are split over, 1 runs everything on the calling thread
+// and 0 uses one thread per hardware thread
+// With full pairs every particle only writes its own values, so the results do not depend on the thread count;
+// half pairs add up per-slice sums in slice order, so theirs depend on the slice count only, see SetPairSlices
+void FluidSimulator::SetThreadCount(unsigned count) {
+	if (count == 0) count = std::thread::hardware_concurrency();
+	if (count == 0) count = 1;
+	if (count == GetThreadCount()) return;
+
+	threadPool.reset();
+	if (count > 1)
+		threadPool.reset(new ThreadPool(count));
+}
+
+unsigned FluidSimulator::GetThreadCount() const {
+	return threadPool ? threadPool->GetThreadCount() : 1;
+}
+
+void FluidSimulator::SetCollisionIterations(unsigned iterations) {
+	collisionIterations = iterations > 0 ? iterations : 1;
+}
+
+unsigned FluidSimulator::GetCollisionIterations() const {
+	return collisionIterations;
 }
 
 void FluidSimulator::ToggleSurfaceTension(){
@@ -173,98 +209,391 @@ void FluidSimulator::ToggleSurfaceTension(){
 
 // Do an explicit Euler time integration step
 void FluidSimulator::ExplicitEulerStep(float dt) {
-	// Clear force accumulators
-	for (auto pi = particles.begin(); pi != particles.end(); pi++)
-		(*pi)->forceAccum = glm::vec3(0.f, 0.f, 0.f);
-	for (auto bi = bodies.begin(); bi != bodies.end(); bi++)
-		(*bi)->forceAccum = glm::vec3(0.f, 0.f, 0.f);
+	RemoveKilledParticles();
+	ClearForces();
+	ApplyAllForces(dt);
+	FinishStep(dt, ExplicitEuler);
+}
+
+// Do a symplectic Euler time integration step
+void FluidSimulator::SymplecticEulerStep(float dt) {
+	RemoveKilledParticles();
+	ClearForces();
+	ApplyAllForces(dt);
+	FinishStep(dt, SymplecticEuler);
+}
+
+void FluidSimulator::SetIntegrator(Integrator integrator) {
+	this->integrator = integrator;
+}
+
+Integrator FluidSimulator::GetIntegrator() const {
+	return integrator;
+}
+
+void FluidSimulator::SetPressureSolver(std::unique_ptr<PressureSolver> solver) {
+	if (solver) pressureSolver = std::move(solver);
+}
+
+// Moves the simulation forward by frameDt in as many substeps as the time step limits ask for
+void FluidSimulator::Advance(float frameDt) {
+	timeStepStats = TimeStepStats();
+	float remaining = frameDt;
+	while (remaining > 0.f) {
+		RemoveKilledParticles();
+
+		// The forces come first, the accelerations they cause are one of the limits
+		// An explicit pressure solver's forces count as well; an implicit one is solved for the step that is chosen
+		ClearForces();
+		ApplyNonPressureForces();
+		const bool explicitPressure = pressureSolver->IsExplicit();
+		if (explicitPressure) pressureSolver->Solve(*this, 0.f);
 
-	// Apply forces
-	ApplyAllForces();
+		float dt = StableTimeStep();
+		if (dt >= remaining || timeStepStats.substeps + 1 >= timeStepSettings.maxSubsteps)
+			dt = remaining;
+		else if (2.f * dt > remaining)
+			dt = 0.5f * remaining;	// Two even substeps instead of a full one and a sliver
+		if (!explicitPressure) pressureSolver->Solve(*this, dt);
+		FinishStep(dt, integrator);
 
-	// Fix collisions
-	DetectAndRespondCollisions(dt);
+		timeStepStats.substeps++;
+		timeStepStats.dt = dt;
+		remaining = dt == remaining ? 0.f : remaining - dt;
+	}
+}
 
-	// Update positions and velocity
-	for (auto pi = particles.begin(); pi != particles.end(); pi++) {
-		Particle* p = *pi;
-		p->position += p->velocity * dt;
-		p->velocity += (p->forceAccum / p->mass) * dt;
+// Runs one step once the forces are known: collisions and integration
+void FluidSimulator::FinishStep(float dt, Integrator integrator) {
+	if (integrator == SymplecticEuler) {
+		// The collisions have to see the velocity the particles will actually move with
+		Accelerate(dt);
+		DetectAndRespondCollisions(dt);
+		Move(dt);
+	} else {
+		DetectAndRespondCollisions(dt);
+		Move(dt);
+		Accelerate(dt);
 	}
-	// Update positions, rotations and velocity
-	for (auto bi = bodies.begin(); bi != bodies.end(); bi++) {
+
+	PROFILE_END_STEP();
+}
+
+// Clear force accumulators
+void FluidSimulator::ClearForces() {
+	std::fill(particles.forceAccum.begin(), particles.forceAccum.end(), glm::vec3(0.f, 0.f, 0.f));
+	for (auto bi = bodies.GetAll().begin(); bi != bodies.GetAll().end(); bi++)
+		(*bi)->forceAccum = glm::vec3(0.f, 0.f, 0.f);
+}
+
+// Moves the particles and bodies forward by dt with their current velocities
+void FluidSimulator::Move(float dt) {
+	PROFILE_SCOPE("Move");
+	ForParticles(particles.Size(), [&](unsigned begin, unsigned end) {
+		for (unsigned i = begin; i < end; i++)
+			particles.position[i] += particles.velocity[i] * dt;
+	});
+	for (auto bi = bodies.GetAll().begin(); bi != bodies.GetAll().end(); bi++) {
 		Body* b = *bi;
 		b->center += b->velocity * dt;
-		b->velocity += (b->forceAccum / b->mass) * dt;
 		b->rotation = b->rotation + b->omega *dt;
+		b->UpdateTransform();
 		//b->omega /= 2;
 	}
+}
 
+// Updates the velocities of the particles and bodies with the forces
+void FluidSimulator::Accelerate(float dt) {
+	PROFILE_SCOPE("Accelerate");
+	ForParticles(particles.Size(), [&](unsigned begin, unsigned end) {
+		for (unsigned i = begin; i < end; i++)
+			particles.velocity[i] += (particles.forceAccum[i] / particles.mass[i]) * dt;
+	});
+	for (auto bi = bodies.GetAll().begin(); bi != bodies.GetAll().end(); bi++) {
+		Body* b = *bi;
+		b->velocity += (b->forceAccum / b->mass) * dt;
+	}
 }
 
-// Removes all particles
-void FluidSimulator::Clear() {
-	// Free reserved memory
-	for (auto pi = particles.begin(); pi != particles.end(); pi++)
-		delete *pi;
-	particles.clear();
-	// Free reserved memory
-	for (auto pi = bodies.begin(); pi != bodies.end(); pi++)
-		delete *pi;
-	bodies.clear();
+// Largest dt the time step limits allow for the current velocities and forces
+// Speeds and accelerations are compared squared, so the loop needs no square roots
+float FluidSimulator::StableTimeStep() {
+	PROFILE_SCOPE("StableTimeStep");
+	const TimeStepSettings& s = timeStepSettings;
+	const float h = kernels.GetH();
+
+	float maxSpeed2 = 0.f, maxAcceleration2 = 0.f, maxRate = 0.f;
+	for (unsigned i = 0; i < particles.Size(); i++) {
+		const glm::vec3 a = particles.forceAccum[i] / particles.mass[i];
+		maxSpeed2 = std::max(maxSpeed2, glm::dot(particles.velocity[i], particles.velocity[i]));
+		maxAcceleration2 = std::max(maxAcceleration2, glm::dot(a, a));
+	}
+	// The particles bounce off the bodies, so a fast body counts as well
+	for (auto bi = bodies.GetAll().begin(); bi != bodies.GetAll().end(); bi++)
+		maxSpeed2 = std::max(maxSpeed2, glm::dot((*bi)->velocity, (*bi)->velocity));
+	for (unsigned i = 0; i < viscosityRate.size(); i++)
+		maxRate = std::max(maxRate, viscosityRate[i]);
+
+	timeStepStats.cflDt = maxSpeed2 > 0.f ? s.cflFactor * h / sqrt(maxSpeed2) : s.maxDt;
+	timeStepStats.forceDt = maxAcceleration2 > 0.f ? s.forceFactor * sqrt(h / sqrt(maxAcceleration2)) : s.maxDt;
+	timeStepStats.viscosityDt = maxRate > 0.f ? s.viscosityFactor / maxRate : s.maxDt;
+
+	const float dt = std::min(timeStepStats.cflDt, std::min(timeStepStats.forceDt, timeStepStats.viscosityDt));
+	return std::max(s.minDt, std::min(s.maxDt, dt));
 }
 
-// Removes all particles from octree
-void FluidSimulator::clearOctree() {
-	// Free reserved memory
-	for (auto pi = octree.begin(); pi != octree.end(); pi++)
-		(*pi).clear();
+// Removes all particles
+void FluidSimulator::Clear() {
+	particles.Clear();
+	killed.clear();
+	neighbours.Invalidate();
+	reorderDue = true;
+	pressureSolver->Reset();
+	bodies.Clear();
 }
 
-std::vector<Particle*>&	FluidSimulator::GetParticles() {
+ParticleStore& FluidSimulator::GetParticles() {
 	return particles;
 }
 
-std::vector<Body*>&	FluidSimulator::GetBodies() {
+BodyStore& FluidSimulator::GetBodies() {
 	return bodies;
 }
 
-void FluidSimulator::CalculateDensities() {
-	// Clear density
-	for (auto pi = particles.begin(); pi != particles.end(); pi++)
-		(*pi)->density = (*pi)->restDensity;
+Body* FluidSimulator::GetMovingBody() {
+	return bodies.GetLast();
+}
 
-	// For every particle
-	for (unsigned i = 0; i < particles.size(); i++)  {
-		Particle* pi = particles[i];
+// Calls body(begin, end) over blocks of particles [0, count), on the thread pool if there is one
+void FluidSimulator::ForParticles(unsigned count, const std::function<void(unsigned, unsigned)>& body) {
+	if (threadPool)
+		threadPool->ParallelFor(count, particleBlockSize, body);
+	else if (count > 0)
+		body(0, count);
+}
 
-		// Calculate density from every other particle
-		for (unsigned j = i+1; j < particles.size(); j++) {
-			Particle* pj = particles[j];
+// Number of bits set
+static unsigned PopCount(unsigned long long x) {
+	x = x - ((x >> 1) & 0x5555555555555555ull);
+	x = (x & 0x3333333333333333ull) + ((x >> 2) & 0x3333333333333333ull);
+	x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0full;
+	return (unsigned)((x * 0x0101010101010101ull) >> 56);
+}
 
-			float rSquared = glm::length2(pi->position - pj->position);
-			float kernel = KernelPoly6(rSquared, h);
-			pi->density += particles[j]->mass * kernel;
-			pj->density += particles[i]->mass * kernel;
+// Calls body(slice, begin, end) for the slices of the last UpdateSlices, each on a single thread
+void FluidSimulator::ForParticleSlices(const std::function<void(unsigned, unsigned, unsigned)>& body) {
+	auto run = [&](unsigned first, unsigned last) {
+		for (unsigned s = first; s < last; s++) {
+			const ReductionSlice& slice = sliceLayout.slices[s];
+			if (slice.begin < slice.end) body(s, slice.begin, slice.end);
 		}
+	};
+	if (threadPool)
+		threadPool->ParallelFor((unsigned)sliceLayout.slices.size(), 1, run);
+	else
+		run(0, (unsigned)sliceLayout.slices.size());
+}
+
+// Splits the particles into the slices of the half pair passes and finds the particles outside of every slice its
+// pairs add to; with the particles in Morton order most pairs stay within their slice
+void FluidSimulator::UpdateSlices() {
+	PROFILE_SCOPE("UpdateSlices");
+	const unsigned n = particles.Size();
+	unsigned count = pairSlices > 0 ? pairSlices : GetThreadCount() > 1 ? slicesPerThread * GetThreadCount() : 1;
+	count = std::max(1u, std::min(count, n));
+	std::vector<ReductionSlice>& slices = sliceLayout.slices;
+	slices.resize(count);
+	for (unsigned s = 0; s < count; s++) {
+		slices[s].begin = (unsigned)((unsigned long long)n * s / count);
+		slices[s].end = (unsigned)((unsigned long long)n * (s + 1) / count);
+		slices[s].outside.clear();
 	}
+	if (count == 1) return;
+
+	// The outside particles of a slice are marked in a bitmap over the range they span, which lists them in order,
+	// and the place of one is the number of marks before it
+	std::vector<unsigned>& slot = sliceLayout.slot;
+	slot.resize(neighbours.index.size());
+	ForParticleSlices([&](unsigned slice, unsigned begin, unsigned end) {
+		unsigned low = n, high = 0;
+		for (unsigned i = begin; i < end; i++) {
+			for (unsigned k = neighbours.Begin(i); k < neighbours.End(i); k++) {
+				const unsigned j = neighbours.index[k];
+				if (j >= begin && j < end) continue;
+				low = std::min(low, j);
+				high = std::max(high, j + 1);
+			}
+		}
+		if (low >= high) return;
+
+		std::vector<unsigned long long> marks((high - low + 63) / 64, 0);
+		for (unsigned i = begin; i < end; i++) {
+			for (unsigned k = neighbours.Begin(i); k < neighbours.End(i); k++) {
+				const unsigned j = neighbours.index[k];
+				if (j < begin || j >= end) marks[(j - low) / 64] |= 1ull << ((j - low) % 64);
+			}
+		}
+
+		std::vector<unsigned>& outside = slices[slice].outside;
+		std::vector<unsigned> before(marks.size());
+		for (unsigned w = 0; w < marks.size(); w++) {
+			before[w] = (unsigned)outside.size();
+			unsigned j = low + 64 * w;
+			for (unsigned long long word = marks[w]; word != 0; word >>= 1, j++)
+				if (word & 1) outside.push_back(j);
+		}
+
+		for (unsigned i = begin; i < end; i++) {
+			for (unsigned k = neighbours.Begin(i); k < neighbours.End(i); k++) {
+				const unsigned j = neighbours.index[k];
+				if (j >= begin && j < end) continue;
+				const unsigned w = (j - low) / 64;
+				slot[k] = before[w] + PopCount(marks[w] & ((1ull << ((j - low) % 64)) - 1));
+			}
+		}
+	});
+}
+
+// Finds the neighbours of every particle, once per step
+void FluidSimulator::UpdateNeighbours() {
+	PROFILE_SCOPE("UpdateNeighbours");
+
+	if (neighbours.NeedsRebuild(particles)) {
+		PROFILE_SCOPE("NeighbourSearch");
+		PROFILE_COUNT("neighbour searches", 1);
+
+		// Sort the particles into the grid before searching, and into memory as well once they have mixed too much
+		bool reorder = false;
+		if (useOctree) {
+			PROFILE_SCOPE("GridBuild");
+			reorder = reorderDue || reorderStats.locality < reorderSettings.threshold * reorderStats.baseline;
+			grid.Build(particles, reorder);
+			if (reorder) {
+				PROFILE_COUNT("particle reorders", 1);
+				reorderStats.reorders++;
+				reorderStats.interval = reorderStats.searches;
+				reorderStats.searches = 0;
+				reorderDue = false;
+			}
+#ifdef FLUIDSIM_PROFILE
+			unsigned occupiedCells, maxPerCell;
+			grid.GetOccupancy(occupiedCells, maxPerCell);
+			PROFILE_COUNT("occupied grid cells", occupiedCells);
+			PROFILE_MAX("most particles in a grid cell", maxPerCell);
+#endif
+		}
+
+		const float radius = kernels.GetH() + neighbours.GetSkin();
+		const float radiusSquared = radius * radius;
+		const glm::vec3* position = particles.Empty() ? 0 : &particles.position[0];
+
+		neighbours.BeginBuild(particles, particleBlockSize);
+		ForParticles(particles.Size(), [&](unsigned begin, unsigned end) {
+			for (unsigned i = begin; i < end; i++) {
+				auto add = [&](unsigned j) {
+					if (glm::length2(position[i] - position[j]) <= radiusSquared)
+						neighbours.AddCandidate(i, j);
+				};
+				if (pairMode == HalfPairs) ForEachHalfNeighbour(i, add);
+				else ForEachNeighbour(i, add);
+			}
+		});
+		neighbours.EndBuild();
+
+		if (useOctree) {
+			reorderStats.searches++;
+			reorderStats.locality = neighbours.Locality(reorderSettings.window);
+			if (reorder) reorderStats.baseline = reorderStats.locality;
+			PROFILE_MAX("neighbour locality", reorderStats.locality);
+		}
+	}
+
+	PROFILE_SCOPE("NeighbourRefresh");
+	neighbours.PrepareRefresh();
+	ForParticles(particles.Size(), [&](unsigned begin, unsigned end) {
+		neighbours.Refresh(particles, kernels.GetH(), begin, end);
+	});
+	PROFILE_COUNT("neighbour pairs visited", neighbours.CandidateCount());
+	PROFILE_COUNT("neighbour pairs within h", neighbours.PairCount());
+
+	if (pairMode == HalfPairs) UpdateSlices();
 }
 
-void FluidSimulator::CalculatePressures() {
-	for (auto pi = particles.begin(); pi != particles.end(); pi++) {
-		Particle* p = *pi;
-		p->pressure = k * (p->density - p->restDensity);
+void FluidSimulator::CalculateDensities() {
+	PROFILE_SCOPE("CalculateDensities");
+	if (particles.Empty()) return;
+	const float* mass = &particles.mass[0];
+	const float* restDensity = &particles.restDensity[0];
+	float* density = &particles.density[0];
+	const unsigned n = particles.Size();
+
+	if (pairMode == HalfPairs) {
+		ForParticles(n, [&](unsigned begin, unsigned end) {
+			for (unsigned i = begin; i < end; i++)
+				density[i] = restDensity[i];
+		});
+
+		// Every pair adds to both particles
+		scalarBuffer.Prepare(sliceLayout, 0.f);
+		ForParticleSlices([&](unsigned slice, unsigned begin, unsigned end) {
+			auto sum = scalarBuffer.Get(slice, density);
+			for (unsigned i = begin; i < end; i++)  {
+				const unsigned first = neighbours.Begin(i), last = neighbours.End(i);
+				if (first == last) continue;
+				float* w = &neighbours.weight[first];
+				KernelPoly6Batch(&neighbours.length[first], w, last - first, kernels);
+
+				float d = 0.f;
+				for (unsigned k = first; k < last; k++) {
+					const unsigned j = neighbours.index[k];
+					d += mass[j] * w[k - first];
+					sum(j, k) += mass[i] * w[k - first];
+				}
+				sum[i] += d;
+			}
+		});
+		ForParticles(n, [&](unsigned begin, unsigned end) {
+			scalarBuffer.Reduce(density, begin, end, 0.f);
+		});
+		return;
 	}
+
+	// For every particle
+	ForParticles(n, [&](unsigned begin, unsigned end) {
+		for (unsigned i = begin; i < end; i++)  {
+			float d = restDensity[i];
+			const unsigned first = neighbours.Begin(i), last = neighbours.End(i);
+			if (first == last) { density[i] = d; continue; }
+			float* w = &neighbours.weight[first];
+			KernelPoly6Batch(&neighbours.length[first], w, last - first, kernels);
+
+			// Calculate density from every neighbour
+			for (unsigned k = first; k < last; k++)
+				d += mass[neighbours.index[k]] * w[k - first];
+			density[i] = d;
+		}
+	});
+}
+
+void FluidSimulator::CalculatePressures() {
+	PROFILE_SCOPE("CalculatePressures");
+	ForParticles(particles.Size(), [&](unsigned begin, unsigned end) {
+		for (unsigned i = begin; i < end; i++)
+			particles.pressure[i] = parameters.k * (particles.density[i] - particles.restDensity[i]);
+	});
+}
+
+void FluidSimulator::ApplyAllForces(float dt) {
+	ApplyNonPressureForces();
+	pressureSolver->Solve(*this, dt);
 }
 
-void FluidSimulator::ApplyAllForces() {
+// The pressure solver comes last, it may need the other forces to predict where the particles go
+void FluidSimulator::ApplyNonPressureForces() {
+	UpdateNeighbours();
+
 	CalculateDensities();
-	CalculatePressures();
 
-	if (useOctree){
-		calculateOctree();
-	}
-	ApplyPressureForces();
 	ApplyGravityForces();
 	if (wind) ApplyWindForces();
 	ApplyViscosityForces();
@@ -272,159 +601,236 @@ void FluidSimulator::ApplyAllForces() {
 }
 
 void FluidSimulator::ApplyPressureForces() {
-	if (!useOctree){
-		// For every particle
-		for (unsigned i = 0; i < particles.size(); i++) {
-			Particle* pi = particles[i];
-
-			// Compute pressure force from every other particle
-			for (unsigned j = i+1; j < particles.size(); j++) {
-				Particle* pj = particles[j];
-
-				if (abs(pj->density) < 1e-8f || abs(pi->density) < 1e-8f) continue; // Prevent division by 0
-
-				const glm::vec3 r = pi->position - pj->position;
-				if (glm::length(r) < 1e-8f) continue;
-
-				pi->forceAccum -= pj->mass * ((pi->pressure + pj->pressure) / (2.f * pj->density)) * KernelSpikyGradient(r, h);
-				pj->forceAccum -= pi->mass * ((pi->pressure + pj->pressure) / (2.f * pi->density)) * KernelSpikyGradient(-r, h);
+	PROFILE_SCOPE("ApplyPressureForces");
+	if (particles.Empty()) return;
+	const float* mass = &particles.mass[0];
+	const float* density = &particles.density[0];
+	const float* pressure = &particles.pressure[0];
+	glm::vec3* forceAccum = &particles.forceAccum[0];
+	const unsigned n = particles.Size();
+
+	if (pairMode == HalfPairs) {
+		// The gradient turns around from j's side, so j gets the same term in the other direction, weighted by i
+		vectorBuffer.Prepare(sliceLayout, glm::vec3(0.f));
+		ForParticleSlices([&](unsigned slice, unsigned begin, unsigned end) {
+			auto force = vectorBuffer.Get(slice, forceAccum);
+			for (unsigned i = begin; i < end; i++) {
+				if (fabs(density[i]) < 1e-8f) continue; // Prevent division by 0
+				const unsigned first = neighbours.Begin(i), last = neighbours.End(i);
+				if (first == last) continue;
+				float* w = &neighbours.weight[first];
+				KernelSpikyGradientBatch(&neighbours.length[first], w, last - first, kernels);
+
+				glm::vec3 fi(0.f);
+				for (unsigned k = first; k < last; k++) {
+					const unsigned j = neighbours.index[k];
+					if (fabs(density[j]) < 1e-8f) continue; // Prevent division by 0
+
+					const glm::vec3 g = ((pressure[i] + pressure[j]) * 0.5f * w[k - first]) * neighbours.r[k];
+					fi -= mass[j] / density[j] * g;
+					force(j, k) += mass[i] / density[i] * g;
+				}
+				force[i] += fi;
 			}
-		}
-	}else{
-		std::vector<Particle*> closeParticles;
-		// For every particle
-		for (unsigned i = 0; i < particles.size(); i++) {
-			Particle* pi = particles[i];
-
-			GetParticlesClose(pi, closeParticles);
-			// Compute pressure force from every other particle
-			for (unsigned j = 0; j < closeParticles.size(); j++) {
-				Particle* pj = closeParticles[j];
-
-				if (abs(pj->density) < 1e-8f || abs(pi->density) < 1e-8f) continue; // Prevent division by 0
-
-				const glm::vec3 r = pi->position - pj->position;
-				if (glm::length(r) < 1e-8f) continue;
+		});
+		ForParticles(n, [&](unsigned begin, unsigned end) {
+			vectorBuffer.Reduce(forceAccum, begin, end, glm::vec3(0.f));
+		});
+		return;
+	}
 
-				pi->forceAccum -= pj->mass * ((pi->pressure + pj->pressure) / (2.f * pj->density)) * KernelSpikyGradient(r, h);
+	// For every particle
+	ForParticles(n, [&](unsigned begin, unsigned end) {
+		for (unsigned i = begin; i < end; i++) {
+			if (fabs(density[i]) < 1e-8f) continue; // Prevent division by 0
+			const unsigned first = neighbours.Begin(i), last = neighbours.End(i);
+			if (first == last) continue;
+			// Coincident particles get a 0 gradient
+			float* w = &neighbours.weight[first];
+			KernelSpikyGradientBatch(&neighbours.length[first], w, last - first, kernels);
+
+			// Compute pressure force from every neighbour
+			for (unsigned k = first; k < last; k++) {
+				const unsigned j = neighbours.index[k];
+				if (fabs(density[j]) < 1e-8f) continue; // Prevent division by 0
+
+				forceAccum[i] -= mass[j] * ((pressure[i] + pressure[j]) / (2.f * density[j])) * w[k - first] * neighbours.r[k];
 			}
 		}
-	}
+	});
 }
 
 void FluidSimulator::ApplyViscosityForces() {
-	if (!useOctree){
-		// For every particle
-		for (unsigned i = 0; i < particles.size(); i++) {
-			Particle* pi = particles[i];
-
-			// Compute viscosity force from every other particle
-			for (unsigned j = i+1; j < particles.size(); j++) {
-				Particle* pj = particles[j];
-
-				const glm::vec3 r = pi->position - pj->position;
-				const glm::vec3 v = pj->velocity - pi->velocity;
-
-				pi->forceAccum += mu * pj->mass * (v / pj->density) * KernelViscosityLaplacian(r, h);
-				pj->forceAccum += mu * pi->mass * (-v / pi->density) * KernelViscosityLaplacian(-r, h);
+	PROFILE_SCOPE("ApplyViscosityForces");
+	viscosityRate.resize(particles.Size());
+	if (particles.Empty()) return;
+	const glm::vec3* velocity = &particles.velocity[0];
+	const float* mass = &particles.mass[0];
+	const float* density = &particles.density[0];
+	glm::vec3* forceAccum = &particles.forceAccum[0];
+	const unsigned n = particles.Size();
+
+	if (pairMode == HalfPairs) {
+		std::fill(viscosityRate.begin(), viscosityRate.end(), 0.f);
+
+		// The velocity difference turns around from j's side, the Laplacian does not
+		vectorBuffer.Prepare(sliceLayout, glm::vec3(0.f));
+		scalarBuffer.Prepare(sliceLayout, 0.f);
+		ForParticleSlices([&](unsigned slice, unsigned begin, unsigned end) {
+			auto force = vectorBuffer.Get(slice, forceAccum);
+			auto rate = scalarBuffer.Get(slice, &viscosityRate[0]);
+			for (unsigned i = begin; i < end; i++) {
+				const unsigned first = neighbours.Begin(i), last = neighbours.End(i);
+				if (first == last) continue;
+				float* w = &neighbours.weight[first];
+				KernelViscosityLaplacianBatch(&neighbours.length[first], w, last - first, kernels);
+
+				glm::vec3 fi(0.f);
+				float ri = 0.f;
+				for (unsigned k = first; k < last; k++) {
+					const unsigned j = neighbours.index[k];
+					const glm::vec3 v = velocity[j] - velocity[i];
+					const float wi = mass[j] / density[j] * w[k - first];
+					const float wj = mass[i] / density[i] * w[k - first];
+
+					fi += wi * v;
+					force(j, k) -= parameters.mu * wj * v;
+					ri += wi;
+					rate(j, k) += wj;
+				}
+				force[i] += parameters.mu * fi;
+				rate[i] += ri;
 			}
-		}
-	}else{
-		std::vector<Particle*> closeParticles;
-		// For every particle
-		for (unsigned i = 0; i < particles.size(); i++) {
-			Particle* pi = particles[i];
-
-			GetParticlesClose(pi, closeParticles);
-			// Compute viscosity force from every particle close by
-			for (unsigned j = 0; j < closeParticles.size(); j++) {
-				Particle* pj = closeParticles[j];
-
-				const glm::vec3 r = pi->position - pj->position;
-				const glm::vec3 v = pj->velocity - pi->velocity;
+		});
+		ForParticles(n, [&](unsigned begin, unsigned end) {
+			vectorBuffer.Reduce(forceAccum, begin, end, glm::vec3(0.f));
+			scalarBuffer.Reduce(&viscosityRate[0], begin, end, 0.f);
+			for (unsigned i = begin; i < end; i++)
+				viscosityRate[i] *= parameters.mu / mass[i];
+		});
+		return;
+	}
 
-				pi->forceAccum += mu * pj->mass * (v / pj->density) * KernelViscosityLaplacian(r, h);
+	// For every particle
+	ForParticles(n, [&](unsigned begin, unsigned end) {
+		for (unsigned i = begin; i < end; i++) {
+			const unsigned first = neighbours.Begin(i), last = neighbours.End(i);
+			viscosityRate[i] = 0.f;
+			if (first == last) continue;
+			float* w = &neighbours.weight[first];
+			KernelViscosityLaplacianBatch(&neighbours.length[first], w, last - first, kernels);
+
+			// Compute viscosity force from every neighbour
+			float rate = 0.f;
+			for (unsigned k = first; k < last; k++) {
+				const unsigned j = neighbours.index[k];
+				const glm::vec3 v = velocity[j] - velocity[i];
+
+				forceAccum[i] += parameters.mu * mass[j] * (v / density[j]) * w[k - first];
+				rate += mass[j] / density[j] * w[k - first];
 			}
+			// The force pulls the velocity towards the neighbours' at this rate; a step longer than its inverse overshoots
+			viscosityRate[i] = parameters.mu * rate / mass[i];
 		}
-	}
+	});
 }
 
 void FluidSimulator::ApplySurfaceTensionForces() {
-	float lenThreshold = 1e-8f;
-	bool notOctree = true;
-	if (!useOctree || notOctree){
-		// For every particle
-		for (unsigned i = 0; i < particles.size(); i++) {
-			Particle* pi = particles[i];
-
-			glm::vec3 gradCs = glm::vec3(0,0,0);
-			float laplaceCs = 0;
-
-			// Compute surfaceTension force from every other particle
-			for (unsigned j = 0; j < particles.size(); j++) {
-				if (j != i){
-					Particle* pj = particles[j];
-					const glm::vec3 r = pi->position - pj->position;
-					float laplace = 0;
-
-					float rSquared = glm::length2(pi->position - pj->position);
-					glm::vec3 grad = KernelPoly6GradientLaplacian(r,h,laplace);
-
-					gradCs += pj->mass / pj->density * grad;
-					laplaceCs += pj->mass / pj->density * laplace;
-
+	PROFILE_SCOPE("ApplySurfaceTensionForces");
+	if (particles.Empty()) return;
+	const float* mass = &particles.mass[0];
+	const float* density = &particles.density[0];
+	glm::vec3* forceAccum = &particles.forceAccum[0];
+
+	const float lenThreshold = 1e-8f;
+	const unsigned n = particles.Size();
+
+	if (pairMode == HalfPairs) {
+		colourGradient.assign(n, glm::vec3(0.f));
+		colourLaplacian.assign(n, 0.f);
+
+		// Sum the colour field gradient and Laplacian of every particle over the pairs first, the gradient turns
+		// around from j's side and the Laplacian does not
+		vectorBuffer.Prepare(sliceLayout, glm::vec3(0.f));
+		scalarBuffer.Prepare(sliceLayout, 0.f);
+		ForParticleSlices([&](unsigned slice, unsigned begin, unsigned end) {
+			auto gradCs = vectorBuffer.Get(slice, &colourGradient[0]);
+			auto laplaceCs = scalarBuffer.Get(slice, &colourLaplacian[0]);
+			for (unsigned i = begin; i < end; i++) {
+				const unsigned first = neighbours.Begin(i), last = neighbours.End(i);
+				if (first == last) continue;
+				float* grad = &neighbours.weight[first];
+				float* laplace = &neighbours.weight2[first];
+				KernelPoly6GradientLaplacianBatch(&neighbours.length[first], grad, laplace, last - first, kernels);
+
+				glm::vec3 gi(0.f);
+				float li = 0.f;
+				for (unsigned k = first; k < last; k++) {
+					const unsigned j = neighbours.index[k];
+					const float vi = mass[j] / density[j];
+					const float vj = mass[i] / density[i];
+
+					gi += vi * grad[k - first] * neighbours.r[k];
+					gradCs(j, k) -= vj * grad[k - first] * neighbours.r[k];
+					li += vi * laplace[k - first];
+					laplaceCs(j, k) += vj * laplace[k - first];
 				}
+				gradCs[i] += gi;
+				laplaceCs[i] += li;
 			}
-			float nlen = glm::length(gradCs);
-
-			if (nlen < lenThreshold) continue;
-
-			pi->forceAccum += -sigma * laplaceCs * gradCs / nlen;
-		}
-	}else{
-		std::vector<Particle*> closeParticles;
-		for (unsigned i = 0; i < particles.size(); i++) {
-			Particle* pi = particles[i];
+		});
+		ForParticles(n, [&](unsigned begin, unsigned end) {
+			vectorBuffer.Reduce(&colourGradient[0], begin, end, glm::vec3(0.f));
+			scalarBuffer.Reduce(&colourLaplacian[0], begin, end, 0.f);
+			for (unsigned i = begin; i < end; i++) {
+				const float nlen = glm::length(colourGradient[i]);
+				if (nlen < lenThreshold) continue;
+
+				forceAccum[i] += -parameters.sigma * colourLaplacian[i] * colourGradient[i] / nlen;
+			}
+		});
+		return;
+	}
 
+	// For every particle
+	ForParticles(n, [&](unsigned begin, unsigned end) {
+		for (unsigned i = begin; i < end; i++) {
 			glm::vec3 gradCs = glm::vec3(0,0,0);
 			float laplaceCs = 0;
-
-			GetParticlesClose(pi, closeParticles);
-			// Compute surfaceTension force from every other particle
-			for (unsigned j = 0; j < closeParticles.size(); j++) {
-				if (j != i){
-					Particle* pj = closeParticles[j];
-					const glm::vec3 r = pi->position - pj->position;
-					float laplace = 0;
-
-					float rSquared = glm::length2(pi->position - pj->position);
-					glm::vec3 grad = KernelPoly6GradientLaplacian(r,h,laplace);
-
-					gradCs += pj->mass / pj->density * grad;
-					laplaceCs += pj->mass / pj->density * laplace;
-
-				}
+			const unsigned first = neighbours.Begin(i), last = neighbours.End(i);
+			if (first == last) continue;
+			float* grad = &neighbours.weight[first];
+			float* laplace = &neighbours.weight2[first];
+			KernelPoly6GradientLaplacianBatch(&neighbours.length[first], grad, laplace, last - first, kernels);
+
+			// Compute surfaceTension force from every neighbour
+			for (unsigned k = first; k < last; k++) {
+				const unsigned j = neighbours.index[k];
+
+				gradCs += mass[j] / density[j] * grad[k - first] * neighbours.r[k];
+				laplaceCs += mass[j] / density[j] * laplace[k - first];
 			}
 			float nlen = glm::length(gradCs);
 
 			if (nlen < lenThreshold) continue;
 
-			pi->forceAccum += -sigma * laplaceCs * gradCs / nlen;
+			forceAccum[i] += -parameters.sigma * laplaceCs * gradCs / nlen;
 		}
-	}
+	});
 }
 
 void FluidSimulator::ApplyGravityForces() {
+	PROFILE_SCOPE("ApplyGravityForces");
 	const float g = 9.81f; // Gravitational constant for Earth
 	const glm::vec3 gv(0.f, -g, 0.f);
 	if (fluidgravity){
-		for (auto pi = particles.begin(); pi != particles.end(); pi++) {
-			Particle* p = *pi;
-			p->forceAccum += p->restDensity * gv;
-		}
+		ForParticles(particles.Size(), [&](unsigned begin, unsigned end) {
+			for (unsigned i = begin; i < end; i++)
+				particles.forceAccum[i] += particles.restDensity[i] * gv;
+		});
 	}
 	if (bodygravity){
-		for (auto bi = bodies.begin(); bi != bodies.end(); bi++) {
+		for (auto bi = bodies.GetAll().begin(); bi != bodies.GetAll().end(); bi++) {
 			Body* b = *bi;
 			b->forceAccum += b->mass * gv;
 		}
@@ -433,65 +839,157 @@ void FluidSimulator::ApplyGravityForces() {
 
 // Apply a force to all particles in direction of negative x-axis
 void FluidSimulator::ApplyWindForces() {
+	PROFILE_SCOPE("ApplyWindForces");
 	const float wf = 6.f;
 	const glm::vec3 wfv(-wf, 0.f, 0.f);
-	for (auto pi = particles.begin(); pi != particles.end(); pi++) {
-		Particle* p = *pi;
-		p->forceAccum += p->restDensity * wfv;
-	}
+	ForParticles(particles.Size(), [&](unsigned begin, unsigned end) {
+		for (unsigned i = begin; i < end; i++)
+			particles.forceAccum[i] += particles.restDensity[i] * wfv;
+	});
 }
 
 void FluidSimulator::DetectAndRespondCollisions(float dt) {
+	PROFILE_SCOPE("DetectAndRespondCollisions");
+	// Every pass compacts the particles that still collide to the front of activeCollisions,
+	// so after the first step it never needs more storage than it already has
+	const unsigned n = particles.Size();
+	activeCollisions.resize(n);
+	for (unsigned i = 0; i < n; i++)
+		activeCollisions[i] = i;
+	unsigned active = n;
+
+	// With body gravity on, the bodies are pushed around while the particles are handled,
+	// so their swept bounds would go stale; every particle then checks every body
+	const bool useBroadPhase = !bodygravity && !bodies.Empty();
+	if (useBroadPhase) {
+		PROFILE_SCOPE("BodyBroadPhase");
+		bodyBroadPhase.Build(bodies.GetAll(), grid);
+	}
+
+	collisionStats = CollisionStats();
+	while (active > 0 && collisionStats.iterations < collisionIterations) {
+		const unsigned* indices = &activeCollisions[0];
+		collisionStats.iterations++;
+		collisionStats.checks += active;
+
+		// With body gravity on, the particles push the bodies around, so they have to go one at a time
+		if (bodygravity) {
+			for (unsigned a = 0; a < active; a++)
+				RespondCollisions(indices + a, 1, dt, false);
+		} else {
+			ForParticles(active, [&](unsigned begin, unsigned end) {
+				RespondCollisions(indices + begin, end - begin, dt, useBroadPhase);
+			});
+		}
+
+		// Keeps the order, so the serial body gravity path handles the particles in the same order every pass
+		unsigned kept = 0;
+		for (unsigned a = 0; a < active; a++) {
+			if (particles.collision[activeCollisions[a]])
+				activeCollisions[kept++] = activeCollisions[a];
+		}
+		active = kept;
+	}
+
+	collisionStats.unresolved = active;
+	collisionStats.converged = active == 0;
+	PROFILE_COUNT("collision iterations", collisionStats.iterations);
+	PROFILE_COUNT("collision checks", collisionStats.checks);
+	PROFILE_COUNT("collisions unresolved", collisionStats.unresolved);
+}
+
+// Resolves the collision of particle i with one body, returns true if they collided
+// T is the body's concrete type; the body classes are final, so the calls below do not go through the vtable
+template <typename T>
+bool FluidSimulator::RespondBodyCollision(unsigned i, T& rigidBody) {
 	glm::vec3	cp;	// Point of collision
 	float		d;	// Penetration depth
 	glm::vec3	n;	// Normal at point of collision
 
+	const float sImpactCoefficient = 1.0f + parameters.bounce;
+	const glm::vec3& position = particles.position[i];
+	glm::vec3& velocity = particles.velocity[i];
 
-	std::vector<Particle*> possiblyColliding=particles;
-	
-
-	static const float sImpactCoefficient = 1.0f + bounce;
-	int x = 0;
-	while (possiblyColliding.size() > 0 &&x++<100){
-		std::vector<Particle*> newColliding;
-		for (auto pi = possiblyColliding.begin(); pi != possiblyColliding.end(); pi++) {
-			Particle* particle = *pi;
-			particle->collision = false;
-			// If a collision was detected
-			if (boundingBox.Outside(particle->position + particle->velocity*dt, cp, d, n)) {
-				// Reflect velocity with bounce factor in mind
-				particle->velocity = particle->velocity - sImpactCoefficient * glm::dot(particle->velocity, n) * n;
-				particle->collision = true;
-			}
+	const glm::vec3 & physObjVelocity = rigidBody.GetVelocity();
+	if (!rigidBody.collision(position, (velocity - physObjVelocity), cp, d, n))
+		return false;
 
-			for (auto bi = bodies.begin(); bi != bodies.end(); bi++) {
-				Body* rigidBody = *bi;
-				const glm::vec3 & physObjVelocity = rigidBody->GetVelocity();
-				if (rigidBody->collision(particle->position, (particle->velocity - physObjVelocity), cp, d, n)){
-					const glm::vec3  vVelDueToRotAtConPt = rigidBody->GetAngularVelocity(cp);
-					const glm::vec3  vVelBodyAtConPt = physObjVelocity + vVelDueToRotAtConPt;
-					const glm::vec3  velRelative = particle->velocity - vVelBodyAtConPt;
-					const float  speedNormal = glm::dot(velRelative, n); // Contact normal depends on geometry.
-					const glm::vec3  impulse = -speedNormal * n; // Minus: speedNormal is negative.
-					
-					particle->velocity = particle->velocity + impulse * sImpactCoefficient;
-					particle->collision = true;
-					if (bodygravity){
-						rigidBody->velocity += (-impulse * sImpactCoefficient )/ rigidBody->mass;
-						rigidBody->omega += (glm::cross(cp, (-impulse * sImpactCoefficient) / rigidBody->mass) / (glm::length(cp)*glm::length(cp)));
-					}
-				}
-			}
-			if (particle->collision){
-				newColliding.push_back(particle);
-			}
+	const glm::vec3  vVelDueToRotAtConPt = rigidBody.GetAngularVelocity(cp);
+	const glm::vec3  vVelBodyAtConPt = physObjVelocity + vVelDueToRotAtConPt;
+	const glm::vec3  velRelative = velocity - vVelBodyAtConPt;
+	const float  speedNormal = glm::dot(velRelative, n); // Contact normal depends on geometry.
+	const glm::vec3  impulse = -speedNormal * n; // Minus: speedNormal is negative.
+
+	velocity = velocity + impulse * sImpactCoefficient;
+	if (bodygravity){
+		rigidBody.velocity += (-impulse * sImpactCoefficient )/ rigidBody.mass;
+		rigidBody.omega += (glm::cross(cp, (-impulse * sImpactCoefficient) / rigidBody.mass) / (glm::length(cp)*glm::length(cp)));
+	}
+	return true;
+}
+
+// Tests the particles indices[0, count) against every body of one type
+// The bodies are the outer loop, so each particle still meets them in order
+template <typename T>
+void FluidSimulator::CollideBatch(const unsigned* indices, unsigned count, std::vector<T>& bodiesOfType) {
+	for (unsigned b = 0; b < bodiesOfType.size(); b++) {
+		T& body = bodiesOfType[b];
+		for (unsigned a = 0; a < count; a++) {
+			if (RespondBodyCollision(indices[a], body))
+				particles.collision[indices[a]] = true;
 		}
-		possiblyColliding.clear();
-		possiblyColliding = newColliding;
-		newColliding.clear();
 	}
+}
 
+// Resolves the collisions of the particles indices[0, count) with the bounding box and the bodies
+// Sets a particle's collision flag if it hit anything
+// Every particle meets the bodies in the order of BodyStore::GetAll, whether it is handled alone or in a batch
+// With useBroadPhase, only the bodies bodyBroadPhase reports are tested
+void FluidSimulator::RespondCollisions(const unsigned* indices, unsigned count, float dt, bool useBroadPhase) {
+	glm::vec3	cp;	// Point of collision
+	float		d;	// Penetration depth
+	glm::vec3	n;	// Normal at point of collision
+
+	const float sImpactCoefficient = 1.0f + parameters.bounce;
+	for (unsigned a = 0; a < count; a++) {
+		const unsigned i = indices[a];
+		const glm::vec3& position = particles.position[i];
+		glm::vec3& velocity = particles.velocity[i];
+		char& collision = particles.collision[i];
+		collision = false;
+		// If a collision was detected
+		if (boundingBox.Outside(position + velocity*dt, cp, d, n)) {
+			// Reflect velocity with bounce factor in mind
+			velocity = velocity - sImpactCoefficient * glm::dot(velocity, n) * n;
+			collision = true;
+		}
+	}
 
+	if (!useBroadPhase) {
+		CollideBatch(indices, count, bodies.spheres);
+		CollideBatch(indices, count, bodies.boxes);
+		CollideBatch(indices, count, bodies.rotatingBoxes);
+		return;
+	}
+
+	const unsigned boxesBegin = bodies.BoxesBegin();
+	const unsigned rotatingBoxesBegin = bodies.RotatingBoxesBegin();
+	for (unsigned a = 0; a < count; a++) {
+		const unsigned i = indices[a];
+		const glm::vec3& position = particles.position[i];
+		const glm::vec3& velocity = particles.velocity[i];
+
+		// A hit changes the velocity, so the segment is measured again before looking for the next candidate
+		unsigned b = 0;
+		while (bodyBroadPhase.NextCandidate(glm::min(position, position + velocity), glm::max(position, position + velocity), b, b)) {
+			bool hit;
+			if (b < boxesBegin) hit = RespondBodyCollision(i, bodies.spheres[b]);
+			else if (b < rotatingBoxesBegin) hit = RespondBodyCollision(i, bodies.boxes[b - boxesBegin]);
+			else hit = RespondBodyCollision(i, bodies.rotatingBoxes[b - rotatingBoxesBegin]);
+			if (hit) particles.collision[i] = true;
+			b++;
+		}
+	}
 }
 
 float FluidSimulator::csGradient(float cs) {
@@ -504,6 +1002,9 @@ bool FluidSimulator::isWind(){
 bool FluidSimulator::isGravity(){
 	return fluidgravity;
 }
+bool FluidSimulator::isBodyGravity(){
+	return bodygravity;
+}
 bool FluidSimulator::isSurfaceTension(){
 	return surfaceTension;
 }
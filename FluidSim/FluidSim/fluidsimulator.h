@@ -1,27 +1,139 @@
 #pragma once
 
 #include "particle.h"
+#include "particlestore.h"
 #include "Body.h"
-#include "Sphere.h"
-#include "Box.h"
-#include "BoxRotating.h"
+#include "sphere.h"
+#include "box.h"
+#include "boxRotating.h"
+#include "bodystore.h"
+#include <functional>
+#include <memory>
+#include <string>
 #include <vector>
 #include "boundingbox.h"
+#include "uniformgrid.h"
+#include "neighbourlist.h"
+#include "bodybroadphase.h"
+#include "pressuresolver.h"
+#include "pcisphsolver.h"
+#include "kernelbatch.h"
+#include "threadpool.h"
+#include "reductionbuffer.h"
 #include <iostream>
 
+// What the collision pass of the last step did
+struct CollisionStats {
+	unsigned	iterations;		// Passes over the particles that were still colliding
+	unsigned	checks;			// Particles handled over all passes
+	unsigned	unresolved;		// Particles still colliding when the iteration cap was hit
+	bool		converged;		// True if no particle was left colliding
+
+	CollisionStats() : iterations(0), checks(0), unresolved(0), converged(true) {}
+};
+
+// How a step moves the particles and bodies once the forces are known
+enum Integrator {
+	ExplicitEuler,		// Positions move with the old velocity, then the velocity is updated
+	SymplecticEuler		// The velocity is updated first and moves the positions, stable at larger steps
+};
+
+// Limits Advance uses to pick the size of every substep
+struct TimeStepSettings {
+	float		cflFactor;			// dt <= cflFactor * h / fastest speed
+	float		forceFactor;		// dt <= forceFactor * sqrt(h / largest acceleration)
+	float		viscosityFactor;	// dt <= viscosityFactor / largest viscous damping rate
+	float		minDt;				// Substeps are never shorter, whatever the limits say
+	float		maxDt;
+	unsigned	maxSubsteps;		// Per Advance; the last substep takes whatever is left of the frame
+
+	TimeStepSettings() : cflFactor(0.4f), forceFactor(0.25f), viscosityFactor(0.5f), minDt(1e-4f), maxDt(1.f), maxSubsteps(64) {}
+};
+
+// What the last Advance did
+struct TimeStepStats {
+	unsigned	substeps;
+	float		dt;					// Length of the last substep
+	float		cflDt;				// Limits of the last substep, before clamping to the frame
+	float		forceDt;
+	float		viscosityDt;
+
+	TimeStepStats() : substeps(0), dt(0.f), cflDt(0.f), forceDt(0.f), viscosityDt(0.f) {}
+};
+
+// Which neighbour pairs the SPH passes visit
+enum PairMode {
+	FullPairs,		// Every particle lists all of its neighbours, so each pair is evaluated from both sides
+	HalfPairs		// Every pair is listed once and evaluated once, adding to both particles
+};
+
+// When the neighbour search moves the particles in memory into the grid's Morton order
+// Locality is the fraction of candidate neighbour pairs that lie less than window particles apart in storage.
+// It is measured at every search and falls as the fluid mixes; the particles are reordered once it drops below
+// threshold times what it was right after the last reorder, so a churning flow is reordered more often than a calm one
+struct ReorderSettings {
+	float		threshold;
+	unsigned	window;
+
+	ReorderSettings() : threshold(0.9f), window(256) {}
+};
+
+// What the reordering has done so far
+struct ReorderStats {
+	unsigned	reorders;
+	unsigned	searches;		// Neighbour searches since the last reorder
+	unsigned	interval;		// Neighbour searches between the last two reorders
+	float		locality;		// At the last search
+	float		baseline;		// Right after the last reorder
+
+	ReorderStats() : reorders(0), searches(0), interval(0), locality(1.f), baseline(1.f) {}
+};
+
+// Material constants of the fluid and how particles bounce off bodies and the bounding box
+struct FluidParameters {
+	float		k;			// Pressure constant
+	float		mu;			// Viscosity constant
+	float		bounce;		// Collision response factor, 0 stops particles at a wall and 1 reflects them fully
+	float		sigma;		// Surface tension coefficient
+
+	FluidParameters() : k(3e8f), mu(6e4f), bounce(0.4f), sigma(10.f) {}
+};
+
 // Simulates fluids using particles
 class FluidSimulator {
 public:
 	FluidSimulator(const AABoundingBox& boundingBox);
 	~FluidSimulator();
 
-	// This class takes ownership of the particle pointers and will be the one to destroy them
-	void AddParticle(Particle* particle);
-	void AddParticles(const std::vector<Particle*>& particles);
+	// Particles are copied into the simulator's own storage
+	ParticleHandle AddParticle(const Particle& particle);
+	void AddParticles(const std::vector<Particle>& particles);
+	void AddParticles(const Particle* particles, unsigned count);
+
+	// Appends count particles in one go and calls fill(i, p) for i = 0, 1, ... in order to set up each of them
+	// in place, p being a ParticleRef holding the values of Particle(); nothing is copied and the storage grows once
+	template <typename F>
+	void AddParticles(unsigned count, F fill);
 
-	// This class takes ownership of the body pointers and will be the one to destroy them
-	void AddBody(Body* body);
-	void AddBodies(const std::vector<Body*>& bodies);
+	// Makes room for count particles in all, for callers that add them in several batches
+	void ReserveParticles(unsigned count);
+
+	// Handle of particle i; the neighbour search reorders the particles and with them their indices, handles stay the same
+	ParticleHandle GetParticleHandle(unsigned i) const { return particles.GetHandle(i); }
+	// Sets index to where the particle is now, returns false if it has been removed
+	bool FindParticle(ParticleHandle handle, unsigned& index) const { return particles.Find(handle, index); }
+
+	// Removes the particle at the start of the next step
+	// Kills are collected and removed together once per step in a single pass that keeps the order of the other
+	// particles, so the neighbour list and the grid only have to be renumbered instead of built again
+	void KillParticle(ParticleHandle handle);
+	// Removes the killed particles now instead of at the next step
+	void RemoveKilledParticles();
+
+	// Bodies are copied into the simulator's own storage
+	void AddBody(const Sphere& sphere);
+	void AddBody(const Box& box);
+	void AddBody(const BoxRotating& box);
 
 	void ToggleFluidGravity();
 	void ToggleBodyGravity();
@@ -29,54 +141,211 @@ public:
 	void ToggleSurfaceTension();
 	void ToggleUseOctree();
 
+	void SetParameters(const FluidParameters& parameters);
+	const FluidParameters& GetParameters() const { return parameters; }
+
+	// Moves the walls the particles are kept within, the grid is laid out over them again
+	void SetBoundingBox(const AABoundingBox& boundingBox);
+
+	// Dense unless set otherwise; a hashed grid suits large domains the fluid only fills a small part of
+	void SetGridStorage(GridStorage storage);
+	GridStorage GetGridStorage() const;
+
+	// SPH radius, the kernels and the neighbour search follow it
+	void SetSmoothingLength(float h);
+	float GetSmoothingLength() const;
+
+	// Verlet skin for the neighbour list, 0 searches the neighbours again every step
+	void SetNeighbourSkin(float skin);
+	float GetNeighbourSkin() const;
+
+	// Full unless set otherwise. Half pairs search the grid over half of the cells around every particle and evaluate
+	// the kernels once per pair, where full pairs do both twice; the passes run over slices of the particles, each
+	// adding what it gives the particles outside of it into a buffer of its own, which are added up after the pass
+	void SetPairMode(PairMode mode);
+	PairMode GetPairMode() const { return pairMode; }
+
+	// Slices the half pair passes split the particles into, 0 for four per thread and a single one when single threaded
+	// The sums depend on the slice count and nothing else, so a fixed count gives the same results for any thread count
+	void SetPairSlices(unsigned count);
+	unsigned GetPairSlices() const { return pairSlices; }
+
+	// Number of threads the solver passes are split over, 1 is single threaded and 0 uses all hardware threads
+	void SetThreadCount(unsigned count);
+	unsigned GetThreadCount() const;
+
+	// Most passes the collision response makes before leaving particles that still collide, at least 1
+	void SetCollisionIterations(unsigned iterations);
+	unsigned GetCollisionIterations() const;
+	const CollisionStats& GetCollisionStats() const { return collisionStats; }
+
 	// Do an explicit Euler time integration step
 	void ExplicitEulerStep(float dt);
+	// Do a symplectic Euler time integration step
+	void SymplecticEulerStep(float dt);
+
+	// Moves the simulation forward by frameDt in as many substeps as the time step limits ask for,
+	// each of them with the integrator set by SetIntegrator
+	void Advance(float frameDt);
+	void SetIntegrator(Integrator integrator);
+	Integrator GetIntegrator() const;
+	TimeStepSettings& GetTimeStepSettings() { return timeStepSettings; }
+	const TimeStepStats& GetTimeStepStats() const { return timeStepStats; }
+
+	// Only used with the grid; particle indices change with every reorder, handles do not
+	ReorderSettings& GetReorderSettings() { return reorderSettings; }
+	const ReorderStats& GetReorderStats() const { return reorderStats; }
+
+	// Turns densities into pressure forces, an EquationOfStateSolver unless set otherwise
+	void SetPressureSolver(std::unique_ptr<PressureSolver> solver);
+	PressureSolver& GetPressureSolver() { return *pressureSolver; }
 
 	// Removes all particles
 	void Clear();
 
-	std::vector<Particle*>&	GetParticles();
-	std::vector<Body*>&	GetBodies();
+	// Writes the particles, bodies, toggles, fluid parameters and grid and solver settings to path, see checkpoint.cpp for the format
+	// Returns false if the file could not be written; an earlier file at path is only replaced once the new one is complete
+	bool SaveCheckpoint(const std::string& path) const;
+	// Replaces the whole state with the one saved at path
+	// Returns false, leaving the simulator as it was, if the file could not be read or is not a checkpoint of this version
+	bool LoadCheckpoint(const std::string& path);
+
+	ParticleStore&			GetParticles();
+	BodyStore&				GetBodies();
 	AABoundingBox& GetBoundingBox() { return boundingBox; }
-	Body* movingBody;
+	// The body the keys move, the one added last; null if there are no bodies
+	Body* GetMovingBody();
 
 	bool isWind();
 	bool isGravity();
+	bool isBodyGravity();
 	bool isSurfaceTension();
 	bool isUseOctree();
 
 	//AABoundingBox			box;
 
 private:
+	// Times the passes one by one
+	friend class SolverBench;
+	// Read the neighbours and densities, and run the pressure passes
+	friend class EquationOfStateSolver;
+	friend class PcisphSolver;
+
+	// The neighbour search has to take new particles in
+	void		ParticlesAdded();
+
+	// Calls body(begin, end) over blocks of particles [0, count), on the thread pool if there is one
+	void		ForParticles(unsigned count, const std::function<void(unsigned, unsigned)>& body);
+	// Calls body(slice, begin, end) for the slices of the last UpdateSlices, each on a single thread
+	void		ForParticleSlices(const std::function<void(unsigned, unsigned, unsigned)>& body);
+	void		UpdateSlices();
+
+	void		UpdateNeighbours();
 	void		CalculateDensities();
 	void		CalculatePressures();
 
-	void		ApplyAllForces();
+	// Every force, with the pressure forces solved for a step of dt
+	void		ApplyAllForces(float dt);
+	// Neighbours, densities and every force but pressure
+	void		ApplyNonPressureForces();
 	void		ApplyPressureForces();
 	void		ApplyViscosityForces();
 	void		ApplySurfaceTensionForces();
 	void		ApplyGravityForces();
 	void		ApplyWindForces();
 
+	// Calls f(j) for every particle j other than i that may lie within the SPH radius of particle i
+	// The neighbour list is built through here, so every SPH pass shares the same neighbour search
+	template <typename F>
+	void		ForEachNeighbour(unsigned i, F f) const;
+	// The same for half pairs: of every two particles that may lie within the SPH radius of each other,
+	// only one gets the other passed to f
+	template <typename F>
+	void		ForEachHalfNeighbour(unsigned i, F f) const;
+
 	void		DetectAndRespondCollisions(float dt);
+	// Runs one step once the forces are known: collisions and integration
+	void		FinishStep(float dt, Integrator integrator);
+	void		ClearForces();
+	// Positions and rotations from the velocities, and velocities from the forces
+	void		Move(float dt);
+	void		Accelerate(float dt);
+	// Largest dt the time step limits allow for the current velocities and forces, fills the limits of timeStepStats
+	float		StableTimeStep();
+	void		RespondCollisions(const unsigned* indices, unsigned count, float dt, bool useBroadPhase);
+	template <typename T>
+	void		CollideBatch(const unsigned* indices, unsigned count, std::vector<T>& bodiesOfType);
+	template <typename T>
+	bool		RespondBodyCollision(unsigned i, T& body);
 	float		csGradient(float cs);
 
-	void		initOctree();
-	void		calculateOctree();
-	void		GetParticlesClose(Particle* pi, std::vector<Particle*>& particles);
-	void		clearOctree();	// Frees memory from octree
-
 	AABoundingBox			boundingBox;	// The bounding box in which the particles should reside
-	std::vector<Particle*>	particles;		// These particles represent the fluid
-	bool					gravity;		// True if gravity force is to be applied
-	std::vector<Body*>		bodies;			// The bodies in the simulation
+	FluidParameters			parameters;
+	ParticleStore			particles;		// These particles represent the fluid
+	bool					gravity;		// True if gravity force is to be applied
+	BodyStore				bodies;			// The bodies in the simulation
 	bool					fluidgravity;	// True if gravity force is to be applied on the fluid
 	bool					bodygravity;	// True if gravity force is to be applied on the bodies
-	std::vector<std::vector<Particle*>>	octree; // octree for detecting particles close to one another
+	UniformGrid				grid;			// Grid for detecting particles close to one another
+	NeighbourList			neighbours;		// Neighbours of every particle for the current step
+	BodyBroadPhase			bodyBroadPhase;	// Bodies each particle may hit, rebuilt for every collision pass
+	SphKernelSet			kernels;		// SPH kernels for the current smoothing length
+	std::unique_ptr<ThreadPool>	threadPool;	// Workers for the solver passes, empty when single threaded
 	bool					wind;			// True if wind force is to be applied
 	bool					surfaceTension;	// True if surface tension force is to be applied
+	bool					useOctree;		// Use the grid, else all particles are looped.
+	std::vector<unsigned>	activeCollisions;	// Particles still colliding, kept between steps so its storage is reused
+	unsigned				collisionIterations;	// Cap on the collision passes per step
+	CollisionStats			collisionStats;	// Of the last step
+	Integrator				integrator;		// Used by Advance
+	TimeStepSettings		timeStepSettings;
+	TimeStepStats			timeStepStats;	// Of the last Advance
+	ReorderSettings			reorderSettings;
+	ReorderStats			reorderStats;
+	bool					reorderDue;		// Reorder at the next search whatever the locality, set while there is no baseline yet
+	std::vector<float>		viscosityRate;	// Per particle, how fast viscosity pulls its velocity to its neighbours'
+	PairMode				pairMode;
+	unsigned				pairSlices;		// Setting, 0 picks the count from the threads
+	ReductionLayout			sliceLayout;	// Slices of the half pair passes, for the current neighbour list
+	ReductionBuffer<glm::vec3>	vectorBuffer;	// Per-slice sums of the half pair passes
+	ReductionBuffer<float>	scalarBuffer;
+	std::vector<glm::vec3>	colourGradient;	// Scratch for the surface tension with half pairs, per particle
+	std::vector<float>		colourLaplacian;
+	std::vector<ParticleHandle>	killed;		// Particles to remove at the start of the next step
+	std::vector<char>		killedMask;		// Scratch for RemoveKilledParticles, per particle
+	std::vector<unsigned>	remap;			// Scratch for RemoveKilledParticles, new index of every particle
+	std::unique_ptr<PressureSolver>	pressureSolver;
+};
+
+template <typename F>
+void FluidSimulator::AddParticles(unsigned count, F fill) {
+	if (count == 0) return;
+	const unsigned first = particles.Append(count);
+	for (unsigned i = 0; i < count; i++)
+		fill(i, particles[first + i]);
+	ParticlesAdded();
+}
+
+template <typename F>
+void FluidSimulator::ForEachNeighbour(unsigned i, F f) const {
+	if (useOctree) {
+		grid.ForEachNeighbour(particles.position[i], [&](unsigned j) {
+			if (j != i) f(j);
+		});
+	} else {
+		const unsigned n = particles.Size();
+		for (unsigned j = 0; j < n; j++)
+			if (j != i) f(j);
+	}
+}
 
-	int						d1,d2,d3;		// dimensions of octree (including extra (empty) space on each side)
-	float						c1,c2,c3;		// dimensions of octree (including extra (empty) space on each side)
-	bool					useOctree;		// Use octree, else all particles are looped.
-};
\ No newline at end of file
+template <typename F>
+void FluidSimulator::ForEachHalfNeighbour(unsigned i, F f) const {
+	if (useOctree) {
+		grid.ForEachHalfNeighbour(i, particles.position[i], f);
+	} else {
+		const unsigned n = particles.Size();
+		for (unsigned j = i + 1; j < n; j++)
+			f(j);
+	}
+}
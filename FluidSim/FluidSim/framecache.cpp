@@ -0,0 +1,246 @@
+#include "framecache.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+const char frameCacheMagic[8] = { 'F', 'L', 'U', 'I', 'D', 'F', 'R', 'M' };
+const char frameIndexMagic[8] = { 'F', 'L', 'U', 'I', 'D', 'I', 'D', 'X' };
+
+// Velocities further out than this many steps are clamped, so differences between them still fit in an int
+const int maxVelocitySteps = 1 << 29;
+
+static void PutVarint(std::vector<unsigned char>& out, unsigned long long value) {
+	while (value >= 0x80) {
+		out.push_back((unsigned char)(value | 0x80));
+		value >>= 7;
+	}
+	out.push_back((unsigned char)value);
+}
+
+// Zigzag maps small negative and positive numbers to small unsigned ones: 0, -1, 1, -2 ... become 0, 1, 2, 3 ...
+static void PutSigned(std::vector<unsigned char>& out, long long value) {
+	PutVarint(out, ((unsigned long long)value << 1) ^ (unsigned long long)(value >> 63));
+}
+
+// Reads variable length integers out of a chunk, failing instead of running past its end
+class ChunkReader {
+public:
+	ChunkReader(const unsigned char* data, unsigned bytes) : data(data), end(data + bytes), failed(false) {}
+
+	unsigned long long GetVarint() {
+		unsigned long long value = 0;
+		for (unsigned shift = 0; shift < 64; shift += 7) {
+			if (data == end) break;
+			const unsigned char byte = *data++;
+			value |= (unsigned long long)(byte & 0x7f) << shift;
+			if (!(byte & 0x80)) return value;
+		}
+		failed = true;
+		return 0;
+	}
+
+	long long GetSigned() {
+		const unsigned long long value = GetVarint();
+		return (long long)(value >> 1) ^ -(long long)(value & 1);
+	}
+
+	// True if every read so far lay within the chunk and nothing of it is left
+	bool Done() const { return !failed && data == end; }
+
+private:
+	const unsigned char*	data;
+	const unsigned char*	end;
+	bool					failed;
+};
+
+FrameCacheHeader MakeFrameCacheHeader(const AABoundingBox& box, const FrameCacheSettings& settings) {
+	FrameCacheHeader header;
+	memcpy(header.magic, frameCacheMagic, sizeof(frameCacheMagic));
+	header.version = frameCacheVersion;
+	header.positionBits = std::min(std::max(settings.positionBits, 1u), 24u);
+	header.low = glm::vec3(box.left, box.bottom, box.back);
+	header.extent = box.size;
+	header.velocityStep = settings.velocityStep;
+	header.keyframeInterval = std::max(settings.keyframeInterval, 1u);
+	return header;
+}
+
+FrameCacheFooter MakeFrameCacheFooter(unsigned long long indexOffset, unsigned long long frames) {
+	FrameCacheFooter footer;
+	footer.indexOffset = indexOffset;
+	footer.frames = frames;
+	memcpy(footer.magic, frameIndexMagic, sizeof(frameIndexMagic));
+	return footer;
+}
+
+FrameEncoder::FrameEncoder() :
+	sinceKeyframe(0),
+	first(true) {
+	Reset(MakeFrameCacheHeader(AABoundingBox(), FrameCacheSettings()));
+}
+
+void FrameEncoder::Reset(const FrameCacheHeader& header) {
+	this->header = header;
+	previous = QuantisedFrame();
+	sinceKeyframe = 0;
+	first = true;
+}
+
+bool FrameEncoder::Encode(const std::vector<glm::vec3>& positions, const std::vector<glm::vec3>& velocities,
+		const std::vector<unsigned>& ids, std::vector<unsigned char>& chunk) {
+	const unsigned n = (unsigned)ids.size();
+	const float gridSteps = (float)((1u << header.positionBits) - 1);
+	const float toGrid = gridSteps / header.extent;
+
+	order.resize(n);
+	for (unsigned i = 0; i < n; i++)
+		order[i] = i;
+	std::sort(order.begin(), order.end(), [&](unsigned a, unsigned b) { return ids[a] < ids[b]; });
+
+	current.ids.resize(n);
+	current.position.resize(3 * n);
+	current.velocity.resize(3 * n);
+	for (unsigned i = 0; i < n; i++) {
+		const unsigned j = order[i];
+		current.ids[i] = ids[j];
+		for (unsigned c = 0; c < 3; c++) {
+			const float p = std::floor((positions[j][c] - header.low[c]) * toGrid + 0.5f);
+			const float v = std::floor(velocities[j][c] / header.velocityStep + 0.5f);
+			current.position[3 * i + c] = (int)std::min(std::max(p, 0.f), gridSteps);
+			current.velocity[3 * i + c] = (int)std::min(std::max(v, (float)-maxVelocitySteps), (float)maxVelocitySteps);
+		}
+	}
+
+	// Particles that were added or removed cannot be matched up with the frame before
+	const bool keyframe = first || sinceKeyframe + 1 >= header.keyframeInterval || current.ids != previous.ids;
+	chunk.clear();
+	if (keyframe) {
+		PutVarint(chunk, n);
+		for (unsigned i = 0; i < n; i++) {
+			PutSigned(chunk, (long long)current.ids[i] - (i > 0 ? (long long)current.ids[i - 1] : 0));
+			for (unsigned c = 0; c < 3; c++)
+				PutSigned(chunk, (long long)current.position[3 * i + c] - (i > 0 ? current.position[3 * (i - 1) + c] : 0));
+			for (unsigned c = 0; c < 3; c++)
+				PutSigned(chunk, (long long)current.velocity[3 * i + c] - (i > 0 ? current.velocity[3 * (i - 1) + c] : 0));
+		}
+		sinceKeyframe = 0;
+	} else {
+		for (unsigned i = 0; i < n; i++) {
+			for (unsigned c = 0; c < 3; c++)
+				PutSigned(chunk, (long long)current.position[3 * i + c] - previous.position[3 * i + c]);
+			for (unsigned c = 0; c < 3; c++)
+				PutSigned(chunk, (long long)current.velocity[3 * i + c] - previous.velocity[3 * i + c]);
+		}
+		sinceKeyframe++;
+	}
+
+	std::swap(previous, current);
+	first = false;
+	return keyframe;
+}
+
+FrameReader::FrameReader() :
+	header(),
+	decodedFrame(0) {
+}
+
+bool FrameReader::Open(const std::string& path) {
+	Close();
+	if (!file.Open(path) || file.Size() < sizeof(FrameCacheHeader) + sizeof(FrameCacheFooter)) {
+		Close();
+		return false;
+	}
+
+	FrameCacheFooter footer;
+	memcpy(&header, file.Data(), sizeof(header));
+	memcpy(&footer, file.Data() + file.Size() - sizeof(footer), sizeof(footer));
+	const unsigned long long indexEnd = file.Size() - sizeof(footer);
+	if (memcmp(header.magic, frameCacheMagic, sizeof(frameCacheMagic)) != 0 || header.version != frameCacheVersion
+		|| memcmp(footer.magic, frameIndexMagic, sizeof(frameIndexMagic)) != 0
+		|| header.positionBits < 1 || header.positionBits > 24 || !(header.extent > 0.f) || !(header.velocityStep > 0.f)
+		|| footer.indexOffset < sizeof(header) || footer.indexOffset > indexEnd
+		|| (indexEnd - footer.indexOffset) != footer.frames * sizeof(FrameIndexEntry)) {
+		Close();
+		return false;
+	}
+
+	index.resize((size_t)footer.frames);
+	if (!index.empty())
+		memcpy(&index[0], file.Data() + footer.indexOffset, index.size() * sizeof(FrameIndexEntry));
+	for (unsigned f = 0; f < index.size(); f++) {
+		const FrameIndexEntry& entry = index[f];
+		if (entry.offset < sizeof(header) || entry.offset + entry.bytes > footer.indexOffset || (f == 0 && !entry.keyframe)) {
+			Close();
+			return false;
+		}
+	}
+	decodedFrame = GetFrameCount();
+	return true;
+}
+
+void FrameReader::Close() {
+	file.Close();
+	index.clear();
+	decodedFrame = 0;
+}
+
+bool FrameReader::ReadFrame(unsigned frame, std::vector<glm::vec3>& positions, std::vector<glm::vec3>& velocities,
+		std::vector<unsigned>& ids) {
+	if (frame >= GetFrameCount() || !Decode(frame)) return false;
+
+	const unsigned n = (unsigned)decoded.ids.size();
+	const float fromGrid = header.extent / (float)((1u << header.positionBits) - 1);
+	ids = decoded.ids;
+	positions.resize(n);
+	velocities.resize(n);
+	for (unsigned i = 0; i < n; i++) {
+		for (unsigned c = 0; c < 3; c++) {
+			positions[i][c] = header.low[c] + decoded.position[3 * i + c] * fromGrid;
+			velocities[i][c] = decoded.velocity[3 * i + c] * header.velocityStep;
+		}
+	}
+	return true;
+}
+
+// Leaves frame in decoded, starting from the frame already there if that one leads up to it
+bool FrameReader::Decode(unsigned frame) {
+	if (decodedFrame == frame) return true;
+
+	unsigned start = frame;
+	while (!index[start].keyframe) start--;
+	if (decodedFrame < GetFrameCount() && decodedFrame >= start && decodedFrame < frame)
+		start = decodedFrame + 1;
+
+	for (unsigned f = start; f <= frame; f++) {
+		const FrameIndexEntry& entry = index[f];
+		ChunkReader reader(file.Data() + entry.offset, entry.bytes);
+		decodedFrame = GetFrameCount();
+
+		if (entry.keyframe) {
+			const unsigned long long n = reader.GetVarint();
+			if (n != entry.particles || n > entry.bytes) return false;
+			decoded.ids.resize((size_t)n);
+			decoded.position.resize(3 * (size_t)n);
+			decoded.velocity.resize(3 * (size_t)n);
+			for (unsigned i = 0; i < n; i++) {
+				decoded.ids[i] = (unsigned)(reader.GetSigned() + (i > 0 ? (long long)decoded.ids[i - 1] : 0));
+				for (unsigned c = 0; c < 3; c++)
+					decoded.position[3 * i + c] = (int)(reader.GetSigned() + (i > 0 ? decoded.position[3 * (i - 1) + c] : 0));
+				for (unsigned c = 0; c < 3; c++)
+					decoded.velocity[3 * i + c] = (int)(reader.GetSigned() + (i > 0 ? decoded.velocity[3 * (i - 1) + c] : 0));
+			}
+		} else {
+			if (entry.particles != decoded.ids.size()) return false;
+			for (unsigned i = 0; i < entry.particles; i++) {
+				for (unsigned c = 0; c < 3; c++)
+					decoded.position[3 * i + c] += (int)reader.GetSigned();
+				for (unsigned c = 0; c < 3; c++)
+					decoded.velocity[3 * i + c] += (int)reader.GetSigned();
+			}
+		}
+		if (!reader.Done()) return false;
+		decodedFrame = f;
+	}
+	return true;
+}
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <string>
+#include <vector>
+#include "boundingbox.h"
+#include "mappedfile.h"
+
+// Particle cache: the positions, velocities and ids of a sequence of frames in one file
+//
+// Positions are quantised on a grid over the bounding box and velocities in fixed steps, so every frame is a set of integers.
+// A keyframe stores them relative to the previous particle of the same frame, every other frame relative to the frame
+// before it; either way the differences are written zigzagged as variable length integers, so slow particles cost a byte
+// or two per component. A frame is a keyframe every keyframeInterval frames and whenever the particles changed since the
+// last one, and the index at the end of the file lets a reader start decoding at the keyframe before any frame.
+// The neighbour search reorders the particles in memory from time to time, so every frame is stored in order of id to line it up with the last.
+//
+// The file, in the byte order of the machine that wrote it:
+//   FrameCacheHeader
+//   the frames, one chunk of variable length integers each:
+//     keyframe: particle count, then per particle the id, x, y, z, vx, vy, vz relative to the previous particle by id
+//     other:    per particle x, y, z, vx, vy, vz relative to the same particle in the frame before
+//   FrameIndexEntry per frame
+//   FrameCacheFooter
+
+const unsigned frameCacheVersion = 1;
+
+struct FrameCacheHeader {
+	char		magic[8];			// "FLUIDFRM"
+	unsigned	version;
+	unsigned	positionBits;		// Per component, positions are quantised on a grid of 2^positionBits - 1 steps
+	glm::vec3	low;				// Corner of the bounding box the grid spans
+	float		extent;				// Size of the bounding box along every axis
+	float		velocityStep;		// Velocities are whole multiples of it
+	unsigned	keyframeInterval;
+};
+
+struct FrameIndexEntry {
+	unsigned long long	offset;		// Of the chunk from the start of the file
+	unsigned	bytes;				// Size of the chunk
+	unsigned	step;				// Simulation step the frame was taken after
+	unsigned	particles;
+	unsigned	keyframe;			// 1 if the chunk stands on its own
+};
+
+struct FrameCacheFooter {
+	unsigned long long	indexOffset;
+	unsigned long long	frames;
+	char		magic[8];			// "FLUIDIDX"
+};
+
+// Settings of a new cache
+struct FrameCacheSettings {
+	unsigned	positionBits;		// 1 to 24
+	float		velocityStep;
+	unsigned	keyframeInterval;	// At least 1, 1 makes every frame a keyframe
+
+	FrameCacheSettings() : positionBits(16), velocityStep(1e-3f), keyframeInterval(30) {}
+};
+
+// Header of a new cache over box, and the footer closing it
+FrameCacheHeader	MakeFrameCacheHeader(const AABoundingBox& box, const FrameCacheSettings& settings);
+FrameCacheFooter	MakeFrameCacheFooter(unsigned long long indexOffset, unsigned long long frames);
+
+// One frame in quantised form, what the encoder and decoder work on
+struct QuantisedFrame {
+	std::vector<unsigned>	ids;
+	std::vector<int>		position;	// x, y, z per particle
+	std::vector<int>		velocity;
+};
+
+// Turns frames into chunks; keeps the last frame to encode the next one against
+class FrameEncoder {
+public:
+	FrameEncoder();
+
+	// Starts over with a cache of the given header, the next frame is a keyframe
+	void		Reset(const FrameCacheHeader& header);
+
+	// Replaces chunk with the encoding of the given frame, returns true if it is a keyframe
+	// Ids have to be unique, the particles can come in any order
+	bool		Encode(const std::vector<glm::vec3>& positions, const std::vector<glm::vec3>& velocities,
+					const std::vector<unsigned>& ids, std::vector<unsigned char>& chunk);
+
+private:
+	FrameCacheHeader	header;
+	QuantisedFrame		previous;
+	QuantisedFrame		current;
+	std::vector<unsigned>	order;		// Indices of the frame being encoded, sorted by id
+	unsigned			sinceKeyframe;	// Frames encoded since the last keyframe
+	bool				first;
+};
+
+// Reads frames out of a cache in any order
+// Frames are decoded from the keyframe before them; reading them in order only decodes each chunk once
+class FrameReader {
+public:
+	FrameReader();
+
+	// Returns false if path could not be mapped or is not a complete cache of this version
+	bool		Open(const std::string& path);
+	void		Close();
+
+	unsigned	GetFrameCount() const { return (unsigned)index.size(); }
+	const FrameIndexEntry&	GetFrameInfo(unsigned frame) const { return index[frame]; }
+	const FrameCacheHeader&	GetHeader() const { return header; }
+
+	// Fills the arrays with frame, returns false if frame is out of range or its chunks are corrupt
+	bool		ReadFrame(unsigned frame, std::vector<glm::vec3>& positions, std::vector<glm::vec3>& velocities,
+					std::vector<unsigned>& ids);
+
+private:
+	bool		Decode(unsigned frame);
+
+	MappedFile			file;
+	FrameCacheHeader	header;
+	std::vector<FrameIndexEntry>	index;
+	QuantisedFrame		decoded;
+	unsigned			decodedFrame;	// Frame held in decoded, GetFrameCount() if none
+};
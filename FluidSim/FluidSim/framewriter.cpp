@@ -0,0 +1,139 @@
+#include "framewriter.h"
+
+FrameWriter::FrameWriter(FrameWriterPolicy policy) :
+	offset(0),
+	policy(policy),
+	fill(0),
+	pending(false),
+	stop(false) {
+}
+
+FrameWriter::~FrameWriter() {
+	Close();
+}
+
+bool FrameWriter::Open(const std::string& path, const AABoundingBox& box, const FrameCacheSettings& settings) {
+	Close();
+	out.open(path.c_str(), std::ios::binary | std::ios::trunc);
+	if (!out) return false;
+
+	const FrameCacheHeader header = MakeFrameCacheHeader(box, settings);
+	out.write((const char*)&header, sizeof(header));
+	if (!out) {
+		out.close();
+		return false;
+	}
+
+	encoder.Reset(header);
+	index.clear();
+	offset = sizeof(header);
+	fill = 0;
+	pending = false;
+	stop = false;
+	stats = FrameWriterStats();
+	stats.bytes = offset;
+	thread = std::thread(&FrameWriter::WriterLoop, this);
+	return true;
+}
+
+bool FrameWriter::Close() {
+	if (!IsOpen()) return true;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stop = true;
+	}
+	wake.notify_all();
+	thread.join();
+
+	// The thread is gone, so everything here belongs to this one again
+	const FrameCacheFooter footer = MakeFrameCacheFooter(offset, index.size());
+	if (!index.empty())
+		out.write((const char*)&index[0], index.size() * sizeof(FrameIndexEntry));
+	out.write((const char*)&footer, sizeof(footer));
+	out.close();
+	if (!out) stats.failed = true;
+	else stats.bytes += index.size() * sizeof(FrameIndexEntry) + sizeof(footer);
+	return !stats.failed;
+}
+
+bool FrameWriter::Submit(const ParticleStore& particles, unsigned step) {
+	if (!IsOpen()) return false;
+
+	unsigned target;
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		stats.submitted++;
+		if (pending && policy == DropBusyFrames) {
+			stats.dropped++;
+			return false;
+		}
+		if (pending) stats.waits++;
+		while (pending)
+			taken.wait(lock);
+		target = fill;
+	}
+
+	// The thread only takes buffers[fill] once pending is set, so it can be filled without holding the lock
+	Frame& frame = buffers[target];
+	frame.position = particles.position;
+	frame.velocity = particles.velocity;
+	frame.id = particles.id;
+	frame.step = step;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		pending = true;
+	}
+	wake.notify_one();
+	return true;
+}
+
+FrameWriterStats FrameWriter::GetStats() {
+	std::lock_guard<std::mutex> lock(mutex);
+	return stats;
+}
+
+void FrameWriter::WriterLoop() {
+	for (;;) {
+		unsigned frame;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			while (!stop && !pending)
+				wake.wait(lock);
+			// Frames submitted before Close are still written
+			if (!pending) return;
+			frame = fill;
+			fill ^= 1;
+			pending = false;
+		}
+		taken.notify_one();
+		WriteFrame(buffers[frame]);
+	}
+}
+
+void FrameWriter::WriteFrame(const Frame& frame) {
+	// Later frames would be encoded against one that never made it to the file
+	if (stats.failed) return;
+
+	const bool keyframe = encoder.Encode(frame.position, frame.velocity, frame.id, chunk);
+	if (!chunk.empty())
+		out.write((const char*)&chunk[0], chunk.size());
+
+	FrameIndexEntry entry;
+	entry.offset = offset;
+	entry.bytes = (unsigned)chunk.size();
+	entry.step = frame.step;
+	entry.particles = (unsigned)frame.id.size();
+	entry.keyframe = keyframe ? 1 : 0;
+
+	std::lock_guard<std::mutex> lock(mutex);
+	if (!out) {
+		stats.failed = true;
+		return;
+	}
+	index.push_back(entry);
+	offset += chunk.size();
+	stats.written++;
+	if (keyframe) stats.keyframes++;
+	stats.bytes = offset;
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <condition_variable>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "framecache.h"
+#include "particlestore.h"
+
+// What a FrameWriter has done so far
+struct FrameWriterStats {
+	unsigned	submitted;		// Frames handed to Submit
+	unsigned	written;		// Frames on disk
+	unsigned	dropped;		// Frames Submit skipped because the one before was still being written
+	unsigned	waits;			// Frames Submit held back until the thread took the one before
+	unsigned	keyframes;
+	unsigned long long	bytes;	// Written to the file, index included once closed
+	bool		failed;			// A write failed, the file is incomplete
+
+	FrameWriterStats() : submitted(0), written(0), dropped(0), waits(0), keyframes(0), bytes(0), failed(false) {}
+};
+
+// What Submit does with a frame while the thread has yet to take the one before
+enum FrameWriterPolicy {
+	DropBusyFrames,		// Skips the new frame, so the simulation never stalls on the disk; for the interactive viewer
+	WaitForBusyFrames	// Waits for the thread, so no frame is lost; for runs whose cache has to be complete
+};
+
+// Writes particle frames to a cache (see framecache.h) on a thread of its own
+// Submit copies the frame into one of two buffers and returns; the thread encodes and writes it while the simulation
+// goes on filling the other. If the thread is still busy with the frame before that, the policy decides whether the
+// new frame is dropped or waited for
+class FrameWriter {
+public:
+	explicit FrameWriter(FrameWriterPolicy policy = DropBusyFrames);
+	~FrameWriter();
+
+	// Starts a cache at path over box, returns false if the file could not be created
+	bool		Open(const std::string& path, const AABoundingBox& box, const FrameCacheSettings& settings = FrameCacheSettings());
+	// Waits for the last frame and writes the index, returns false if anything could not be written
+	bool		Close();
+	bool		IsOpen() const { return thread.joinable(); }
+
+	// Queues the positions, velocities and ids of particles as the frame after step
+	// Returns false if the frame was dropped, which WaitForBusyFrames never does
+	bool		Submit(const ParticleStore& particles, unsigned step);
+
+	FrameWriterStats	GetStats();
+
+private:
+	FrameWriter(const FrameWriter&);
+	FrameWriter& operator=(const FrameWriter&);
+
+	struct Frame {
+		std::vector<glm::vec3>	position;
+		std::vector<glm::vec3>	velocity;
+		std::vector<unsigned>	id;
+		unsigned				step;
+	};
+
+	void		WriterLoop();
+	void		WriteFrame(const Frame& frame);
+
+	std::ofstream		out;			// Only touched by the thread while it runs
+	FrameEncoder		encoder;
+	std::vector<unsigned char>		chunk;
+	std::vector<FrameIndexEntry>	index;
+	unsigned long long	offset;			// Of the next chunk
+
+	FrameWriterPolicy	policy;
+	Frame				buffers[2];
+	unsigned			fill;			// Buffer Submit fills next, the thread owns the other one
+
+	std::thread			thread;
+	std::mutex			mutex;			// Guards the fields below and fill
+	std::condition_variable	wake;
+	std::condition_variable	taken;		// Signalled when the thread takes a frame, for Submit waiting on it
+	bool				pending;		// buffers[fill] holds a frame the thread has not taken yet
+	bool				stop;
+	FrameWriterStats	stats;
+};
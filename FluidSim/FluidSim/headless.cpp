@@ -0,0 +1,452 @@
+// Runs the simulation without a window or OpenGL, for batch runs and throughput measurements
+//
+// Usage: FluidSimHeadless [options]
+//   --steps N          Number of steps to run (default 1000)
+//   --dt X             Fixed time step (default 0.1, the same as the interactive version)
+//   --adaptive         Treat --dt as a frame and split every step into substeps of adaptive length
+//   --symplectic       Integrate with symplectic instead of explicit Euler
+//   --pcisph           Solve pressure with PCISPH instead of the equation of state
+//   --threads N        Solver threads, 0 uses all hardware threads (default 0)
+//   --skin X           Verlet skin of the neighbour list (default 0)
+//   --collisions N     Most collision passes per step (default 100)
+//   --output FILE      Write particle states as CSV to FILE
+//   --every N          Write the particle states every N steps instead of only after the last step
+//   --frames FILE      Write every step (or every N with --every) to the particle cache FILE on a background thread;
+//                      the steps wait for it when it falls behind, and a cache missing frames fails the run
+//   --no-grid          Find neighbours by brute force instead of with the uniform grid
+//   --hashed-grid      Keep only the occupied cells of the grid, in a hash table
+//   --half-pairs       Evaluate every neighbour pair once for both particles instead of once from each
+//   --slices N         Split the half pair passes into N slices, which makes their results the same for any --threads
+//                      (default 0, four per thread)
+//   --no-gravity       Turn fluid gravity off
+//   --body-gravity     Turn body gravity on
+//   --wind             Turn wind on
+//   --tension          Turn surface tension on
+//   --profile          Print the time per phase and the solver counters (needs FLUIDSIM_PROFILE)
+//   --trace FILE       Write a Chrome trace of every phase to FILE (needs FLUIDSIM_PROFILE)
+//   --scene FILE       Start from the scene file FILE instead of the default scene; the settings it makes replace the
+//                      ones given here
+//   --load FILE        Start from the checkpoint in FILE instead of the default scene; its toggles, skin,
+//                      collision passes and integrator replace the ones given here
+//   --save FILE        Write a checkpoint to FILE after the last step
+//   --domains N        Split the box along x into N domains, each with its own simulator on its own thread
+//   --rank R           With --socket, run only domain R of the --domains, the others run in processes of their own
+//   --socket PREFIX    Connect the domain processes over the UNIX sockets PREFIX.0, PREFIX.1, ...; on Windows over
+//                      loopback TCP, with the ports in the files PREFIX.0, PREFIX.1, ...
+//   --rebalance N      Steps between the load checks of the domains, 0 keeps the cuts (default 50)
+//
+// Domains need fixed steps and no body gravity, and do not run emitters. Threaded domains write one output file
+// with the domains after each other; a domain process writes only its own particles to its own --output
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include "domain.h"
+#include "fluidsimulator.h"
+#include "framewriter.h"
+#include "profiler.h"
+#include "scene.h"
+
+struct HeadlessOptions {
+	unsigned	steps;
+	float		dt;
+	bool		adaptive;
+	bool		symplectic;
+	bool		pcisph;
+	unsigned	threads;
+	float		skin;
+	unsigned	collisionIterations;
+	std::string	output;
+	unsigned	every;			// 0 writes only the last step
+	std::string	frames;
+	bool		grid;
+	bool		hashedGrid;
+	bool		halfPairs;
+	unsigned	slices;			// 0 picks them from the threads
+	bool		fluidGravity;
+	bool		bodyGravity;
+	bool		wind;
+	bool		tension;
+	bool		profile;
+	std::string	trace;
+	std::string	scene;
+	std::string	load;
+	std::string	save;
+	unsigned	domains;		// 0 runs a single simulator
+	int			rank;			// -1 runs all domains on threads
+	std::string	socket;
+	unsigned	rebalance;
+};
+
+void PrintUsage() {
+	std::cerr << "Usage: FluidSimHeadless [--steps N] [--dt X] [--adaptive] [--symplectic] [--pcisph] [--threads N] [--skin X] [--collisions N]" << std::endl
+		<< "                        [--output FILE] [--every N] [--frames FILE] [--no-grid] [--hashed-grid] [--half-pairs] [--slices N] [--no-gravity] [--body-gravity] [--wind] [--tension] [--profile] [--trace FILE]" << std::endl
+		<< "                        [--scene FILE] [--load FILE] [--save FILE] [--domains N] [--rank R] [--socket PREFIX] [--rebalance N]" << std::endl;
+}
+
+// Returns false if the arguments could not be parsed
+bool ParseOptions(int argc, char** argv, HeadlessOptions& options) {
+	options.steps = 1000;
+	options.dt = 0.1f;
+	options.adaptive = false;
+	options.symplectic = false;
+	options.pcisph = false;
+	options.threads = 0;
+	options.skin = 0.f;
+	options.collisionIterations = 100;
+	options.every = 0;
+	options.grid = true;
+	options.hashedGrid = false;
+	options.halfPairs = false;
+	options.slices = 0;
+	options.fluidGravity = true;
+	options.bodyGravity = false;
+	options.wind = false;
+	options.tension = false;
+	options.profile = false;
+	options.domains = 0;
+	options.rank = -1;
+	options.rebalance = 50;
+
+	for (int i = 1; i < argc; i++) {
+		const std::string arg = argv[i];
+		const bool hasValue = i + 1 < argc;
+
+		if (arg == "--steps" && hasValue) options.steps = (unsigned)atoi(argv[++i]);
+		else if (arg == "--dt" && hasValue) options.dt = (float)atof(argv[++i]);
+		else if (arg == "--adaptive") options.adaptive = true;
+		else if (arg == "--symplectic") options.symplectic = true;
+		else if (arg == "--pcisph") options.pcisph = true;
+		else if (arg == "--threads" && hasValue) options.threads = (unsigned)atoi(argv[++i]);
+		else if (arg == "--skin" && hasValue) options.skin = (float)atof(argv[++i]);
+		else if (arg == "--collisions" && hasValue) options.collisionIterations = (unsigned)atoi(argv[++i]);
+		else if (arg == "--output" && hasValue) options.output = argv[++i];
+		else if (arg == "--every" && hasValue) options.every = (unsigned)atoi(argv[++i]);
+		else if (arg == "--frames" && hasValue) options.frames = argv[++i];
+		else if (arg == "--no-grid") options.grid = false;
+		else if (arg == "--hashed-grid") options.hashedGrid = true;
+		else if (arg == "--half-pairs") options.halfPairs = true;
+		else if (arg == "--slices" && hasValue) options.slices = (unsigned)atoi(argv[++i]);
+		else if (arg == "--no-gravity") options.fluidGravity = false;
+		else if (arg == "--body-gravity") options.bodyGravity = true;
+		else if (arg == "--wind") options.wind = true;
+		else if (arg == "--tension") options.tension = true;
+		else if (arg == "--profile") options.profile = true;
+		else if (arg == "--trace" && hasValue) options.trace = argv[++i];
+		else if (arg == "--scene" && hasValue) options.scene = argv[++i];
+		else if (arg == "--load" && hasValue) options.load = argv[++i];
+		else if (arg == "--save" && hasValue) options.save = argv[++i];
+		else if (arg == "--domains" && hasValue) options.domains = (unsigned)atoi(argv[++i]);
+		else if (arg == "--rank" && hasValue) options.rank = atoi(argv[++i]);
+		else if (arg == "--socket" && hasValue) options.socket = argv[++i];
+		else if (arg == "--rebalance" && hasValue) options.rebalance = (unsigned)atoi(argv[++i]);
+		else {
+			std::cerr << "Unknown or incomplete option " << arg << std::endl;
+			return false;
+		}
+	}
+
+	if (options.dt <= 0.f) {
+		std::cerr << "--dt has to be positive" << std::endl;
+		return false;
+	}
+	if (options.domains > 0) {
+		if (options.adaptive || !options.frames.empty() || !options.load.empty() || !options.save.empty()
+			|| options.profile || !options.trace.empty()) {
+			std::cerr << "--domains does not work with --adaptive, --frames, --load, --save, --profile or --trace" << std::endl;
+			return false;
+		}
+		if (options.socket.empty() != (options.rank < 0) || options.rank >= (int)options.domains) {
+			std::cerr << "--socket and --rank go together, and the rank has to be below --domains" << std::endl;
+			return false;
+		}
+	} else if (options.rank >= 0 || !options.socket.empty()) {
+		std::cerr << "--rank and --socket need --domains" << std::endl;
+		return false;
+	}
+#ifndef FLUIDSIM_PROFILE
+	if (options.profile || !options.trace.empty())
+		std::cerr << "Built without FLUIDSIM_PROFILE, --profile and --trace have nothing to report" << std::endl;
+#endif
+	return true;
+}
+
+// Appends one line per particle: step,id,x,y,z,vx,vy,vz
+void WriteParticles(std::ostream& out, unsigned step, const ParticleStore& particles) {
+	for (unsigned i = 0; i < particles.Size(); i++) {
+		const glm::vec3& p = particles.position[i];
+		const glm::vec3& v = particles.velocity[i];
+		out << step << ',' << particles.id[i] << ','
+			<< p.x << ',' << p.y << ',' << p.z << ','
+			<< v.x << ',' << v.y << ',' << v.z << '\n';
+	}
+}
+
+// Applies the options that set up the simulator, before the scene is loaded
+void Configure(FluidSimulator& simulator, const HeadlessOptions& options) {
+	simulator.SetThreadCount(options.threads);
+	simulator.SetNeighbourSkin(options.skin);
+	simulator.SetCollisionIterations(options.collisionIterations);
+	simulator.SetIntegrator(options.symplectic ? SymplecticEuler : ExplicitEuler);
+	if (options.pcisph) simulator.SetPressureSolver(std::unique_ptr<PressureSolver>(new PcisphSolver()));
+	if (options.grid) simulator.ToggleUseOctree();
+	if (options.hashedGrid) simulator.SetGridStorage(HashedGrid);
+	if (options.halfPairs) simulator.SetPairMode(HalfPairs);
+	simulator.SetPairSlices(options.slices);
+	if (!options.fluidGravity) simulator.ToggleFluidGravity();
+	if (options.bodyGravity) simulator.ToggleBodyGravity();
+	if (options.wind) simulator.ToggleWind();
+	if (options.tension) simulator.ToggleSurfaceTension();
+}
+
+// What one domain reports after its run
+struct DomainResult {
+	bool				ok;
+	std::string			error;
+	unsigned			particles;		// Of all domains together
+	unsigned			own;			// Of this domain
+	float				low, high;		// Its slab
+	double				ms;
+	DomainStats			stats;
+	std::ostringstream	out;			// The particle states of the domain, for threaded domains
+
+	DomainResult() : ok(false), particles(0), own(0), low(0.f), high(0.f), ms(0.0) {}
+};
+
+// Loads the scene into one domain and runs it, writing its particles to out
+void RunDomain(DomainTransport& transport, const HeadlessOptions& options, std::ostream* out, DomainResult& result) {
+	FluidDomain domain(AABoundingBox(glm::vec3(0.f, 0.f, 0.f), 100.f), transport);
+	FluidSimulator& simulator = domain.GetSimulator();
+	Configure(simulator, options);
+	domain.GetSettings().rebalanceInterval = options.rebalance;
+	Scene scene;
+	if (!options.scene.empty()) {
+		if (!LoadScene(options.scene, simulator, scene, result.error)) return;
+	} else LoadDefaultScene(simulator);
+	if (!domain.Start()) {
+		result.error = "The scene has body gravity on or its box is too narrow for that many domains";
+		return;
+	}
+
+	std::chrono::high_resolution_clock::duration simTime(0);
+	for (unsigned step = 1; step <= options.steps; step++) {
+		const auto start = std::chrono::high_resolution_clock::now();
+		if (!domain.Step(options.dt)) {
+			result.error = "Lost the connection to another domain";
+			return;
+		}
+		simTime += std::chrono::high_resolution_clock::now() - start;
+
+		const bool write = options.every > 0 ? step % options.every == 0 : step == options.steps;
+		if (out && write)
+			WriteParticles(*out, step, simulator.GetParticles());
+	}
+	result.ms = std::chrono::duration_cast<std::chrono::microseconds>(simTime).count() / 1000.0;
+	result.stats = domain.GetStats();
+	if (!domain.Sum(simulator.GetParticles().Size(), result.particles)) {
+		result.error = "Lost the connection to another domain";
+		return;
+	}
+	result.own = simulator.GetParticles().Size();
+	result.low = domain.GetLow();
+	result.high = domain.GetHigh();
+	result.ok = true;
+}
+
+// Runs the domains on threads, or with --socket the one domain of this process
+int RunDomains(const HeadlessOptions& options) {
+	std::ofstream file;
+	if (!options.output.empty()) {
+		file.open(options.output.c_str());
+		if (!file) {
+			std::cerr << "Could not open " << options.output << " for writing" << std::endl;
+			return 1;
+		}
+		file << "step,id,x,y,z,vx,vy,vz\n";
+	}
+
+	std::vector<std::unique_ptr<DomainResult>> results;
+	if (!options.socket.empty()) {
+		SocketTransport transport;
+		if (!transport.Open(options.socket, (unsigned)options.rank, options.domains, 60)) {
+			std::cerr << "Could not connect to the other domains over " << options.socket << std::endl;
+			return 1;
+		}
+		results.push_back(std::unique_ptr<DomainResult>(new DomainResult()));
+		RunDomain(transport, options, file.is_open() ? &file : 0, *results[0]);
+	} else {
+		// The domains share the hardware threads unless told otherwise
+		HeadlessOptions domainOptions = options;
+		if (domainOptions.threads == 0)
+			domainOptions.threads = std::max(std::thread::hardware_concurrency() / options.domains, 1u);
+		ThreadExchange exchange(options.domains);
+		std::vector<std::unique_ptr<ThreadTransport>> transports;
+		std::vector<std::thread> threads;
+		for (unsigned d = 0; d < options.domains; d++) {
+			transports.push_back(std::unique_ptr<ThreadTransport>(new ThreadTransport(exchange, d)));
+			results.push_back(std::unique_ptr<DomainResult>(new DomainResult()));
+		}
+		for (unsigned d = 0; d < options.domains; d++) {
+			DomainResult* result = results[d].get();
+			ThreadTransport* transport = transports[d].get();
+			threads.push_back(std::thread([&, result, transport]() {
+				RunDomain(*transport, domainOptions, file.is_open() ? &result->out : 0, *result);
+			}));
+		}
+		for (auto ti = threads.begin(); ti != threads.end(); ti++)
+			ti->join();
+		for (unsigned d = 0; d < options.domains; d++)
+			file << results[d]->out.str();
+	}
+
+	// Every domain loads the same scene, so they fail to start all together
+	double ms = 0.0;
+	DomainStats total;
+	for (auto ri = results.begin(); ri != results.end(); ri++) {
+		const DomainResult& result = **ri;
+		if (!result.ok) {
+			std::cerr << result.error << std::endl;
+			return 1;
+		}
+		const unsigned rank = options.rank >= 0 ? (unsigned)options.rank : (unsigned)(ri - results.begin());
+		std::cout << "domain " << rank << ": " << result.own << " particles in [" << result.low << ", " << result.high << ")" << std::endl;
+		ms = std::max(ms, result.ms);
+		total.ghosts += result.stats.ghosts;
+		total.sent += result.stats.sent;
+		total.received += result.stats.received;
+		total.rebalances = std::max(total.rebalances, result.stats.rebalances);
+	}
+	const unsigned n = results[0]->particles;
+	std::cout << "particles: " << n << std::endl
+		<< "domains: " << options.domains << std::endl
+		<< "steps: " << options.steps << std::endl
+		<< "total: " << ms << " ms" << std::endl
+		<< "ghosts at the last step: " << total.ghosts << std::endl
+		<< "particles moved between domains: " << total.sent << " sent, " << total.received << " received" << std::endl
+		<< "rebalances: " << total.rebalances << std::endl;
+	if (options.steps > 0 && n > 0) {
+		std::cout << "per step: " << ms / options.steps << " ms" << std::endl
+			<< "per particle step: " << ms * 1e6 / ((double)options.steps * n) << " ns" << std::endl;
+	}
+	if (file.is_open() && !file) {
+		std::cerr << "Could not write " << options.output << std::endl;
+		return 1;
+	}
+	return 0;
+}
+
+int main(int argc, char** argv) {
+	HeadlessOptions options;
+	if (!ParseOptions(argc, argv, options)) {
+		PrintUsage();
+		return 1;
+	}
+	if (options.domains > 0) return RunDomains(options);
+
+	FluidSimulator simulator(AABoundingBox(glm::vec3(0.f, 0.f, 0.f), 100.f));
+	Configure(simulator, options);
+	Scene scene;
+	std::string error;
+	if (!options.load.empty()) {
+		if (!simulator.LoadCheckpoint(options.load)) {
+			std::cerr << "Could not load the checkpoint " << options.load << std::endl;
+			return 1;
+		}
+	} else if (!options.scene.empty()) {
+		if (!LoadScene(options.scene, simulator, scene, error)) {
+			std::cerr << error << std::endl;
+			return 1;
+		}
+	} else LoadDefaultScene(simulator);
+	Profiler::Instance().SetTracing(!options.trace.empty());
+
+	std::ofstream out;
+	if (!options.output.empty()) {
+		out.open(options.output.c_str());
+		if (!out) {
+			std::cerr << "Could not open " << options.output << " for writing" << std::endl;
+			return 1;
+		}
+		out << "step,id,x,y,z,vx,vy,vz\n";
+	}
+	// Every frame is kept, the run waits for the disk instead
+	FrameWriter frames(WaitForBusyFrames);
+	if (!options.frames.empty() && !frames.Open(options.frames, simulator.GetBoundingBox())) {
+		std::cerr << "Could not open " << options.frames << " for writing" << std::endl;
+		return 1;
+	}
+
+	// Only the steps are timed, writing the output is not
+	std::chrono::high_resolution_clock::duration simTime(0);
+	unsigned unconverged = 0;	// Steps that left particles colliding
+	unsigned substeps = 0;
+	unsigned pressureIterations = 0;
+	float maxDensityError = 0.f;
+	for (unsigned step = 1; step <= options.steps; step++) {
+		const auto start = std::chrono::high_resolution_clock::now();
+		if (options.adaptive) simulator.Advance(options.dt);
+		else if (simulator.GetIntegrator() == SymplecticEuler) simulator.SymplecticEulerStep(options.dt);
+		else simulator.ExplicitEulerStep(options.dt);
+		UpdateScene(simulator, scene, options.dt);
+		simTime += std::chrono::high_resolution_clock::now() - start;
+		substeps += options.adaptive ? simulator.GetTimeStepStats().substeps : 1;
+		pressureIterations += simulator.GetPressureSolver().GetStats().iterations;
+		maxDensityError = std::max(maxDensityError, simulator.GetPressureSolver().GetStats().maxDensityError);
+		if (!simulator.GetCollisionStats().converged) unconverged++;
+
+		const bool write = options.every > 0 ? step % options.every == 0 : step == options.steps;
+		if (out.is_open() && write)
+			WriteParticles(out, step, simulator.GetParticles());
+		if (frames.IsOpen() && (options.every == 0 || step % options.every == 0))
+			frames.Submit(simulator.GetParticles(), step);
+	}
+
+	const double ms = std::chrono::duration_cast<std::chrono::microseconds>(simTime).count() / 1000.0;
+	const unsigned n = simulator.GetParticles().Size();
+	std::cout << "particles: " << n << std::endl
+		<< "threads: " << simulator.GetThreadCount() << std::endl
+		<< "steps: " << options.steps << std::endl
+		<< "substeps: " << substeps << std::endl
+		<< "total: " << ms << " ms" << std::endl
+		<< "unconverged collision steps: " << unconverged << std::endl
+		<< "largest density error: " << maxDensityError << std::endl;
+	if (simulator.isUseOctree()) {
+		const ReorderStats& reorder = simulator.GetReorderStats();
+		std::cout << "particle reorders: " << reorder.reorders << " (last after " << reorder.interval << " searches)" << std::endl
+			<< "neighbour locality: " << reorder.locality << " (" << reorder.baseline << " after the last reorder)" << std::endl;
+	}
+	if (options.steps > 0)
+		std::cout << "pressure iterations per step: " << (double)pressureIterations / options.steps << std::endl;
+	if (options.steps > 0 && n > 0) {
+		std::cout << "per step: " << ms / options.steps << " ms" << std::endl
+			<< "per particle step: " << ms * 1e6 / ((double)options.steps * n) << " ns" << std::endl;
+	}
+
+	if (frames.IsOpen()) {
+		const bool written = frames.Close();
+		const FrameWriterStats stats = frames.GetStats();
+		std::cout << "frames written: " << stats.written << " (" << stats.keyframes << " keyframes), dropped: " << stats.dropped
+			<< ", waited for: " << stats.waits << ", " << stats.bytes << " bytes" << std::endl;
+		if (!written || stats.dropped > 0) {
+			std::cerr << "Could not write " << options.frames << (written ? " completely" : "") << std::endl;
+			return 1;
+		}
+	}
+	if (!options.save.empty() && !simulator.SaveCheckpoint(options.save)) {
+		std::cerr << "Could not write the checkpoint " << options.save << std::endl;
+		return 1;
+	}
+	if (options.profile && Profiler::Instance().GetTotals().steps > 0)
+		Profiler::Instance().GetTotals().Print(std::cout);
+	if (!options.trace.empty() && !Profiler::Instance().WriteChromeTrace(options.trace)) {
+		std::cerr << "Could not write " << options.trace << std::endl;
+		return 1;
+	}
+	return 0;
+}
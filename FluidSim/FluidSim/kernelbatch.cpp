@@ -0,0 +1,114 @@
+#include "kernelbatchisa.h"
+
+// The scalar kernels, for processors without any of the instruction sets below
+#include "kernelbatchbody.h"
+
+#if defined(KERNEL_BATCH_X86)
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+
+// eax, ebx, ecx and edx of cpuid leaf, 0 for leaves the processor does not have
+static void Cpuid(unsigned leaf, unsigned regs[4]) {
+	regs[0] = regs[1] = regs[2] = regs[3] = 0;
+#if defined(_MSC_VER)
+	int r[4];
+	__cpuid(r, 0);
+	if ((unsigned)r[0] < leaf) return;
+	__cpuidex(r, leaf, 0);
+	for (int i = 0; i < 4; i++) regs[i] = (unsigned)r[i];
+#else
+	if (__get_cpuid_max(0, 0) < leaf) return;
+	__cpuid_count(leaf, 0, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+// Register states the operating system saves on a thread switch; wider registers are no use without them
+static unsigned long long Xcr0() {
+#if defined(_MSC_VER)
+	return _xgetbv(0);
+#else
+	unsigned lo, hi;
+	__asm__ __volatile__("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+	return ((unsigned long long)hi << 32) | lo;
+#endif
+}
+
+static bool ProcessorHas(KernelBatchIsa isa) {
+	unsigned leaf1[4], leaf7[4];
+	Cpuid(1, leaf1);
+	Cpuid(7, leaf7);
+	const bool sse = (leaf1[3] & (1u << 25)) != 0;
+	// OSXSAVE and AVX, with the SSE and AVX state saved
+	const bool osxsave = (leaf1[2] & (1u << 27)) != 0;
+	const unsigned long long xcr0 = osxsave ? Xcr0() : 0;
+	const bool avx = osxsave && (leaf1[2] & (1u << 28)) != 0 && (xcr0 & 0x06) == 0x06;
+	// AVX-512F, with the opmask and upper ZMM state saved as well
+	const bool avx512 = avx && (leaf7[1] & (1u << 16)) != 0 && (xcr0 & 0xe6) == 0xe6;
+	switch (isa) {
+	case KernelBatchSse:	return sse;
+	case KernelBatchAvx:	return avx;
+	case KernelBatchAvx512:	return avx512;
+	default:				return true;
+	}
+}
+#else
+static bool ProcessorHas(KernelBatchIsa isa) { return isa == KernelBatchScalar; }
+#endif
+
+static const KernelBatchFunctions* Functions(KernelBatchIsa isa) {
+	switch (isa) {
+	case KernelBatchSse:	return KernelBatchFunctionsSse();
+	case KernelBatchAvx:	return KernelBatchFunctionsAvx();
+	case KernelBatchAvx512:	return KernelBatchFunctionsAvx512();
+	default:				return &batchFunctions;
+	}
+}
+
+static KernelBatchIsa WidestIsa() {
+	for (int isa = KernelBatchAvx512; isa > KernelBatchScalar; isa--)
+		if (Functions((KernelBatchIsa)isa) && ProcessorHas((KernelBatchIsa)isa)) return (KernelBatchIsa)isa;
+	return KernelBatchScalar;
+}
+
+// Picked once at start up, before any thread runs a kernel
+static KernelBatchIsa activeIsa = WidestIsa();
+static const KernelBatchFunctions* active = Functions(activeIsa);
+
+KernelBatchIsa GetKernelBatchIsa() {
+	return activeIsa;
+}
+
+bool SetKernelBatchIsa(KernelBatchIsa isa) {
+	if (!Functions(isa) || !ProcessorHas(isa)) return false;
+	activeIsa = isa;
+	active = Functions(isa);
+	return true;
+}
+
+const char* KernelBatchIsaName(KernelBatchIsa isa) {
+	switch (isa) {
+	case KernelBatchSse:	return "SSE";
+	case KernelBatchAvx:	return "AVX";
+	case KernelBatchAvx512:	return "AVX-512";
+	default:				return "scalar";
+	}
+}
+
+void KernelPoly6Batch(const float* lr, float* out, unsigned count, const SphKernelSet& kernels) {
+	active->poly6(lr, out, count, kernels);
+}
+
+void KernelSpikyGradientBatch(const float* lr, float* out, unsigned count, const SphKernelSet& kernels) {
+	active->spikyGradient(lr, out, count, kernels);
+}
+
+void KernelViscosityLaplacianBatch(const float* lr, float* out, unsigned count, const SphKernelSet& kernels) {
+	active->viscosityLaplacian(lr, out, count, kernels);
+}
+
+void KernelPoly6GradientLaplacianBatch(const float* lr, float* gradient, float* laplacian, unsigned count, const SphKernelSet& kernels) {
+	active->poly6GradientLaplacian(lr, gradient, laplacian, count, kernels);
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include "sphkernelset.h"
+
+// Batch versions of the kernels in kernels.h, evaluated for count pairs at once with the widest instruction set the
+// processor supports, see KernelBatchIsa
+// lr holds |r| of every pair; pairs with lr outside [0, h] are masked to 0 instead of branched on
+// Vector kernels return a factor s, with the kernel being s * r
+
+// KernelPoly6(lr*lr, h)
+void	KernelPoly6Batch(const float* lr, float* out, unsigned count, const SphKernelSet& kernels);
+// KernelSpikyGradient(r, h) = out * r, pairs with lr == 0 give 0 instead of dividing by 0
+void	KernelSpikyGradientBatch(const float* lr, float* out, unsigned count, const SphKernelSet& kernels);
+// KernelViscosityLaplacian(r, h)
+void	KernelViscosityLaplacianBatch(const float* lr, float* out, unsigned count, const SphKernelSet& kernels);
+// KernelPoly6GradientLaplacian(r, h, laplacian) = gradient * r
+void	KernelPoly6GradientLaplacianBatch(const float* lr, float* gradient, float* laplacian, unsigned count, const SphKernelSet& kernels);
+
+// Instruction sets the batch kernels are built for, each in a file of its own with its own compiler flags
+enum KernelBatchIsa {
+	KernelBatchScalar,
+	KernelBatchSse,		// 4 lanes
+	KernelBatchAvx,		// 8 lanes, the projects build kernelbatchavx.cpp with /arch:AVX
+	KernelBatchAvx512	// 16 lanes, needs VS2017 15.3 or later, so the v110 projects leave it out
+};
+
+// The instruction set the kernels use, by default the widest one both the build and the processor have
+KernelBatchIsa	GetKernelBatchIsa();
+// False if the build or the processor lacks isa; not while kernels run, it is meant for benchmarks
+bool			SetKernelBatchIsa(KernelBatchIsa isa);
+const char*		KernelBatchIsaName(KernelBatchIsa isa);
@@ -0,0 +1,42 @@
+#include "kernelbatchisa.h"
+
+// AVX batch kernels, 8 lanes
+// The projects build this file alone with /arch:AVX, so all of it is VEX encoded and nothing stalls switching between
+// SSE and AVX; GCC and Clang get the same from the target pragma. Only called once cpuid reported AVX
+#if defined(KERNEL_BATCH_X86) && (defined(_MSC_VER) || defined(__GNUC__))
+#include <immintrin.h>
+
+#if defined(__clang__)
+#pragma clang attribute push(__attribute__((target("avx"))), apply_to = function)
+#elif defined(__GNUC__)
+#pragma GCC push_options
+#pragma GCC target("avx")
+#endif
+
+#define KERNEL_BATCH_LANES 8
+typedef __m256 Lane;
+static inline Lane Load(const float* p) { return _mm256_loadu_ps(p); }
+static inline void Store(float* p, Lane v) { _mm256_storeu_ps(p, v); }
+static inline Lane Set(float s) { return _mm256_set1_ps(s); }
+static inline Lane Add(Lane a, Lane b) { return _mm256_add_ps(a, b); }
+static inline Lane Sub(Lane a, Lane b) { return _mm256_sub_ps(a, b); }
+static inline Lane Mul(Lane a, Lane b) { return _mm256_mul_ps(a, b); }
+static inline Lane Div(Lane a, Lane b) { return _mm256_div_ps(a, b); }
+// Keeps v where lo <= x <= hi and zeroes it elsewhere
+static inline Lane Mask(Lane v, Lane x, Lane lo, Lane hi) {
+	const Lane m = _mm256_and_ps(_mm256_cmp_ps(x, lo, _CMP_GE_OQ), _mm256_cmp_ps(x, hi, _CMP_LE_OQ));
+	return _mm256_and_ps(m, v);
+}
+
+#include "kernelbatchbody.h"
+
+#if defined(__clang__)
+#pragma clang attribute pop
+#elif defined(__GNUC__)
+#pragma GCC pop_options
+#endif
+
+const KernelBatchFunctions* KernelBatchFunctionsAvx() { return &batchFunctions; }
+#else
+const KernelBatchFunctions* KernelBatchFunctionsAvx() { return 0; }
+#endif
@@ -0,0 +1,44 @@
+#include "kernelbatchisa.h"
+
+// AVX-512 batch kernels, 16 lanes. Only called once cpuid reported AVX-512F
+// Visual C++ has the intrinsics from VS2017 15.3 on, without needing /arch; the v110 projects build this file empty
+#if defined(KERNEL_BATCH_X86) && ((defined(_MSC_VER) && _MSC_VER >= 1911) || defined(__GNUC__))
+#include <immintrin.h>
+
+// AVX-512 brings FMA along; fusing multiplies and adds would change the results from the other instruction sets
+#if defined(__clang__)
+#pragma clang attribute push(__attribute__((target("avx512f"))), apply_to = function)
+#pragma clang fp contract(off)
+#elif defined(__GNUC__)
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+#pragma GCC optimize("fp-contract=off")
+#endif
+
+#define KERNEL_BATCH_LANES 16
+typedef __m512 Lane;
+static inline Lane Load(const float* p) { return _mm512_loadu_ps(p); }
+static inline void Store(float* p, Lane v) { _mm512_storeu_ps(p, v); }
+static inline Lane Set(float s) { return _mm512_set1_ps(s); }
+static inline Lane Add(Lane a, Lane b) { return _mm512_add_ps(a, b); }
+static inline Lane Sub(Lane a, Lane b) { return _mm512_sub_ps(a, b); }
+static inline Lane Mul(Lane a, Lane b) { return _mm512_mul_ps(a, b); }
+static inline Lane Div(Lane a, Lane b) { return _mm512_div_ps(a, b); }
+// Keeps v where lo <= x <= hi and zeroes it elsewhere
+static inline Lane Mask(Lane v, Lane x, Lane lo, Lane hi) {
+	const __mmask16 m = _mm512_cmp_ps_mask(x, lo, _CMP_GE_OQ) & _mm512_cmp_ps_mask(x, hi, _CMP_LE_OQ);
+	return _mm512_maskz_mov_ps(m, v);
+}
+
+#include "kernelbatchbody.h"
+
+#if defined(__clang__)
+#pragma clang attribute pop
+#elif defined(__GNUC__)
+#pragma GCC pop_options
+#endif
+
+const KernelBatchFunctions* KernelBatchFunctionsAvx512() { return &batchFunctions; }
+#else
+const KernelBatchFunctions* KernelBatchFunctionsAvx512() { return 0; }
+#endif
@@ -0,0 +1,86 @@
+#pragma once
+
+#include "kernelbatchisa.h"
+
+// The batch kernels, written once on top of the lane operations the including file defines for its instruction set
+// Load, Store, Set, Add, Sub, Mul, Div and Mask work on KERNEL_BATCH_LANES floats of type Lane; without
+// KERNEL_BATCH_LANES only the scalar loops are left
+// The scalar loops multiply in the same order as the lanes, so every instruction set gives the same results
+
+// Smallest |r| the spiky gradient accepts, closer pairs would divide by 0
+static const float minSpikyLength = 1e-8f;
+
+static void Poly6Batch(const float* lr, float* out, unsigned count, const SphKernelSet& kernels) {
+	const SphKernelCoefficients& c = kernels.GetCoefficients();
+	unsigned i = 0;
+#ifdef KERNEL_BATCH_LANES
+	const Lane zero = Set(0.f), h = Set(c.h), hs = Set(c.hs), coef = Set(c.poly6);
+	for (; i + KERNEL_BATCH_LANES <= count; i += KERNEL_BATCH_LANES) {
+		const Lane x = Load(lr + i);
+		const Lane d = Sub(hs, Mul(x, x));
+		Store(out + i, Mask(Mul(coef, Mul(d, Mul(d, d))), x, zero, h));
+	}
+#endif
+	for (; i < count; i++) {
+		const float d = c.hs - lr[i]*lr[i];
+		out[i] = (lr[i] < 0.f || lr[i] > c.h) ? 0.f : c.poly6 * (d * (d*d));
+	}
+}
+
+static void SpikyGradientBatch(const float* lr, float* out, unsigned count, const SphKernelSet& kernels) {
+	const SphKernelCoefficients& c = kernels.GetCoefficients();
+	unsigned i = 0;
+#ifdef KERNEL_BATCH_LANES
+	const Lane minLength = Set(minSpikyLength), h = Set(c.h), coef = Set(c.spikyGradient);
+	for (; i + KERNEL_BATCH_LANES <= count; i += KERNEL_BATCH_LANES) {
+		const Lane x = Load(lr + i);
+		const Lane d = Sub(h, x);
+		Store(out + i, Mask(Div(Mul(coef, Mul(d, d)), x), x, minLength, h));
+	}
+#endif
+	for (; i < count; i++) {
+		const float d = c.h - lr[i];
+		out[i] = (lr[i] < minSpikyLength || lr[i] > c.h) ? 0.f : c.spikyGradient * (d*d) / lr[i];
+	}
+}
+
+static void ViscosityLaplacianBatch(const float* lr, float* out, unsigned count, const SphKernelSet& kernels) {
+	const SphKernelCoefficients& c = kernels.GetCoefficients();
+	unsigned i = 0;
+#ifdef KERNEL_BATCH_LANES
+	const Lane zero = Set(0.f), h = Set(c.h), coef = Set(c.viscosityLaplacian);
+	for (; i + KERNEL_BATCH_LANES <= count; i += KERNEL_BATCH_LANES) {
+		const Lane x = Load(lr + i);
+		Store(out + i, Mask(Mul(coef, Sub(h, x)), x, zero, h));
+	}
+#endif
+	for (; i < count; i++)
+		out[i] = (lr[i] < 0.f || lr[i] > c.h) ? 0.f : c.viscosityLaplacian * (c.h - lr[i]);
+}
+
+static void Poly6GradientLaplacianBatch(const float* lr, float* gradient, float* laplacian, unsigned count, const SphKernelSet& kernels) {
+	const SphKernelCoefficients& c = kernels.GetCoefficients();
+	unsigned i = 0;
+#ifdef KERNEL_BATCH_LANES
+	const Lane zero = Set(0.f), h = Set(c.h), hs = Set(c.hs), coef = Set(c.poly6Gradient);
+	const Lane three = Set(3.f), seven = Set(7.f);
+	for (; i + KERNEL_BATCH_LANES <= count; i += KERNEL_BATCH_LANES) {
+		const Lane x = Load(lr + i);
+		const Lane xs = Mul(x, x);
+		const Lane d = Sub(hs, xs);
+		Store(gradient + i, Mask(Mul(coef, Mul(d, d)), x, zero, h));
+		Store(laplacian + i, Mask(Mul(Mul(coef, d), Sub(Mul(three, hs), Mul(seven, xs))), x, zero, h));
+	}
+#endif
+	for (; i < count; i++) {
+		const float xs = lr[i]*lr[i];
+		const float d = c.hs - xs;
+		const bool outside = lr[i] < 0.f || lr[i] > c.h;
+		gradient[i] = outside ? 0.f : c.poly6Gradient * (d*d);
+		laplacian[i] = outside ? 0.f : c.poly6Gradient * d * (3.f * c.hs - 7.f * xs);
+	}
+}
+
+static const KernelBatchFunctions batchFunctions = {
+	Poly6Batch, SpikyGradientBatch, ViscosityLaplacianBatch, Poly6GradientLaplacianBatch
+};
@@ -0,0 +1,21 @@
+#pragma once
+
+#include "kernelbatch.h"
+
+// Shared by the files that build the batch kernels for one instruction set each, see kernelbatch.cpp
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+#define KERNEL_BATCH_X86
+#endif
+
+struct KernelBatchFunctions {
+	void	(*poly6)(const float* lr, float* out, unsigned count, const SphKernelSet& kernels);
+	void	(*spikyGradient)(const float* lr, float* out, unsigned count, const SphKernelSet& kernels);
+	void	(*viscosityLaplacian)(const float* lr, float* out, unsigned count, const SphKernelSet& kernels);
+	void	(*poly6GradientLaplacian)(const float* lr, float* gradient, float* laplacian, unsigned count, const SphKernelSet& kernels);
+};
+
+// The kernels of each instruction set, 0 where the compiler cannot build them
+const KernelBatchFunctions*	KernelBatchFunctionsSse();
+const KernelBatchFunctions*	KernelBatchFunctionsAvx();
+const KernelBatchFunctions*	KernelBatchFunctionsAvx512();
@@ -0,0 +1,40 @@
+#include "kernelbatchisa.h"
+
+// SSE batch kernels, 4 lanes; every x86 processor the projects target has it, but it is still checked at run time
+#if defined(KERNEL_BATCH_X86) && (defined(_MSC_VER) || defined(__GNUC__))
+#include <xmmintrin.h>
+
+#if defined(__clang__)
+#pragma clang attribute push(__attribute__((target("sse"))), apply_to = function)
+#elif defined(__GNUC__)
+#pragma GCC push_options
+#pragma GCC target("sse")
+#endif
+
+#define KERNEL_BATCH_LANES 4
+typedef __m128 Lane;
+static inline Lane Load(const float* p) { return _mm_loadu_ps(p); }
+static inline void Store(float* p, Lane v) { _mm_storeu_ps(p, v); }
+static inline Lane Set(float s) { return _mm_set1_ps(s); }
+static inline Lane Add(Lane a, Lane b) { return _mm_add_ps(a, b); }
+static inline Lane Sub(Lane a, Lane b) { return _mm_sub_ps(a, b); }
+static inline Lane Mul(Lane a, Lane b) { return _mm_mul_ps(a, b); }
+static inline Lane Div(Lane a, Lane b) { return _mm_div_ps(a, b); }
+// Keeps v where lo <= x <= hi and zeroes it elsewhere
+static inline Lane Mask(Lane v, Lane x, Lane lo, Lane hi) {
+	const Lane m = _mm_and_ps(_mm_cmpge_ps(x, lo), _mm_cmple_ps(x, hi));
+	return _mm_and_ps(m, v);
+}
+
+#include "kernelbatchbody.h"
+
+#if defined(__clang__)
+#pragma clang attribute pop
+#elif defined(__GNUC__)
+#pragma GCC pop_options
+#endif
+
+const KernelBatchFunctions* KernelBatchFunctionsSse() { return &batchFunctions; }
+#else
+const KernelBatchFunctions* KernelBatchFunctionsSse() { return 0; }
+#endif
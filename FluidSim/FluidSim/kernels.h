@@ -12,4 +12,9 @@ glm::vec3	KernelSpikyGradient(const glm::vec3& r, float h);
 float		KernelSpikyLaplacian(const glm::vec3& r, float h);
 float		KernelViscosity(const glm::vec3& r, float h);
 glm::vec3	KernelViscosityGradient(const glm::vec3& r, float h);
-float		KernelViscosityLaplacian(const glm::vec3& r, float h);
\ No newline at end of file
+float		KernelViscosityLaplacian(const glm::vec3& r, float h);
+
+// The same kernels for callers that already know lr = |r|, e.g. from the neighbour list
+glm::vec3	KernelPoly6GradientLaplacian(const glm::vec3& r, float lr, float h, float& laplac);
+glm::vec3	KernelSpikyGradient(const glm::vec3& r, float lr, float h);
+float		KernelViscosityLaplacian(float lr, float h);
\ No newline at end of file
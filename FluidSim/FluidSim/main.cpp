@@ -6,6 +6,8 @@
 #include <sstream>
 #include "framework.h"
 #include "fluidsimulator.h"
+#include "framewriter.h"
+#include "scene.h"
 
 int windowWidth = 800;			// Width of the window
 int windowHeight = 600;			// Height of the window
@@ -13,6 +15,7 @@ const float fovy = 60.f;		// Vertical field of view in degrees
 const float zNear = 0.1f;		// Near plane
 const float zFar = 1000.f;		// Far plane
 bool paused = false;
+bool pcisph = false;			// Pressure from PCISPH instead of the equation of state
 
 struct BlockProgram {
 	GLuint program;
@@ -76,11 +79,19 @@ FluidSimulator fluidSimulator(	// The fluid simulator
 int simTime = 0;				// Starting times of simulation and rendering,
 int renderTime = 0;				// used for performance measurement
 float fps = 0.f;				// Frames per second
+FrameWriter recorder(DropBusyFrames);	// Writes every frame to frames.fsf while recording, skipping any the disk cannot keep up with
+unsigned recordedSteps = 0;
+const char* scenePath = "scenes/default.scene";
+Scene scene;					// Emitters of the loaded scene
 
 void UpdateWindowTitle() {
 	std::stringstream ss;
 	ss << "FluidSim - Sim: " << simTime << "ms, Render: " << renderTime << "ms - FPS: " << floor(fps) << " wind: " << (fluidSimulator.isWind()?"Y":"N") << " gravity: " 
-		<< (fluidSimulator.isGravity()?"Y":"N") << " surface tension: " << (fluidSimulator.isSurfaceTension()?"Y":"N") << " octree: " << (fluidSimulator.isUseOctree()?"Y":"N");
+		<< (fluidSimulator.isGravity()?"Y":"N") << " surface tension: " << (fluidSimulator.isSurfaceTension()?"Y":"N") << " octree: " << (fluidSimulator.isUseOctree()?"Y":"N") << " threads: " << fluidSimulator.GetThreadCount()
+		<< " substeps: " << fluidSimulator.GetTimeStepStats().substeps << " dt: " << fluidSimulator.GetTimeStepStats().dt
+		<< " pcisph: " << (pcisph?"Y":"N") << " pressure iterations: " << fluidSimulator.GetPressureSolver().GetStats().iterations
+		<< " recording: " << (recorder.IsOpen()?"Y":"N");
+	if (recorder.IsOpen()) ss << " (" << recorder.GetStats().dropped << " dropped)";
 	glutSetWindowTitle(ss.str().c_str());
 }
 
@@ -285,22 +296,16 @@ unsigned int defaults(unsigned int displayMode, int& width, int& height) {
 	return GLUT_DOUBLE | GLUT_RGBA | GLUT_DEPTH;
 }
 
-void AddParticles() {
-	for (float z = -50.f; z < 40.f; z += 6.f) {
-		for (float y = 0.f; y < 40.f; y += 6.f) {
-			for (float x = 0.f; x < 40.f; x += 6.f) {
-				glm::vec3 position(x, y, z);
-				fluidSimulator.AddParticle(new Particle(position));
-			}
-		}
+// Loads scenePath, or the built-in scene if it cannot be read
+void ResetScene() {
+	std::string error;
+	if (!LoadScene(scenePath, fluidSimulator, scene, error)) {
+		std::cerr << error << ", loading the built-in scene instead" << std::endl;
+		fluidSimulator.Clear();
+		scene = Scene();
+		LoadDefaultScene(fluidSimulator);
 	}
-}
-
-void AddBodies() {
-
-	fluidSimulator.AddBody(new Sphere(glm::vec3(20.f, 70.f, 20.f),20.0, 5.f));
-	fluidSimulator.AddBody(new BoxRotating(glm::vec3(-20.f, 75.f, -20.f), glm::vec3(40.f, 40.f, 40.f), 10.f));
-
+	pcisph = dynamic_cast<PcisphSolver*>(&fluidSimulator.GetPressureSolver()) != 0;
 }
 
 // Initializes our application
@@ -318,8 +323,7 @@ void init() {
 	InitMatrices();
 
 	// Do initialization for simulation
-	AddParticles();
-	AddBodies();
+	ResetScene();
 }
 
 void DisplayBlocks() {
@@ -334,11 +338,10 @@ void DisplayBlocks() {
 	glUniformMatrix4fv(blockProgram.viewMatrixUniform, 1, GL_FALSE, glm::value_ptr(viewMatrix));
 
 	const float particleScale = 3.f;
-	std::vector<Particle*>& particles = fluidSimulator.GetParticles();
-	for (auto pi = particles.begin(); pi != particles.end(); pi++) {
-		Particle* p = *pi;
+	ParticleStore& particles = fluidSimulator.GetParticles();
+	for (unsigned i = 0; i < particles.Size(); i++) {
 		modelMatrix = glm::scale(glm::mat4(1.f), glm::vec3(particleScale, particleScale, particleScale));
-		modelMatrix = glm::translate(modelMatrix, p->position / particleScale);
+		modelMatrix = glm::translate(modelMatrix, particles.position[i] / particleScale);
 		mvpMatrix = projectionMatrix * viewMatrix * modelMatrix;
 		glUniformMatrix4fv(blockProgram.mvpMatrixUniform, 1, GL_FALSE, glm::value_ptr(mvpMatrix));
 		modelViewMatrix = viewMatrix * modelMatrix;
@@ -363,11 +366,9 @@ void DisplaySplats() {
 	viewMatrix = glm::lookAt(cameraPosition, cameraLookAt, glm::vec3(0.f, 1.f, 0.f));
 	glm::vec3 cameraLightDir = glm::vec3(viewMatrix * glm::vec4(lightDir, 0.f));
 
-	std::vector<Particle*>& particles = fluidSimulator.GetParticles();
-	for (auto pi = particles.begin(); pi != particles.end(); pi++) {
-		Particle* p = *pi;
-		
-		glm::vec3 cameraPosition = glm::vec3(viewMatrix * glm::vec4(p->position, 1.f));
+	const ParticleStore& particles = fluidSimulator.GetParticles();
+	for (unsigned i = 0; i < particles.Size(); i++) {
+		glm::vec3 cameraPosition = glm::vec3(viewMatrix * glm::vec4(particles.position[i], 1.f));
 
 		glUniform3fv(splatProgram.cameraLightDirUniform, 1, glm::value_ptr(cameraLightDir));
 		glUniform3fv(splatProgram.cameraPositionUniform, 1, glm::value_ptr(cameraPosition)); 
@@ -408,21 +409,18 @@ void DisplayBody() {
 	viewMatrix = glm::lookAt(cameraPosition, cameraLookAt, glm::vec3(0.f, 1.f, 0.f));
 	glm::vec3 cameraLightDir = glm::vec3(viewMatrix * glm::vec4(lightDir, 0.f));
 
-	std::vector<Body*> bodies = fluidSimulator.GetBodies();
+	const BodyStore& bodies = fluidSimulator.GetBodies();
 
-	for (auto bi = bodies.begin(); bi != bodies.end(); bi++){
-		Body* body = (Body*)*bi;
-		if (dynamic_cast<Sphere*>(body)){
-			const Sphere* sphere = (Sphere*)*bi;
-			glm::vec3 cameraPosition = glm::vec3(viewMatrix * glm::vec4(sphere->center, 1.f));
+	for (auto si = bodies.spheres.begin(); si != bodies.spheres.end(); si++){
+		const Sphere* sphere = &*si;
+		glm::vec3 cameraPosition = glm::vec3(viewMatrix * glm::vec4(sphere->center, 1.f));
 
-			glUniform3fv(splatProgram.cameraLightDirUniform, 1, glm::value_ptr(cameraLightDir));
-			glUniform3fv(splatProgram.cameraPositionUniform, 1, glm::value_ptr(cameraPosition));
-			glUniform1f(splatProgram.sphereRadiusUniform, sphere->size);
-			glUniform3f(splatProgram.baseColorUniform, 0.f, 1.f, 0.f);
-			glUniform1f(splatProgram.opaquenessUniform, 1.f);
-			glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
-		}
+		glUniform3fv(splatProgram.cameraLightDirUniform, 1, glm::value_ptr(cameraLightDir));
+		glUniform3fv(splatProgram.cameraPositionUniform, 1, glm::value_ptr(cameraPosition));
+		glUniform1f(splatProgram.sphereRadiusUniform, sphere->size);
+		glUniform3f(splatProgram.baseColorUniform, 0.f, 1.f, 0.f);
+		glUniform1f(splatProgram.opaquenessUniform, 1.f);
+		glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
 	}
 
 
@@ -437,32 +435,29 @@ void DisplayBody() {
 		viewMatrix = glm::lookAt(cameraPosition, cameraLookAt, glm::vec3(0.f, 1.f, 0.f));
 		glUniformMatrix4fv(blockProgram.viewMatrixUniform, 1, GL_FALSE, glm::value_ptr(viewMatrix));
 
-		for (auto bi = bodies.begin(); bi != bodies.end(); bi++){
-			Body* body = (Body*)*bi;
-			if (dynamic_cast<BoxRotating*>(body)){
-				const BoxRotating* box = (BoxRotating*)*bi;
-				modelMatrix = glm::scale(glm::mat4(1.f), box->size);
-				if (glm::length(box->rotation)>0){
-					glm::mat4 RotationMatrix(1);
-					RotationMatrix = glm::rotate(RotationMatrix, glm::length(box->rotation), glm::normalize(box->rotation));
-					glm::mat4 iRotationMatrix(1);
-					iRotationMatrix = glm::rotate(iRotationMatrix, -glm::length(box->rotation), glm::normalize(box->rotation));
-					modelMatrix = modelMatrix * RotationMatrix;
-					modelMatrix = glm::translate(modelMatrix, glm::vec3(iRotationMatrix * glm::vec4(box->center / box->size, 1.0)));
-				}else{
-					modelMatrix = glm::translate(modelMatrix, box->center / box->size);
-				}
-				
-				
-				mvpMatrix = projectionMatrix * viewMatrix  * modelMatrix;
-				glUniformMatrix4fv(blockProgram.mvpMatrixUniform, 1, GL_FALSE, glm::value_ptr(mvpMatrix));
-				modelViewMatrix = viewMatrix * modelMatrix;
-				glUniformMatrix4fv(blockProgram.modelViewMatrixUniform, 1, GL_FALSE, glm::value_ptr(modelViewMatrix));
-				normalMatrix = glm::transpose(glm::inverse(modelViewMatrix));
-				glUniformMatrix4fv(blockProgram.normalMatrixUniform, 1, GL_FALSE, glm::value_ptr(normalMatrix));
-
-				glDrawElements(GL_TRIANGLES, sizeof(cubeIndices) / sizeof(GLshort), GL_UNSIGNED_SHORT, 0);
+		for (auto bi = bodies.rotatingBoxes.begin(); bi != bodies.rotatingBoxes.end(); bi++){
+			const BoxRotating* box = &*bi;
+			modelMatrix = glm::scale(glm::mat4(1.f), box->size);
+			if (glm::length(box->rotation)>0){
+				glm::mat4 RotationMatrix(1);
+				RotationMatrix = glm::rotate(RotationMatrix, glm::length(box->rotation), glm::normalize(box->rotation));
+				glm::mat4 iRotationMatrix(1);
+				iRotationMatrix = glm::rotate(iRotationMatrix, -glm::length(box->rotation), glm::normalize(box->rotation));
+				modelMatrix = modelMatrix * RotationMatrix;
+				modelMatrix = glm::translate(modelMatrix, glm::vec3(iRotationMatrix * glm::vec4(box->center / box->size, 1.0)));
+			}else{
+				modelMatrix = glm::translate(modelMatrix, box->center / box->size);
 			}
+			
+			
+			mvpMatrix = projectionMatrix * viewMatrix  * modelMatrix;
+			glUniformMatrix4fv(blockProgram.mvpMatrixUniform, 1, GL_FALSE, glm::value_ptr(mvpMatrix));
+			modelViewMatrix = viewMatrix * modelMatrix;
+			glUniformMatrix4fv(blockProgram.modelViewMatrixUniform, 1, GL_FALSE, glm::value_ptr(modelViewMatrix));
+			normalMatrix = glm::transpose(glm::inverse(modelViewMatrix));
+			glUniformMatrix4fv(blockProgram.normalMatrixUniform, 1, GL_FALSE, glm::value_ptr(normalMatrix));
+
+			glDrawElements(GL_TRIANGLES, sizeof(cubeIndices) / sizeof(GLshort), GL_UNSIGNED_SHORT, 0);
 		}
 	}
 
@@ -493,8 +488,12 @@ void simulate() {
 	float dt = (float)(simTime + renderTime) / 1000.f;
 	fps = 1.f / dt;
 
-	if (!paused)
-		fluidSimulator.ExplicitEulerStep(0.1f);
+	// Every frame advances the simulation by the same time, split into substeps as the flow requires
+	if (!paused) {
+		fluidSimulator.Advance(0.1f);
+		UpdateScene(fluidSimulator, scene, 0.1f);
+		if (recorder.IsOpen()) recorder.Submit(fluidSimulator.GetParticles(), ++recordedSteps);
+	}
 
 	// Start drawing again
 	glutPostRedisplay();
@@ -506,7 +505,7 @@ void keyboard(unsigned char key, int x, int y) {
 	// Shut down program if ESC key is pressed
 	if (key == 27) glutLeaveMainLoop();
 	// Reset simulation if Space key is pressed
-	if (key == ' ') { fluidSimulator.Clear(); AddParticles(); AddBodies(); }
+	if (key == ' ') { ResetScene(); }
 	// Toggle gravity force with G key
 	if (key == 'g') { fluidSimulator.ToggleFluidGravity(); }
 	// Toggle gravity force with G key
@@ -514,15 +513,29 @@ void keyboard(unsigned char key, int x, int y) {
 	// Toggle wind force with W key
 	if (key == 'w') { fluidSimulator.ToggleWind(); }
 
-	if (key == 'i'){ fluidSimulator.movingBody->center += glm::vec3(0.f, 3.f, 0.f); }
-	if (key == 'k'){ fluidSimulator.movingBody->center -= glm::vec3(0.f, 3.f, 0.f); }
+	if (key == 'i' && fluidSimulator.GetMovingBody()){ fluidSimulator.GetMovingBody()->center += glm::vec3(0.f, 3.f, 0.f); }
+	if (key == 'k' && fluidSimulator.GetMovingBody()){ fluidSimulator.GetMovingBody()->center -= glm::vec3(0.f, 3.f, 0.f); }
 
 	// Toggle surface tension force with S key
-	if (key == 's') { fluidSimulator.ToggleSurfaceTension(); }
+	if (key == 's') { fluidSimulator.ToggleSurfaceTension(); }
 	// Toggle octree with O key
-	if (key == 'o') { fluidSimulator.ToggleUseOctree(); }
+	if (key == 'o') { fluidSimulator.ToggleUseOctree(); }
+	// Toggle between one thread and all hardware threads with T key
+	if (key == 't') { fluidSimulator.SetThreadCount(fluidSimulator.GetThreadCount() > 1 ? 1 : 0); }
 	// Pause simulation with P key
-	if (key == 'p') { paused = !paused; }
+	if (key == 'p') { paused = !paused; }
+	// Start or stop recording the particles to frames.fsf with R key
+	if (key == 'r') {
+		if (recorder.IsOpen()) recorder.Close();
+		else if (recorder.Open("frames.fsf", fluidSimulator.GetBoundingBox())) recordedSteps = 0;
+	}
+	// Switch between the equation of state and PCISPH with C key, PCISPH predicts with symplectic Euler
+	if (key == 'c') {
+		pcisph = !pcisph;
+		if (pcisph) fluidSimulator.SetPressureSolver(std::unique_ptr<PressureSolver>(new PcisphSolver()));
+		else fluidSimulator.SetPressureSolver(std::unique_ptr<PressureSolver>(new EquationOfStateSolver()));
+		fluidSimulator.SetIntegrator(pcisph ? SymplecticEuler : ExplicitEuler);
+	}
 }
 
 // Handles reshaping of the window
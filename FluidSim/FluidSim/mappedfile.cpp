@@ -0,0 +1,98 @@
+#include "mappedfile.h"
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+
+MappedFile::MappedFile() :
+	file(INVALID_HANDLE_VALUE),
+	mapping(0),
+	data(0),
+	size(0) {
+}
+
+bool MappedFile::Open(const std::string& path) {
+	Close();
+	file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, 0);
+	if (file == INVALID_HANDLE_VALUE) return false;
+
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0 || (unsigned long long)fileSize.QuadPart > (size_t)-1) {
+		Close();
+		return false;
+	}
+	mapping = CreateFileMappingA(file, 0, PAGE_READONLY, 0, 0, 0);
+	if (!mapping) {
+		Close();
+		return false;
+	}
+	data = (const unsigned char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (!data) {
+		Close();
+		return false;
+	}
+	size = (size_t)fileSize.QuadPart;
+	return true;
+}
+
+void MappedFile::Close() {
+	if (data) UnmapViewOfFile(data);
+	if (mapping) CloseHandle(mapping);
+	if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+	file = INVALID_HANDLE_VALUE;
+	mapping = 0;
+	data = 0;
+	size = 0;
+}
+
+#else
+
+MappedFile::MappedFile() :
+	file(-1),
+	data(0),
+	size(0) {
+}
+
+bool MappedFile::Open(const std::string& path) {
+	Close();
+	file = open(path.c_str(), O_RDONLY);
+	if (file < 0) return false;
+
+	struct stat status;
+	if (fstat(file, &status) != 0 || status.st_size == 0) {
+		Close();
+		return false;
+	}
+	void* view = mmap(0, (size_t)status.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+	if (view == MAP_FAILED) {
+		Close();
+		return false;
+	}
+	// The file is read front to back once
+	madvise(view, (size_t)status.st_size, MADV_SEQUENTIAL);
+	data = (const unsigned char*)view;
+	size = (size_t)status.st_size;
+	return true;
+}
+
+void MappedFile::Close() {
+	if (data) munmap((void*)data, size);
+	if (file >= 0) close(file);
+	file = -1;
+	data = 0;
+	size = 0;
+}
+
+#endif
+
+MappedFile::~MappedFile() {
+	Close();
+}
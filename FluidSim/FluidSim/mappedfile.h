@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+// Read-only view of a whole file, mapped into memory instead of read
+// The pages are only loaded as they are touched, so copying out of a large file runs at disk speed
+class MappedFile {
+public:
+	MappedFile();
+	~MappedFile();
+
+	// Returns false if the file could not be opened or mapped; empty files cannot be mapped
+	bool		Open(const std::string& path);
+	void		Close();
+
+	const unsigned char*	Data() const { return data; }
+	size_t					Size() const { return size; }
+
+private:
+	MappedFile(const MappedFile&);
+	MappedFile& operator=(const MappedFile&);
+
+#ifdef _WIN32
+	void*		file;		// HANDLEs, kept as void* so windows.h stays out of this header
+	void*		mapping;
+#else
+	int			file;
+#endif
+	const unsigned char*	data;
+	size_t					size;
+};
@@ -0,0 +1,144 @@
+#include "neighbourlist.h"
+
+#include <glm/gtx/norm.hpp>
+#include <cmath>
+
+NeighbourList::NeighbourList() :
+	skin(0.f),
+	valid(false),
+	blockSize(1) {
+}
+
+void NeighbourList::SetSkin(float skin) {
+	this->skin = skin < 0.f ? 0.f : skin;
+	valid = false;
+}
+
+// True if the candidate pairs have to be searched again for the current positions
+bool NeighbourList::NeedsRebuild(const ParticleStore& particles) const {
+	if (!valid || skin <= 0.f) return true;
+	if (buildPosition.size() != particles.Size()) return true;
+
+	const float limit = 0.25f * skin * skin;	// (skin / 2)^2
+	for (unsigned i = 0; i < particles.Size(); i++) {
+		if (glm::length2(particles.position[i] - buildPosition[i]) > limit)
+			return true;
+	}
+	return false;
+}
+
+// Drops removed particles from the candidate pairs and renumbers the rest
+// Remove keeps the order of the particles, so every row moves down in place
+void NeighbourList::Remove(const std::vector<unsigned>& remap, unsigned kept) {
+	if (!valid) return;
+	const unsigned n = (unsigned)candidateCount.size();
+	// Particles added since the last search have no rows yet
+	if (remap.size() != n) {
+		valid = false;
+		return;
+	}
+
+	unsigned c = 0;
+	for (unsigned i = 0; i < n; i++) {
+		const unsigned row = remap[i];
+		const unsigned first = candidateStart[i];
+		const unsigned last = candidateStart[i + 1];
+		if (row == removedParticle) continue;
+
+		candidateStart[row] = c;
+		for (unsigned k = first; k < last; k++) {
+			const unsigned j = remap[candidateIndex[k]];
+			if (j != removedParticle) candidateIndex[c++] = j;
+		}
+		candidateCount[row] = c - candidateStart[row];
+		buildPosition[row] = buildPosition[i];
+	}
+	candidateStart[kept] = c;
+	candidateStart.resize(kept + 1);
+	candidateCount.resize(kept);
+	candidateIndex.resize(c);
+	buildPosition.resize(kept);
+}
+
+void NeighbourList::BeginBuild(const ParticleStore& particles, unsigned blockSize) {
+	const unsigned n = particles.Size();
+	this->blockSize = blockSize > 0 ? blockSize : 1;
+
+	buildPosition = particles.position;
+	blockCandidates.resize((n + this->blockSize - 1) / this->blockSize);
+	for (auto bi = blockCandidates.begin(); bi != blockCandidates.end(); bi++)
+		bi->clear();
+	candidateCount.assign(n, 0);
+}
+
+void NeighbourList::EndBuild() {
+	const unsigned n = (unsigned)candidateCount.size();
+
+	candidateStart.resize(n + 1);
+	candidateStart[0] = 0;
+	for (unsigned i = 0; i < n; i++)
+		candidateStart[i + 1] = candidateStart[i] + candidateCount[i];
+
+	// Blocks hold consecutive rows, so concatenating them in order gives the rows in order
+	candidateIndex.clear();
+	candidateIndex.reserve(candidateStart[n]);
+	for (auto bi = blockCandidates.begin(); bi != blockCandidates.end(); bi++)
+		candidateIndex.insert(candidateIndex.end(), bi->begin(), bi->end());
+
+	valid = true;
+}
+
+void NeighbourList::PrepareRefresh() {
+	const unsigned n = (unsigned)candidateCount.size();
+	start.assign(candidateStart.begin(), candidateStart.begin() + n);
+	end.resize(n);
+	index.resize(candidateIndex.size());
+	r.resize(candidateIndex.size());
+	length.resize(candidateIndex.size());
+	weight.resize(candidateIndex.size());
+	weight2.resize(candidateIndex.size());
+}
+
+// Fills in the entries of particles [begin, end) from the candidates, keeping only pairs within h
+void NeighbourList::Refresh(const ParticleStore& particles, float h, unsigned begin, unsigned end) {
+	const float hs = h*h;
+
+	for (unsigned i = begin; i < end; i++) {
+		const glm::vec3 pi = particles.position[i];
+		unsigned k = start[i];
+		for (unsigned c = candidateStart[i]; c < candidateStart[i + 1]; c++) {
+			const unsigned j = candidateIndex[c];
+			const glm::vec3 rij = pi - particles.position[j];
+			const float rs = glm::length2(rij);
+			if (rs > hs) continue;
+
+			index[k] = j;
+			r[k] = rij;
+			length[k] = sqrt(rs);
+			k++;
+		}
+		this->end[i] = k;
+	}
+}
+
+// Pairs kept by the last Refresh
+unsigned NeighbourList::PairCount() const {
+	unsigned pairs = 0;
+	for (unsigned i = 0; i < end.size(); i++)
+		pairs += end[i] - start[i];
+	return pairs;
+}
+
+float NeighbourList::Locality(unsigned window) const {
+	// Every eighth row is plenty for a fraction and keeps this well below the cost of the search
+	const unsigned stride = 8;
+	unsigned pairs = 0, local = 0;
+	for (unsigned i = 0; i + 1 < candidateStart.size(); i += stride) {
+		pairs += candidateStart[i + 1] - candidateStart[i];
+		// |j - i| < window without a branch: the difference wraps around for j < i, shifting it by window - 1
+		// lines both sides up in [0, 2 * window - 1)
+		for (unsigned k = candidateStart[i]; k < candidateStart[i + 1]; k++)
+			local += candidateIndex[k] - i + window - 1 < 2 * window - 1 ? 1 : 0;
+	}
+	return pairs > 0 ? (float)local / (float)pairs : 1.f;
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <vector>
+#include "particlestore.h"
+
+// Neighbours within the SPH radius of every particle, built once per step and read by all SPH passes
+// The neighbours of particle i are entries [Begin(i), End(i)) of index, r and length; with half pairs
+// (see PairMode) every pair is an entry of only one of its two particles
+// With a Verlet skin the candidate pairs are found within h + skin and reused over several steps,
+// until some particle has moved more than half the skin since the last build
+class NeighbourList {
+public:
+	NeighbourList();
+
+	void		SetSkin(float skin);
+	float		GetSkin() const { return skin; }
+
+	// Forces a full rebuild on the next step, e.g. when particles were added or reordered
+	void		Invalidate() { valid = false; }
+
+	// Drops removed particles from the candidate pairs and renumbers the rest after ParticleStore::Remove,
+	// so the pairs stay usable without a new search
+	void		Remove(const std::vector<unsigned>& remap, unsigned kept);
+
+	// True if the candidate pairs have to be searched again for the current positions
+	bool		NeedsRebuild(const ParticleStore& particles) const;
+
+	// Candidate search: BeginBuild, AddCandidate(i, j) for every candidate j of every particle i, then EndBuild
+	// The particles may be split over threads in blocks of blockSize, as long as
+	// each block is handled by a single thread in increasing order of i
+	void		BeginBuild(const ParticleStore& particles, unsigned blockSize);
+	void		AddCandidate(unsigned i, unsigned j) { blockCandidates[i / blockSize].push_back(j); candidateCount[i]++; }
+	void		EndBuild();
+
+	// Fills in the entries of particles [begin, end) from the candidates, keeping only pairs within h
+	// Call PrepareRefresh first; ranges can be refreshed in parallel
+	void		PrepareRefresh();
+	void		Refresh(const ParticleStore& particles, float h, unsigned begin, unsigned end);
+
+	unsigned	Begin(unsigned i) const { return start[i]; }
+	unsigned	End(unsigned i) const { return end[i]; }
+
+	// Candidate pairs checked by Refresh, and the pairs it kept
+	unsigned	CandidateCount() const { return (unsigned)candidateIndex.size(); }
+	unsigned	PairCount() const;
+
+	// Fraction of the candidate pairs (i, j) with j less than window particles away from i in storage, over a sample of
+	// the particles: how much of what the pair loops read lies close together in memory; 1 if there are no pairs
+	float		Locality(unsigned window) const;
+
+	// Every row has room for all of its candidates, entries [End(i), Begin(i+1)) are unused
+	std::vector<unsigned>	start;			// First entry of every particle
+	std::vector<unsigned>	end;			// One past the last entry of every particle
+	std::vector<unsigned>	index;			// Index of the neighbour j
+	std::vector<glm::vec3>	r;				// position[i] - position[j]
+	std::vector<float>		length;			// |r|
+
+	// Scratch for kernel values per entry, a pass fills the rows it reads with the batch kernels
+	std::vector<float>		weight;
+	std::vector<float>		weight2;
+
+private:
+	float					skin;
+	bool					valid;
+	unsigned				blockSize;
+	std::vector<std::vector<unsigned>>	blockCandidates;	// Candidates per block while building
+	std::vector<unsigned>	candidateCount;
+	std::vector<unsigned>	candidateStart;
+	std::vector<unsigned>	candidateIndex;
+	std::vector<glm::vec3>	buildPosition;	// Positions at the last candidate search
+};
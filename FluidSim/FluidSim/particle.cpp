@@ -7,7 +7,7 @@ const float standardMass = 1.f;
 const float standardDensity = 0.f;
 const float standardRestDensity = 1.f;
 const float standardPressure = 0.f;
-const int standardHash = -1;
+const bool standardCollision = false;
 
 Particle::Particle() :
 	position(standardPosition),
@@ -17,7 +17,7 @@ Particle::Particle() :
 	density(standardDensity),
 	restDensity(standardRestDensity),
 	pressure(standardPressure),
-	hashOctree(standardHash) {
+	collision(standardCollision) {
 }
 
 Particle::Particle(const glm::vec3& position) :
@@ -28,7 +28,7 @@ Particle::Particle(const glm::vec3& position) :
 	density(standardDensity),
 	restDensity(standardRestDensity),
 	pressure(standardPressure),
-	hashOctree(standardHash) {
+	collision(standardCollision) {
 }
 
 Particle::Particle(const glm::vec3& position, const glm::vec3& velocity) :
@@ -39,7 +39,7 @@ Particle::Particle(const glm::vec3& position, const glm::vec3& velocity) :
 	density(standardDensity),
 	restDensity(standardRestDensity),
 	pressure(standardPressure),
-	hashOctree(standardHash) {
+	collision(standardCollision) {
 }
 
 Particle::Particle(const glm::vec3& position, const glm::vec3& velocity, float mass) :
@@ -50,7 +50,7 @@ Particle::Particle(const glm::vec3& position, const glm::vec3& velocity, float m
 	density(standardDensity),
 	restDensity(standardRestDensity),
 	pressure(standardPressure),
-	hashOctree(standardHash) {
+	collision(standardCollision) {
 }
 
 Particle::Particle(const glm::vec3& position, const glm::vec3& velocity, float mass, float restDensity) :
@@ -61,5 +61,5 @@ Particle::Particle(const glm::vec3& position, const glm::vec3& velocity, float m
 	density(standardDensity),
 	restDensity(restDensity),
 	pressure(standardPressure),
-	hashOctree(standardHash) {
+	collision(standardCollision) {
 }
\ No newline at end of file
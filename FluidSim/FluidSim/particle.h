@@ -17,7 +17,6 @@ public:
 	float		mass;
 	float		density;
 	float		restDensity;
-	float		pressure;
-	int			hashOctree;
-	bool		collision;
+	float		pressure;
+	bool		collision;
 };
\ No newline at end of file
@@ -0,0 +1,202 @@
+#include "particlestore.h"
+
+#include <algorithm>
+
+ParticleRef::ParticleRef(ParticleStore& store, unsigned index) :
+	position(store.position[index]),
+	velocity(store.velocity[index]),
+	forceAccum(store.forceAccum[index]),
+	mass(store.mass[index]),
+	density(store.density[index]),
+	restDensity(store.restDensity[index]),
+	pressure(store.pressure[index]),
+	collision(store.collision[index]),
+	id(store.id[index]) {
+}
+
+ParticleStore::ParticleStore() :
+	nextId(0),
+	freeSlot(removedParticle) {
+}
+
+void ParticleStore::Reserve(unsigned count) {
+	position.reserve(count);
+	velocity.reserve(count);
+	forceAccum.reserve(count);
+	mass.reserve(count);
+	density.reserve(count);
+	restDensity.reserve(count);
+	pressure.reserve(count);
+	collision.reserve(count);
+	id.reserve(count);
+	slot.reserve(count);
+}
+
+void ParticleStore::Clear() {
+	// The slots are freed rather than forgotten, so handles from before the Clear stay invalid
+	for (unsigned i = 0; i < slot.size(); i++)
+		ReleaseSlot(slot[i]);
+	slot.clear();
+	position.clear();
+	velocity.clear();
+	forceAccum.clear();
+	mass.clear();
+	density.clear();
+	restDensity.clear();
+	pressure.clear();
+	collision.clear();
+	id.clear();
+	nextId = 0;
+}
+
+// Appends a copy of particle and returns its index
+unsigned ParticleStore::Add(const Particle& particle) {
+	position.push_back(particle.position);
+	velocity.push_back(particle.velocity);
+	forceAccum.push_back(particle.forceAccum);
+	mass.push_back(particle.mass);
+	density.push_back(particle.density);
+	restDensity.push_back(particle.restDensity);
+	pressure.push_back(particle.pressure);
+	collision.push_back(particle.collision ? 1 : 0);
+	id.push_back(nextId++);
+	slot.push_back(AcquireSlot(Size() - 1));
+	return Size() - 1;
+}
+
+// Appends count particles with the values of Particle() and fresh ids, returns the index of the first
+unsigned ParticleStore::Append(unsigned count) {
+	const unsigned first = Size();
+	const unsigned size = first + count;
+	if (size > position.capacity()) Reserve(std::max(size, first + first / 2));
+
+	const Particle defaults;
+	position.resize(size, defaults.position);
+	velocity.resize(size, defaults.velocity);
+	forceAccum.resize(size, defaults.forceAccum);
+	mass.resize(size, defaults.mass);
+	density.resize(size, defaults.density);
+	restDensity.resize(size, defaults.restDensity);
+	pressure.resize(size, defaults.pressure);
+	collision.resize(size, defaults.collision ? 1 : 0);
+	id.resize(size);
+	slot.resize(size);
+	for (unsigned i = first; i < size; i++) {
+		id[i] = nextId++;
+		slot[i] = AcquireSlot(i);
+	}
+	return first;
+}
+
+void ParticleStore::Resize(unsigned count) {
+	position.resize(count, glm::vec3(0.f));
+	velocity.resize(count, glm::vec3(0.f));
+	forceAccum.resize(count, glm::vec3(0.f));
+	mass.resize(count, 0.f);
+	density.resize(count, 0.f);
+	restDensity.resize(count, 0.f);
+	pressure.resize(count, 0.f);
+	collision.resize(count, 0);
+	id.resize(count, 0);
+
+	for (unsigned i = count; i < slot.size(); i++)
+		ReleaseSlot(slot[i]);
+	const unsigned first = (unsigned)slot.size();
+	slot.resize(count);
+	for (unsigned i = first; i < count; i++)
+		slot[i] = AcquireSlot(i);
+}
+
+// Copies particle i back into a standalone Particle
+Particle ParticleStore::Get(unsigned i) const {
+	Particle particle(position[i], velocity[i], mass[i], restDensity[i]);
+	particle.forceAccum = forceAccum[i];
+	particle.density = density[i];
+	particle.pressure = pressure[i];
+	particle.collision = collision[i] != 0;
+	return particle;
+}
+
+// Gathers values into scratch in the given order and swaps the result back into values
+template <typename T>
+static void Gather(std::vector<T>& values, const std::vector<unsigned>& order, std::vector<T>& scratch) {
+	scratch.resize(values.size());
+	for (unsigned i = 0; i < order.size(); i++)
+		scratch[i] = values[order[i]];
+	values.swap(scratch);
+}
+
+// Reorders the particles so that particle i moves to where order[i] was
+void ParticleStore::Permute(const std::vector<unsigned>& order) {
+	Gather(position, order, scratchVec3);
+	Gather(velocity, order, scratchVec3);
+	Gather(forceAccum, order, scratchVec3);
+	Gather(mass, order, scratchFloat);
+	Gather(density, order, scratchFloat);
+	Gather(restDensity, order, scratchFloat);
+	Gather(pressure, order, scratchFloat);
+	Gather(collision, order, scratchChar);
+	Gather(id, order, scratchUnsigned);
+	Gather(slot, order, scratchUnsigned);
+	for (unsigned i = 0; i < slot.size(); i++)
+		slotIndex[slot[i]] = i;
+}
+
+// Moves every kept value to its new index and drops the rest
+template <typename T>
+static void Keep(std::vector<T>& values, const std::vector<unsigned>& remap, unsigned kept) {
+	for (unsigned i = 0; i < remap.size(); i++)
+		if (remap[i] != removedParticle) values[remap[i]] = values[i];
+	values.resize(kept);
+}
+
+// Removes the particles i with dead[i] set in one pass, the others keep their order
+void ParticleStore::Remove(const std::vector<char>& dead, std::vector<unsigned>& remap) {
+	const unsigned n = Size();
+	remap.resize(n);
+	unsigned kept = 0;
+	for (unsigned i = 0; i < n; i++) {
+		if (dead[i]) {
+			ReleaseSlot(slot[i]);
+			remap[i] = removedParticle;
+		} else remap[i] = kept++;
+	}
+	if (kept == n) return;
+
+	Keep(position, remap, kept);
+	Keep(velocity, remap, kept);
+	Keep(forceAccum, remap, kept);
+	Keep(mass, remap, kept);
+	Keep(density, remap, kept);
+	Keep(restDensity, remap, kept);
+	Keep(pressure, remap, kept);
+	Keep(collision, remap, kept);
+	Keep(id, remap, kept);
+	Keep(slot, remap, kept);
+	for (unsigned i = 0; i < kept; i++)
+		slotIndex[slot[i]] = i;
+}
+
+bool ParticleStore::Find(ParticleHandle handle, unsigned& index) const {
+	if (handle.slot >= slotIndex.size() || slotGeneration[handle.slot] != handle.generation) return false;
+	index = slotIndex[handle.slot];
+	return true;
+}
+
+unsigned ParticleStore::AcquireSlot(unsigned index) {
+	unsigned s = freeSlot;
+	if (s != removedParticle) freeSlot = slotIndex[s];
+	else {
+		s = (unsigned)slotIndex.size();
+		slotIndex.push_back(0);
+		slotGeneration.push_back(0);
+	}
+	slotIndex[s] = index;
+	return s;
+}
+
+void ParticleStore::ReleaseSlot(unsigned s) {
+	slotGeneration[s]++;
+	slotIndex[s] = freeSlot;
+	freeSlot = s;
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <vector>
+#include "particle.h"
+
+class ParticleStore;
+
+// Refers to one particle for as long as it lives, however often its index changes
+// Once the particle is removed its handles stay invalid, even after the slot is used again
+struct ParticleHandle {
+	unsigned	slot;
+	unsigned	generation;
+
+	ParticleHandle() : slot(~0u), generation(0) {}
+	ParticleHandle(unsigned slot, unsigned generation) : slot(slot), generation(generation) {}
+
+	bool operator==(const ParticleHandle& other) const { return slot == other.slot && generation == other.generation; }
+	bool operator!=(const ParticleHandle& other) const { return !(*this == other); }
+};
+
+// Index Remove gives the particles it removed
+const unsigned removedParticle = ~0u;
+
+// View on a single particle inside a ParticleStore
+// Lets code that used to walk Particle pointers keep writing p.position, p.density, ...
+class ParticleRef {
+public:
+	ParticleRef(ParticleStore& store, unsigned index);
+
+	glm::vec3&	position;
+	glm::vec3&	velocity;
+	glm::vec3&	forceAccum;		// Force accumulator
+	float&		mass;
+	float&		density;
+	float&		restDensity;
+	float&		pressure;
+	char&		collision;
+	unsigned&	id;
+};
+
+// Contiguous structure-of-arrays storage for the fluid particles
+// Every attribute lives in its own array, so loops that only need positions or densities stream through memory
+class ParticleStore {
+public:
+	ParticleStore();
+
+	unsigned	Size() const { return (unsigned)position.size(); }
+	bool		Empty() const { return position.empty(); }
+	void		Reserve(unsigned count);
+	void		Clear();
+
+	// Appends a copy of particle and returns its index
+	unsigned	Add(const Particle& particle);
+
+	// Appends count particles with the values of Particle() and fresh ids, returns the index of the first
+	// The arrays grow once per call, and by at least half their size, so many small appends stay cheap
+	unsigned	Append(unsigned count);
+
+	// Resizes every array to count, for filling them in directly; new entries are zeroed
+	void		Resize(unsigned count);
+
+	// Id the next added particle gets
+	unsigned	GetNextId() const { return nextId; }
+	void		SetNextId(unsigned id) { nextId = id; }
+
+	// Copies particle i back into a standalone Particle
+	Particle	Get(unsigned i) const;
+
+	ParticleRef	operator[](unsigned i) { return ParticleRef(*this, i); }
+
+	// Reorders the particles so that particle i moves to where order[i] was
+	void		Permute(const std::vector<unsigned>& order);
+
+	// Removes the particles i with dead[i] set in one pass, the others keep their order
+	// Sets remap[i] to the new index of particle i, or to removedParticle
+	void		Remove(const std::vector<char>& dead, std::vector<unsigned>& remap);
+
+	// Handle of particle i, and the index the particle of a handle is at now
+	// Find returns false if the particle has been removed
+	ParticleHandle	GetHandle(unsigned i) const { return ParticleHandle(slot[i], slotGeneration[slot[i]]); }
+	bool		Find(ParticleHandle handle, unsigned& index) const;
+
+	std::vector<glm::vec3>	position;
+	std::vector<glm::vec3>	velocity;
+	std::vector<glm::vec3>	forceAccum;		// Force accumulator
+	std::vector<float>		mass;
+	std::vector<float>		density;
+	std::vector<float>		restDensity;
+	std::vector<float>		pressure;
+	std::vector<char>		collision;		// char instead of bool, std::vector<bool> is bit-packed
+	std::vector<unsigned>	id;				// Stays with the particle when the store is reordered
+
+private:
+	// Slot table behind the handles; free slots are chained through slotIndex
+	unsigned	AcquireSlot(unsigned index);
+	void		ReleaseSlot(unsigned s);
+
+	unsigned				nextId;
+	std::vector<unsigned>	slot;			// Slot of every particle, moves along like id
+	std::vector<unsigned>	slotIndex;		// Index of the particle in every slot in use, the next free slot otherwise
+	std::vector<unsigned>	slotGeneration;	// Incremented whenever a slot is freed, so old handles no longer match
+	unsigned				freeSlot;		// First free slot, removedParticle if there is none
+
+	// Scratch buffers for Permute, kept around so reordering does not allocate every step
+	std::vector<glm::vec3>	scratchVec3;
+	std::vector<float>		scratchFloat;
+	std::vector<char>		scratchChar;
+	std::vector<unsigned>	scratchUnsigned;
+};
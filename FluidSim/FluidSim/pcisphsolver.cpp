@@ -0,0 +1,224 @@
+#include "pcisphsolver.h"
+
+#include <algorithm>
+#include <cmath>
+#include "fluidsimulator.h"
+#include "kernelbatch.h"
+#include "profiler.h"
+
+PcisphSolver::PcisphSolver(float tolerance, unsigned minIterations, unsigned maxIterations) :
+	tolerance(tolerance),
+	delta(0.f) {
+	SetIterations(minIterations, maxIterations);
+}
+
+void PcisphSolver::SetIterations(unsigned minIterations, unsigned maxIterations) {
+	this->minIterations = std::max(1u, minIterations);
+	this->maxIterations = std::max(this->minIterations, maxIterations);
+}
+
+void PcisphSolver::Reset() {
+	PressureSolver::Reset();
+	delta = 0.f;
+}
+
+// A particle whose neighbours all share its pressure p is pushed out by dt^2 * p / density * sum grad W,
+// and changes its density by -m * dt^2 * p / density * (|sum grad W|^2 + sum |grad W|^2)
+// Solving that for p gives the pressure that undoes a density error, at a particle with a full neighbourhood
+void PcisphSolver::MeasureDelta(const FluidSimulator& simulator) {
+	const ParticleStore& particles = simulator.particles;
+	const NeighbourList& neighbours = simulator.neighbours;
+	const unsigned i = referenceParticle;
+
+	glm::vec3 sum(0.f);
+	float sumSquared = 0.f;
+	for (unsigned k = neighbours.Begin(i); k < neighbours.End(i); k++) {
+		const glm::vec3 g = gradient[k] * neighbours.r[k];
+		sum += g;
+		sumSquared += glm::dot(g, g);
+	}
+	// With half pairs some neighbours list i in their rows instead, where r points the other way; this runs once
+	if (simulator.pairMode == HalfPairs) {
+		for (unsigned j = 0; j < particles.Size(); j++) {
+			for (unsigned k = neighbours.Begin(j); k < neighbours.End(j); k++) {
+				if (neighbours.index[k] != i) continue;
+				const glm::vec3 g = -gradient[k] * neighbours.r[k];
+				sum += g;
+				sumSquared += glm::dot(g, g);
+			}
+		}
+	}
+
+	const float denominator = particles.mass[i] * (glm::dot(sum, sum) + sumSquared);
+	delta = denominator > 0.f ? TargetDensity(particles, i) / denominator : 0.f;
+}
+
+void PcisphSolver::Solve(FluidSimulator& simulator, float dt) {
+	PROFILE_SCOPE("PcisphSolver");
+	ParticleStore& particles = simulator.particles;
+	NeighbourList& neighbours = simulator.neighbours;
+	const unsigned n = particles.Size();
+	stats = PressureSolverStats();
+	if (n == 0 || dt <= 0.f) return;
+
+	const glm::vec3* position = &particles.position[0];
+	const glm::vec3* velocity = &particles.velocity[0];
+	const float* mass = &particles.mass[0];
+	const float* density = &particles.density[0];
+	float* pressure = &particles.pressure[0];
+	glm::vec3* forceAccum = &particles.forceAccum[0];
+
+	// The gradients at the current positions stay the same over all iterations
+	gradient.resize(neighbours.weight.size());
+	simulator.ForParticles(n, [&](unsigned begin, unsigned end) {
+		for (unsigned i = begin; i < end; i++) {
+			const unsigned first = neighbours.Begin(i), last = neighbours.End(i);
+			if (first != last)
+				KernelSpikyGradientBatch(&neighbours.length[first], &gradient[first], last - first, simulator.kernels);
+		}
+	});
+
+	// Particles are reordered and removed between steps, so delta is measured in the step the reference particle was found
+	if (MeasureReference(particles)) MeasureDelta(simulator);
+	const float stepDelta = delta / (dt * dt);
+
+	predicted.resize(n);
+	predictedDensity.resize(n);
+	pressureForce.assign(n, glm::vec3(0.f));
+	std::fill(particles.pressure.begin(), particles.pressure.end(), 0.f);
+
+	const float errorScale = referenceExcess > 0.f ? 1.f / referenceExcess : 0.f;
+	const bool half = simulator.pairMode == HalfPairs;
+	if (half) {
+		densityBuffer.Prepare(simulator.sliceLayout, 0.f);
+		forceBuffer.Prepare(simulator.sliceLayout, glm::vec3(0.f));
+	}
+	float maxError = 0.f;
+	while (stats.iterations < maxIterations) {
+		// Predict the positions with the other forces and the pressure forces so far
+		simulator.ForParticles(n, [&](unsigned begin, unsigned end) {
+			for (unsigned i = begin; i < end; i++)
+				predicted[i] = position[i] + dt * (velocity[i] + dt * (forceAccum[i] + pressureForce[i]) / mass[i]);
+		});
+
+		// Their densities, and the pressure that corrects them; only compression is corrected
+		if (half) PredictDensitiesHalf(simulator, stepDelta);
+		else simulator.ForParticles(n, [&](unsigned begin, unsigned end) {
+			for (unsigned i = begin; i < end; i++) {
+				float d = particles.restDensity[i];
+				const unsigned first = neighbours.Begin(i), last = neighbours.End(i);
+				if (first != last) {
+					float* lr = &neighbours.weight2[first];
+					float* w = &neighbours.weight[first];
+					for (unsigned k = first; k < last; k++)
+						lr[k - first] = glm::length(predicted[i] - predicted[neighbours.index[k]]);
+					KernelPoly6Batch(lr, w, last - first, simulator.kernels);
+					for (unsigned k = first; k < last; k++)
+						d += mass[neighbours.index[k]] * w[k - first];
+				}
+				predictedDensity[i] = d;
+				pressure[i] = std::max(0.f, pressure[i] + stepDelta * (d - TargetDensity(particles, i)));
+			}
+		});
+		stats.iterations++;
+
+		maxError = 0.f;
+		for (unsigned i = 0; i < n; i++)
+			maxError = std::max(maxError, (predictedDensity[i] - TargetDensity(particles, i)) * errorScale);
+
+		// The same pressure force as the equation of state, with the corrected pressures
+		if (half) PressureForcesHalf(simulator);
+		else simulator.ForParticles(n, [&](unsigned begin, unsigned end) {
+			for (unsigned i = begin; i < end; i++) {
+				glm::vec3 f(0.f);
+				if (fabs(density[i]) >= 1e-8f) {
+					for (unsigned k = neighbours.Begin(i); k < neighbours.End(i); k++) {
+						const unsigned j = neighbours.index[k];
+						if (fabs(density[j]) < 1e-8f) continue; // Prevent division by 0
+						f -= mass[j] * ((pressure[i] + pressure[j]) / (2.f * density[j])) * gradient[k] * neighbours.r[k];
+					}
+				}
+				pressureForce[i] = f;
+			}
+		});
+
+		if (stats.iterations >= minIterations && maxError <= tolerance) break;
+	}
+
+	for (unsigned i = 0; i < n; i++)
+		forceAccum[i] += pressureForce[i];
+
+	MeasureDensityError(particles, &predictedDensity[0]);
+	PROFILE_COUNT("pressure iterations", stats.iterations);
+	PROFILE_MAX("density error", stats.maxDensityError);
+}
+
+// The predicted densities and pressures with half pairs, every pair adds to both particles
+void PcisphSolver::PredictDensitiesHalf(FluidSimulator& simulator, float stepDelta) {
+	ParticleStore& particles = simulator.particles;
+	NeighbourList& neighbours = simulator.neighbours;
+	const unsigned n = particles.Size();
+	const float* mass = &particles.mass[0];
+	float* pressure = &particles.pressure[0];
+
+	simulator.ForParticles(n, [&](unsigned begin, unsigned end) {
+		for (unsigned i = begin; i < end; i++)
+			predictedDensity[i] = particles.restDensity[i];
+	});
+	simulator.ForParticleSlices([&](unsigned slice, unsigned begin, unsigned end) {
+		auto sum = densityBuffer.Get(slice, &predictedDensity[0]);
+		for (unsigned i = begin; i < end; i++) {
+			const unsigned first = neighbours.Begin(i), last = neighbours.End(i);
+			if (first == last) continue;
+			float* lr = &neighbours.weight2[first];
+			float* w = &neighbours.weight[first];
+			for (unsigned k = first; k < last; k++)
+				lr[k - first] = glm::length(predicted[i] - predicted[neighbours.index[k]]);
+			KernelPoly6Batch(lr, w, last - first, simulator.kernels);
+
+			float d = 0.f;
+			for (unsigned k = first; k < last; k++) {
+				const unsigned j = neighbours.index[k];
+				d += mass[j] * w[k - first];
+				sum(j, k) += mass[i] * w[k - first];
+			}
+			sum[i] += d;
+		}
+	});
+	simulator.ForParticles(n, [&](unsigned begin, unsigned end) {
+		densityBuffer.Reduce(&predictedDensity[0], begin, end, 0.f);
+		for (unsigned i = begin; i < end; i++)
+			pressure[i] = std::max(0.f, pressure[i] + stepDelta * (predictedDensity[i] - TargetDensity(particles, i)));
+	});
+}
+
+// The pressure forces with half pairs, j gets the term of i in the other direction, weighted by i
+void PcisphSolver::PressureForcesHalf(FluidSimulator& simulator) {
+	ParticleStore& particles = simulator.particles;
+	NeighbourList& neighbours = simulator.neighbours;
+	const unsigned n = particles.Size();
+	const float* mass = &particles.mass[0];
+	const float* density = &particles.density[0];
+	const float* pressure = &particles.pressure[0];
+
+	std::fill(pressureForce.begin(), pressureForce.end(), glm::vec3(0.f));
+	simulator.ForParticleSlices([&](unsigned slice, unsigned begin, unsigned end) {
+		auto force = forceBuffer.Get(slice, &pressureForce[0]);
+		for (unsigned i = begin; i < end; i++) {
+			if (fabs(density[i]) < 1e-8f) continue; // Prevent division by 0
+			glm::vec3 fi(0.f);
+			for (unsigned k = neighbours.Begin(i); k < neighbours.End(i); k++) {
+				const unsigned j = neighbours.index[k];
+				if (fabs(density[j]) < 1e-8f) continue; // Prevent division by 0
+
+				const glm::vec3 g = ((pressure[i] + pressure[j]) * 0.5f * gradient[k]) * neighbours.r[k];
+				fi -= mass[j] / density[j] * g;
+				force(j, k) += mass[i] / density[i] * g;
+			}
+			force[i] += fi;
+		}
+	});
+	simulator.ForParticles(n, [&](unsigned begin, unsigned end) {
+		forceBuffer.Reduce(&pressureForce[0], begin, end, glm::vec3(0.f));
+	});
+}
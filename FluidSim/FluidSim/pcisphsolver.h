@@ -0,0 +1,48 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <vector>
+#include "pressuresolver.h"
+#include "reductionbuffer.h"
+
+// Predictive-corrective incompressible SPH (Solenthaler and Pajarola 2009)
+// Every iteration predicts where the particles end up after dt with the current pressures,
+// and raises the pressure of every particle by how much denser than the reference it would get
+// The pressures are solved for the step they are applied over, so the step can be far longer than
+// the stiff equation of state allows
+// The prediction moves the particles the way SymplecticEuler does, so use it with that integrator
+class PcisphSolver final : public PressureSolver {
+public:
+	// Iterates until the predicted density error stays below tolerance, but at least minIterations times
+	explicit PcisphSolver(float tolerance = 0.01f, unsigned minIterations = 3, unsigned maxIterations = 50);
+
+	void	Solve(FluidSimulator& simulator, float dt) override;
+	bool	IsExplicit() const override { return false; }
+	void	Reset() override;
+
+	void	SetTolerance(float tolerance) { this->tolerance = tolerance; }
+	float	GetTolerance() const { return tolerance; }
+	void	SetIterations(unsigned minIterations, unsigned maxIterations);
+
+private:
+	// Checkpoints save and restore the settings and delta
+	friend class FluidSimulator;
+
+	// Measures delta at the reference particle, whose neighbourhood is full
+	void	MeasureDelta(const FluidSimulator& simulator);
+	// The passes over the neighbours with half pairs, where every pair adds to both particles through per-slice buffers
+	void	PredictDensitiesHalf(FluidSimulator& simulator, float stepDelta);
+	void	PressureForcesHalf(FluidSimulator& simulator);
+
+	float		tolerance;
+	unsigned	minIterations;
+	unsigned	maxIterations;
+	float		delta;				// Pressure per unit of density error, times dt^2
+
+	std::vector<float>		gradient;			// Spiky gradient factor of every neighbour entry, at the current positions
+	std::vector<glm::vec3>	predicted;			// Predicted position of every particle
+	std::vector<float>		predictedDensity;
+	std::vector<glm::vec3>	pressureForce;
+	ReductionBuffer<float>	densityBuffer;		// Per-slice sums with half pairs
+	ReductionBuffer<glm::vec3>	forceBuffer;
+};
@@ -0,0 +1,54 @@
+#include "pressuresolver.h"
+
+#include <algorithm>
+#include "fluidsimulator.h"
+#include "profiler.h"
+
+PressureSolver::PressureSolver() :
+	measured(false),
+	referenceExcess(0.f),
+	referenceParticle(0) {
+}
+
+void PressureSolver::Reset() {
+	measured = false;
+}
+
+bool PressureSolver::MeasureReference(const ParticleStore& particles) {
+	if (measured || particles.Empty()) return false;
+	referenceExcess = 0.f;
+	referenceParticle = 0;
+	for (unsigned i = 0; i < particles.Size(); i++) {
+		const float excess = particles.density[i] - particles.restDensity[i];
+		if (excess > referenceExcess) {
+			referenceExcess = excess;
+			referenceParticle = i;
+		}
+	}
+	measured = true;
+	return true;
+}
+
+void PressureSolver::MeasureDensityError(const ParticleStore& particles, const float* density) {
+	stats.maxDensityError = 0.f;
+	stats.averageDensityError = 0.f;
+	if (particles.Empty() || referenceExcess <= 0.f) return;
+
+	for (unsigned i = 0; i < particles.Size(); i++) {
+		const float error = std::max(0.f, density[i] - TargetDensity(particles, i)) / referenceExcess;
+		stats.maxDensityError = std::max(stats.maxDensityError, error);
+		stats.averageDensityError += error;
+	}
+	stats.averageDensityError /= particles.Size();
+}
+
+void EquationOfStateSolver::Solve(FluidSimulator& simulator, float /*dt*/) {
+	MeasureReference(simulator.particles);
+	simulator.CalculatePressures();
+	simulator.ApplyPressureForces();
+
+	stats.iterations = 1;
+	if (!simulator.particles.Empty())
+		MeasureDensityError(simulator.particles, &simulator.particles.density[0]);
+	PROFILE_MAX("density error", stats.maxDensityError);
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include "particlestore.h"
+
+class FluidSimulator;
+
+// What the pressure solver did in the last step
+struct PressureSolverStats {
+	unsigned	iterations;				// 1 for solvers that do not iterate
+	float		maxDensityError;		// Largest compression past the reference density, as a fraction of it
+	float		averageDensityError;	// Compression averaged over all particles, expanded particles count as 0
+
+	PressureSolverStats() : iterations(0), maxDensityError(0.f), averageDensityError(0.f) {}
+};
+
+// Turns the densities of a step into pressure forces
+// The simulator calls Solve once per step, after the neighbours, the densities and every other force are known
+//
+// Densities here are restDensity plus the neighbours' contributions, so restDensity itself can never be reached
+// by a fluid that holds together. The reference a solver compares against is therefore the densest particle of the
+// first step after Reset, the way the fluid was sampled, and density errors are measured against the neighbours'
+// part of that: an error of 0.01 means 1% more neighbour density than the densest particle of the sampling had
+// The reference is kept while particles come and go, so emitters, sinks and far away particles do not move it
+class PressureSolver {
+public:
+	PressureSolver();
+	virtual ~PressureSolver() {}
+
+	// Adds the pressure forces to forceAccum; dt is the step they will be integrated over
+	virtual void	Solve(FluidSimulator& simulator, float dt) = 0;
+
+	// True if the pressure forces do not depend on dt, they then count towards the force limit of adaptive steps
+	virtual bool	IsExplicit() const = 0;
+
+	// Measures the reference density again on the next Solve, the simulator calls it when the smoothing length
+	// changes or all particles are cleared
+	virtual void	Reset();
+
+	const PressureSolverStats&	GetStats() const { return stats; }
+
+protected:
+	// Checkpoints save and restore the measured reference
+	friend class FluidSimulator;
+
+	// Measures the reference on the first call after Reset with any particles, returns true if it did
+	bool			MeasureReference(const ParticleStore& particles);
+	// Fills in the density errors of stats
+	void			MeasureDensityError(const ParticleStore& particles, const float* density);
+
+	// The density particle i should keep
+	float			TargetDensity(const ParticleStore& particles, unsigned i) const { return particles.restDensity[i] + referenceExcess; }
+
+	PressureSolverStats	stats;
+	bool			measured;
+	float			referenceExcess;	// Neighbour part of the reference density
+	unsigned		referenceParticle;	// The particle it was measured at, only valid in the step it was measured
+};
+
+// The equation of state pressure = k * (density - restDensity), stiff and explicit
+class EquationOfStateSolver final : public PressureSolver {
+public:
+	void	Solve(FluidSimulator& simulator, float dt) override;
+	bool	IsExplicit() const override { return true; }
+};
@@ -0,0 +1,134 @@
+#include "profiler.h"
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <chrono>
+#endif
+
+#include <cstring>
+#include <fstream>
+
+// VS2012's high_resolution_clock only ticks once per millisecond, so Windows uses the performance counter
+double ProfileTime() {
+#ifdef _WIN32
+	LARGE_INTEGER counter, frequency;
+	QueryPerformanceCounter(&counter);
+	QueryPerformanceFrequency(&frequency);
+	return (double)counter.QuadPart / (double)frequency.QuadPart;
+#else
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+// Finds the entry called name, or appends it
+// Names are string literals, so comparing the pointers nearly always suffices
+template <typename T>
+static T& FindOrAdd(std::vector<T>& entries, const char* name) {
+	for (auto ei = entries.begin(); ei != entries.end(); ei++)
+		if (ei->name == name || strcmp(ei->name, name) == 0) return *ei;
+
+	T entry = T();
+	entry.name = name;
+	entries.push_back(entry);
+	return entries.back();
+}
+
+void ProfileReport::Clear() {
+	steps = 0;
+	phases.clear();
+	counters.clear();
+}
+
+void ProfileReport::Add(const ProfileReport& other) {
+	steps += other.steps;
+	for (auto pi = other.phases.begin(); pi != other.phases.end(); pi++) {
+		ProfilePhase& phase = FindOrAdd(phases, pi->name);
+		phase.seconds += pi->seconds;
+		phase.calls += pi->calls;
+	}
+	for (auto ci = other.counters.begin(); ci != other.counters.end(); ci++) {
+		ProfileCounter& counter = FindOrAdd(counters, ci->name);
+		counter.maximum = ci->maximum;
+		if (!ci->maximum) counter.value += ci->value;
+		else if (ci->value > counter.value) counter.value = ci->value;
+	}
+}
+
+void ProfileReport::Print(std::ostream& out) const {
+	const double perStep = steps > 0 ? 1.0 / steps : 1.0;
+	out << "Profile over " << steps << " step(s), per step:" << std::endl;
+	for (auto pi = phases.begin(); pi != phases.end(); pi++)
+		out << "  " << pi->name << ": " << pi->seconds * perStep * 1000.0 << " ms (" << pi->calls * perStep << " calls)" << std::endl;
+	for (auto ci = counters.begin(); ci != counters.end(); ci++)
+		out << "  " << ci->name << ": " << (ci->maximum ? ci->value : ci->value * perStep) << std::endl;
+}
+
+Profiler& Profiler::Instance() {
+	static Profiler profiler;
+	return profiler;
+}
+
+Profiler::Profiler() :
+	tracing(false),
+	traceStart(0.0) {
+}
+
+void Profiler::SetTracing(bool tracing) {
+	if (tracing && !this->tracing) traceStart = ProfileTime();
+	this->tracing = tracing;
+}
+
+void Profiler::AddPhase(const char* name, double start, double end) {
+	ProfilePhase& phase = FindOrAdd(currentStep.phases, name);
+	phase.seconds += end - start;
+	phase.calls++;
+
+	if (tracing) {
+		TraceEvent event = { name, start - traceStart, end - start };
+		events.push_back(event);
+	}
+}
+
+void Profiler::AddCounter(const char* name, double value) {
+	FindOrAdd(currentStep.counters, name).value += value;
+}
+
+void Profiler::MaxCounter(const char* name, double value) {
+	ProfileCounter& counter = FindOrAdd(currentStep.counters, name);
+	counter.maximum = true;
+	if (value > counter.value) counter.value = value;
+}
+
+void Profiler::EndStep() {
+	currentStep.steps = 1;
+	lastStep = currentStep;
+	totals.Add(currentStep);
+	currentStep.Clear();
+}
+
+void Profiler::Reset() {
+	currentStep.Clear();
+	lastStep.Clear();
+	totals.Clear();
+	events.clear();
+	traceStart = ProfileTime();
+}
+
+bool Profiler::WriteChromeTrace(const std::string& path) const {
+	std::ofstream out(path.c_str());
+	if (!out) return false;
+
+	// Complete events ("ph": "X") with times in microseconds
+	out << std::fixed;
+	out.precision(3);
+	out << "{\"traceEvents\":[\n";
+	for (unsigned i = 0; i < events.size(); i++) {
+		const TraceEvent& e = events[i];
+		out << "{\"name\":\"" << e.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":" << e.start * 1e6
+			<< ",\"dur\":" << e.duration * 1e6 << "}" << (i + 1 < events.size() ? ",\n" : "\n");
+	}
+	out << "]}\n";
+	return out.good();
+}
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Instrumentation of the solver phases
+// Define FLUIDSIM_PROFILE to turn it on; without it the macros below compile to nothing,
+// and the expressions passed to them are not even evaluated
+//
+// PROFILE_SCOPE(name)			times the rest of the enclosing scope as phase name
+// PROFILE_COUNT(name, value)	adds value to counter name for the current step
+// PROFILE_MAX(name, value)		raises counter name to value if it is lower
+// PROFILE_END_STEP()			closes the current step, see Profiler::GetLastStep
+//
+// Names have to be string literals. Scopes and counters belong on the thread that steps the simulator,
+// never inside the blocks a pass hands to the thread pool
+#ifdef FLUIDSIM_PROFILE
+#define PROFILE_CONCAT_INNER(a, b)	a##b
+#define PROFILE_CONCAT(a, b)		PROFILE_CONCAT_INNER(a, b)
+#define PROFILE_SCOPE(name)			ProfileScope PROFILE_CONCAT(profileScope, __LINE__)(name)
+#define PROFILE_COUNT(name, value)	Profiler::Instance().AddCounter(name, (double)(value))
+#define PROFILE_MAX(name, value)	Profiler::Instance().MaxCounter(name, (double)(value))
+#define PROFILE_END_STEP()			Profiler::Instance().EndStep()
+#else
+#define PROFILE_SCOPE(name)
+#define PROFILE_COUNT(name, value)
+#define PROFILE_MAX(name, value)
+#define PROFILE_END_STEP()
+#endif
+
+// Seconds since some fixed point, with sub-microsecond resolution
+double	ProfileTime();
+
+struct ProfilePhase {
+	const char*	name;
+	double		seconds;		// Total time spent in the phase
+	unsigned	calls;
+};
+
+struct ProfileCounter {
+	const char*	name;
+	double		value;
+	bool		maximum;		// Set by PROFILE_MAX, steps are combined with max instead of summed
+};
+
+// Phase times and counters, of one step or summed over several
+struct ProfileReport {
+	unsigned					steps;
+	std::vector<ProfilePhase>	phases;		// In the order they were first seen
+	std::vector<ProfileCounter>	counters;
+
+	ProfileReport() : steps(0) {}
+
+	void	Clear();
+	// Adds the phase times and counters of other to these
+	void	Add(const ProfileReport& other);
+	// Writes one line per phase and counter, averaged per step except for maximum counters
+	void	Print(std::ostream& out) const;
+};
+
+// Collects the phase times and counters of every step
+class Profiler {
+public:
+	static Profiler&	Instance();
+
+	void		AddPhase(const char* name, double start, double end);
+	void		AddCounter(const char* name, double value);
+	void		MaxCounter(const char* name, double value);
+
+	// Closes the current step; it becomes the last step and is added to the totals
+	void		EndStep();
+
+	const ProfileReport&	GetLastStep() const { return lastStep; }
+	const ProfileReport&	GetTotals() const { return totals; }
+	void		Reset();
+
+	// Records every scope as an event, for WriteChromeTrace
+	void		SetTracing(bool tracing);
+	bool		IsTracing() const { return tracing; }
+
+	// Writes the recorded events in the Chrome trace event format, for chrome://tracing
+	// Returns false if the file could not be written
+	bool		WriteChromeTrace(const std::string& path) const;
+
+private:
+	Profiler();
+
+	struct TraceEvent {
+		const char*	name;
+		double		start;
+		double		duration;
+	};
+
+	ProfileReport			currentStep;
+	ProfileReport			lastStep;
+	ProfileReport			totals;
+	bool					tracing;
+	double					traceStart;		// Time tracing was turned on, so the trace starts at 0
+	std::vector<TraceEvent>	events;
+};
+
+// Adds the time between construction and destruction to a phase
+class ProfileScope {
+public:
+	explicit ProfileScope(const char* name) : name(name), start(ProfileTime()) {}
+	~ProfileScope() { Profiler::Instance().AddPhase(name, start, ProfileTime()); }
+
+private:
+	ProfileScope(const ProfileScope&);
+	ProfileScope& operator=(const ProfileScope&);
+
+	const char*	name;
+	double		start;
+};
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+
+// Slice of the particles for passes where a particle also adds to entries of other particles, such as the symmetric
+// pair passes: a single thread runs rows [begin, end) in order
+struct ReductionSlice {
+	unsigned				begin;
+	unsigned				end;
+	std::vector<unsigned>	outside;	// Particles outside [begin, end) the rows add to, in increasing order
+};
+
+// How the particles are split into slices, for the current neighbour list
+struct ReductionLayout {
+	std::vector<ReductionSlice>	slices;
+	std::vector<unsigned>		slot;		// Per neighbour entry whose particle lies outside its row's slice, its place in outside
+};
+
+// Buffers of a per-particle array for those passes
+// A slice adds to its own particles straight in the array, which no other slice touches, and to the particles outside
+// of it in a buffer of its own; Reduce then adds the buffers in slice order and zeroes them again, so they are ready for
+// the next pass without being cleared separately, and no sum depends on which thread ran which slice
+// A single slice needs no buffer at all, and more slices only need room for what crosses between them
+template <typename T>
+class ReductionBuffer {
+public:
+	// Where a slice adds its values: [i] for its own particle i, (j, k) for the particle j of neighbour entry k
+	class Target {
+	public:
+		Target(T* target, T* outside, const unsigned* slot, unsigned begin, unsigned end) :
+			target(target), outside(outside), slot(slot), begin(begin), count(end - begin) {}
+
+		T&			operator[](unsigned i) const { return target[i]; }
+		T&			operator()(unsigned j, unsigned k) const { return j - begin < count ? target[j] : outside[slot[k]]; }
+
+	private:
+		T*				target;
+		T*				outside;
+		const unsigned*	slot;
+		unsigned		begin;
+		unsigned		count;
+	};
+
+	ReductionBuffer() : layout(0) {}
+
+	// Makes room for the slices of layout, which has to stay as it is until the last Reduce; the buffers are zero afterwards
+	void		Prepare(const ReductionLayout& layout, const T& zero) {
+		this->layout = &layout;
+		offsets.resize(layout.slices.size());
+		size_t size = 0;
+		for (size_t s = 0; s < layout.slices.size(); s++) {
+			offsets[s] = size;
+			size += layout.slices[s].outside.size();
+		}
+		// Reduce leaves every buffer zero, so only new room needs clearing
+		if (copies.size() < size) copies.resize(size, zero);
+	}
+
+	Target		Get(unsigned slice, T* target) {
+		const ReductionSlice& s = layout->slices[slice];
+		return Target(target, copies.data() + offsets[slice], layout->slot.data(), s.begin, s.end);
+	}
+
+	// Adds the buffers into target for entries [begin, end) and zeroes them; ranges can be reduced in parallel
+	void		Reduce(T* target, unsigned begin, unsigned end, const T& zero) {
+		for (size_t s = 0; s < layout->slices.size(); s++) {
+			const std::vector<unsigned>& outside = layout->slices[s].outside;
+			auto oi = std::lower_bound(outside.begin(), outside.end(), begin);
+			T* copy = copies.data() + offsets[s] + (oi - outside.begin());
+			for (; oi != outside.end() && *oi < end; oi++, copy++) {
+				target[*oi] += *copy;
+				*copy = zero;
+			}
+		}
+	}
+
+private:
+	const ReductionLayout*	layout;
+	std::vector<size_t>		offsets;	// Of the buffer of every slice
+	std::vector<T>			copies;
+};
@@ -0,0 +1,409 @@
+#include "scene.h"
+
+#include <cmath>
+#include <fstream>
+#include <functional>
+#include <sstream>
+
+// Most particles the blocks and balls of a scene file may add up to; a mistyped spacing is refused instead of
+// running out of memory
+static const double maxSceneParticles = 1 << 24;
+
+// Number of positions low, low + spacing, ... below high
+// In double, which holds the count of any line exactly up to far beyond the cap, and is inf for infinite bounds
+static double StepCount(float low, float high, float spacing) {
+	return high > low ? std::ceil(((double)high - low) / spacing) : 0.0;
+}
+
+static double BlockCount(const glm::vec3& low, const glm::vec3& high, float spacing) {
+	return StepCount(low.x, high.x, spacing) * StepCount(low.y, high.y, spacing) * StepCount(low.z, high.z, spacing);
+}
+
+// The positions StepCount counts, each computed from low instead of added up, which would stall at large values
+static std::vector<float> Steps(float low, float high, float spacing) {
+	std::vector<float> steps((size_t)StepCount(low, high, spacing));
+	for (size_t k = 0; k < steps.size(); k++)
+		steps[k] = low + (float)k * spacing;
+	return steps;
+}
+
+// Fills the box [low, high) with particles spacing apart, x running fastest, and lets set finish each of them
+// The box has to hold no more than maxSceneParticles
+template <typename F>
+static void AddBlock(FluidSimulator& simulator, const glm::vec3& low, const glm::vec3& high, float spacing, F set) {
+	const std::vector<float> xs = Steps(low.x, high.x, spacing);
+	const std::vector<float> ys = Steps(low.y, high.y, spacing);
+	const std::vector<float> zs = Steps(low.z, high.z, spacing);
+	const unsigned nx = (unsigned)xs.size();
+	const unsigned nxy = nx * (unsigned)ys.size();
+	simulator.AddParticles(nxy * (unsigned)zs.size(), [&](unsigned i, ParticleRef p) {
+		p.position = glm::vec3(xs[i % nx], ys[i % nxy / nx], zs[i / nxy]);
+		set(p);
+	});
+}
+
+void LoadDefaultScene(FluidSimulator& simulator) {
+	// Block of fluid
+	AddBlock(simulator, glm::vec3(0.f, 0.f, -50.f), glm::vec3(40.f, 40.f, 40.f), 6.f, [](ParticleRef) {});
+
+	// Bodies
+	simulator.AddBody(Sphere(glm::vec3(20.f, 70.f, 20.f), 20.0, 5.f));
+	simulator.AddBody(BoxRotating(glm::vec3(-20.f, 75.f, -20.f), glm::vec3(40.f, 40.f, 40.f), 10.f));
+}
+
+// Reads the words of one line of a scene file
+class SceneLine {
+public:
+	explicit SceneLine(const std::string& text) : in(text) {}
+
+	bool Word(std::string& word) {
+		in >> word;
+		return !in.fail();
+	}
+
+	bool Float(float& value) {
+		in >> value;
+		return !in.fail();
+	}
+
+	bool Vec3(glm::vec3& value) {
+		return Float(value.x) && Float(value.y) && Float(value.z);
+	}
+
+	bool Unsigned(unsigned& value) {
+		long long read;
+		in >> read;
+		value = (unsigned)read;
+		return !in.fail() && read >= 0 && read <= 0xffffffffll;
+	}
+
+	bool Switch(bool& on) {
+		std::string word;
+		if (!Word(word)) return false;
+		on = word == "on";
+		return on || word == "off";
+	}
+
+	// Leaves value as it is if the line ends here, returns false if what follows is not a number
+	bool OptionalFloat(float& value) {
+		std::string word;
+		if (!Word(word)) return true;
+		std::istringstream number(word);
+		number >> value;
+		return !number.fail() && number.eof();
+	}
+
+	bool AtEnd() {
+		std::string word;
+		return !Word(word);
+	}
+
+private:
+	std::istringstream	in;
+};
+
+// Properties the fluid shapes and emitters can end with
+struct FluidOptions {
+	glm::vec3	velocity;
+	float		mass;
+	float		restDensity;
+
+	FluidOptions() : velocity(0.f), mass(Particle().mass), restDensity(Particle().restDensity) {}
+
+	void Apply(ParticleRef& p) const {
+		p.velocity = velocity;
+		p.mass = mass;
+		p.restDensity = restDensity;
+	}
+};
+
+// Reads "velocity x y z", "mass m" and "density d" up to the end of the line, returns false on anything else
+static bool ReadFluidOptions(SceneLine& line, FluidOptions& options) {
+	std::string word;
+	while (line.Word(word)) {
+		bool read = false;
+		if (word == "velocity") read = line.Vec3(options.velocity);
+		else if (word == "mass") read = line.Float(options.mass) && options.mass > 0.f;
+		else if (word == "density") read = line.Float(options.restDensity) && options.restDensity > 0.f;
+		if (!read) return false;
+	}
+	return true;
+}
+
+// Reads "velocity x y z", "rotation x y z" and "omega x y z" up to the end of the line into body
+static bool ReadBodyOptions(SceneLine& line, Body& body) {
+	std::string word;
+	while (line.Word(word)) {
+		bool read = false;
+		if (word == "velocity") read = line.Vec3(body.velocity);
+		else if (word == "rotation") read = line.Vec3(body.rotation);
+		else if (word == "omega") read = line.Vec3(body.omega);
+		if (!read) return false;
+	}
+	body.UpdateTransform();
+	return true;
+}
+
+typedef std::function<void(FluidSimulator&)> SceneSetting;
+
+static SceneSetting SetParameter(float FluidParameters::* parameter, float value) {
+	return [=](FluidSimulator& simulator) {
+		FluidParameters parameters = simulator.GetParameters();
+		parameters.*parameter = value;
+		simulator.SetParameters(parameters);
+	};
+}
+
+// Switches a simulator toggle on or off through its getter and toggle
+struct SceneToggle {
+	const char*	name;
+	bool		(FluidSimulator::*get)();
+	void		(FluidSimulator::*toggle)();
+};
+
+const SceneToggle sceneToggles[] = {
+	{ "fluidgravity", &FluidSimulator::isGravity, &FluidSimulator::ToggleFluidGravity },
+	{ "bodygravity", &FluidSimulator::isBodyGravity, &FluidSimulator::ToggleBodyGravity },
+	{ "wind", &FluidSimulator::isWind, &FluidSimulator::ToggleWind },
+	{ "surfacetension", &FluidSimulator::isSurfaceTension, &FluidSimulator::ToggleSurfaceTension },
+	{ "grid", &FluidSimulator::isUseOctree, &FluidSimulator::ToggleUseOctree }
+};
+
+// The whole file is read and checked before the simulator is touched: settings, fluid shapes and bodies are collected as
+// functions to run on it afterwards, and the shapes construct their particles right in the simulator's storage
+bool LoadScene(const std::string& path, FluidSimulator& simulator, Scene& scene, std::string& error) {
+	std::ifstream file(path.c_str(), std::ios::binary);
+	if (!file) {
+		error = "Could not open " + path;
+		return false;
+	}
+	std::stringstream contents;
+	contents << file.rdbuf();
+
+	std::vector<SceneSetting>	settings;
+	std::vector<SceneSetting>	fluids;
+	std::vector<SceneSetting>	bodies;
+	double						particleCount = 0.0;
+	std::vector<Emitter>		emitters;
+	std::vector<Sink>			sinks;
+
+	std::string text;
+	unsigned lineNumber = 0;
+	while (std::getline(contents, text)) {
+		lineNumber++;
+		const size_t comment = text.find('#');
+		if (comment != std::string::npos) text.erase(comment);
+		SceneLine line(text);
+		std::string directive;
+		if (!line.Word(directive)) continue;
+
+		bool read = false;
+		bool tooMany = false;
+		float value = 0.f;
+		unsigned count = 0;
+		bool on = false;
+		std::string word;
+		if (directive == "bounds") {
+			glm::vec3 center;
+			float size;
+			read = line.Vec3(center) && line.Float(size) && size > 0.f && line.AtEnd();
+			const AABoundingBox box(center, size);
+			settings.push_back([=](FluidSimulator& s) { s.SetBoundingBox(box); });
+		} else if (directive == "h") {
+			read = line.Float(value) && value > 0.f && line.AtEnd();
+			settings.push_back([=](FluidSimulator& s) { s.SetSmoothingLength(value); });
+		} else if (directive == "skin") {
+			read = line.Float(value) && value >= 0.f && line.AtEnd();
+			settings.push_back([=](FluidSimulator& s) { s.SetNeighbourSkin(value); });
+		} else if (directive == "k" || directive == "mu" || directive == "bounce" || directive == "sigma") {
+			read = line.Float(value) && line.AtEnd();
+			float FluidParameters::* parameter = directive == "k" ? &FluidParameters::k : directive == "mu" ? &FluidParameters::mu
+				: directive == "bounce" ? &FluidParameters::bounce : &FluidParameters::sigma;
+			settings.push_back(SetParameter(parameter, value));
+		} else if (directive == "collisions") {
+			read = line.Unsigned(count) && line.AtEnd();
+			settings.push_back([=](FluidSimulator& s) { s.SetCollisionIterations(count); });
+		} else if (directive == "gridstorage") {
+			read = line.Word(word) && (word == "dense" || word == "hashed") && line.AtEnd();
+			const GridStorage storage = word == "hashed" ? HashedGrid : DenseGrid;
+			// Ahead of the other settings, so a large box is never laid out densely first
+			settings.insert(settings.begin(), [=](FluidSimulator& s) { s.SetGridStorage(storage); });
+		} else if (directive == "pairs") {
+			read = line.Word(word) && (word == "full" || word == "half") && line.AtEnd();
+			const PairMode mode = word == "half" ? HalfPairs : FullPairs;
+			settings.push_back([=](FluidSimulator& s) { s.SetPairMode(mode); });
+		} else if (directive == "integrator") {
+			read = line.Word(word) && (word == "explicit" || word == "symplectic") && line.AtEnd();
+			const Integrator integrator = word == "symplectic" ? SymplecticEuler : ExplicitEuler;
+			settings.push_back([=](FluidSimulator& s) { s.SetIntegrator(integrator); });
+		} else if (directive == "solver") {
+			float tolerance = 0.01f;
+			read = line.Word(word);
+			if (word == "eos") {
+				read = read && line.AtEnd();
+				settings.push_back([](FluidSimulator& s) { s.SetPressureSolver(std::unique_ptr<PressureSolver>(new EquationOfStateSolver())); });
+			} else if (word == "pcisph") {
+				read = read && line.OptionalFloat(tolerance) && tolerance > 0.f && line.AtEnd();
+				settings.push_back([=](FluidSimulator& s) { s.SetPressureSolver(std::unique_ptr<PressureSolver>(new PcisphSolver(tolerance))); });
+			} else read = false;
+		} else if (directive == "block") {
+			glm::vec3 low, high;
+			float spacing;
+			FluidOptions options;
+			read = line.Vec3(low) && line.Vec3(high) && line.Float(spacing) && spacing > 0.f && ReadFluidOptions(line, options);
+			if (read) {
+				particleCount += BlockCount(low, high, spacing);
+				tooMany = !(particleCount <= maxSceneParticles);
+			}
+			if (read && !tooMany) {
+				fluids.push_back([=](FluidSimulator& s) { AddBlock(s, low, high, spacing, [&](ParticleRef p) { options.Apply(p); }); });
+			}
+		} else if (directive == "ball") {
+			glm::vec3 center;
+			float radius, spacing;
+			FluidOptions options;
+			read = line.Vec3(center) && line.Float(radius) && radius > 0.f && line.Float(spacing) && spacing > 0.f
+				&& ReadFluidOptions(line, options);
+			// Lattice points -radius + k spacing within radius of the center; the ball fills over half of the cube around it,
+			// so a cube of more than twice the particles left is refused before laying it out
+			const double side = std::floor(2.0 * radius / spacing) + 1.0;
+			tooMany = read && !(side * side * side <= 2.0 * (maxSceneParticles - particleCount));
+			std::vector<glm::vec3> positions;
+			if (read && !tooMany) {
+				const unsigned n = (unsigned)side;
+				for (unsigned k = 0; k < n; k++) {
+					const float z = -radius + (float)k * spacing;
+					for (unsigned j = 0; j < n; j++) {
+						const float y = -radius + (float)j * spacing;
+						for (unsigned i = 0; i < n; i++) {
+							const float x = -radius + (float)i * spacing;
+							if (x * x + y * y + z * z <= radius * radius)
+								positions.push_back(center + glm::vec3(x, y, z));
+						}
+					}
+				}
+				particleCount += positions.size();
+				tooMany = !(particleCount <= maxSceneParticles);
+			}
+			if (read && !tooMany) {
+				fluids.push_back([=](FluidSimulator& s) {
+					s.AddParticles((unsigned)positions.size(), [&](unsigned i, ParticleRef p) {
+						p.position = positions[i];
+						options.Apply(p);
+					});
+				});
+			}
+		} else if (directive == "emitter") {
+			Emitter emitter;
+			FluidOptions options;
+			read = line.Vec3(emitter.center) && line.Vec3(emitter.velocity) && line.Float(emitter.radius) && emitter.radius >= 0.f
+				&& line.Float(emitter.rate) && emitter.rate >= 0.f && ReadFluidOptions(line, options);
+			emitter.mass = options.mass;
+			emitter.restDensity = options.restDensity;
+			emitter.due = 0.f;
+			emitter.seed = (unsigned)emitters.size() + 1;
+			emitters.push_back(emitter);
+		} else if (directive == "sink") {
+			Sink sink;
+			read = line.Vec3(sink.center) && line.Float(sink.radius) && sink.radius > 0.f && line.AtEnd();
+			sinks.push_back(sink);
+		} else if (directive == "sphere") {
+			glm::vec3 center;
+			float radius, mass;
+			read = line.Vec3(center) && line.Float(radius) && radius > 0.f && line.Float(mass) && mass > 0.f;
+			Sphere sphere(center, radius, mass);
+			read = read && ReadBodyOptions(line, sphere);
+			bodies.push_back([=](FluidSimulator& s) { s.AddBody(sphere); });
+		} else if (directive == "box" || directive == "rotatingbox") {
+			glm::vec3 center, size;
+			float mass;
+			read = line.Vec3(center) && line.Vec3(size) && size.x > 0.f && size.y > 0.f && size.z > 0.f && line.Float(mass) && mass > 0.f;
+			if (directive == "box") {
+				Box box(center, size, mass);
+				read = read && ReadBodyOptions(line, box);
+				bodies.push_back([=](FluidSimulator& s) { s.AddBody(box); });
+			} else {
+				BoxRotating box(center, size, mass);
+				read = read && ReadBodyOptions(line, box);
+				bodies.push_back([=](FluidSimulator& s) { s.AddBody(box); });
+			}
+		} else {
+			for (unsigned t = 0; t < sizeof(sceneToggles) / sizeof(sceneToggles[0]); t++) {
+				const SceneToggle& toggle = sceneToggles[t];
+				if (directive != toggle.name) continue;
+				read = line.Switch(on) && line.AtEnd();
+				settings.push_back([=](FluidSimulator& s) { if ((s.*toggle.get)() != on) (s.*toggle.toggle)(); });
+			}
+		}
+
+		if (!read) {
+			std::ostringstream message;
+			message << path << ":" << lineNumber << ": could not read \"" << text << "\"";
+			error = message.str();
+			return false;
+		}
+		if (tooMany) {
+			std::ostringstream message;
+			message << path << ":" << lineNumber << ": \"" << text << "\" takes the scene over " << (unsigned)maxSceneParticles << " particles";
+			error = message.str();
+			return false;
+		}
+	}
+
+	simulator.Clear();
+	for (auto si = settings.begin(); si != settings.end(); si++)
+		(*si)(simulator);
+	simulator.ReserveParticles((unsigned)particleCount);
+	for (auto fi = fluids.begin(); fi != fluids.end(); fi++)
+		(*fi)(simulator);
+	for (auto bi = bodies.begin(); bi != bodies.end(); bi++)
+		(*bi)(simulator);
+	scene.emitters.swap(emitters);
+	scene.sinks.swap(sinks);
+	return true;
+}
+
+// Uniform in [0, 1) from a linear congruential generator, so runs emit the same particles every time
+static float NextRandom(unsigned& seed) {
+	seed = seed * 1664525u + 1013904223u;
+	return (seed >> 8) * (1.f / 16777216.f);
+}
+
+void UpdateScene(FluidSimulator& simulator, Scene& scene, float dt) {
+	for (auto ei = scene.emitters.begin(); ei != scene.emitters.end(); ei++) {
+		Emitter& emitter = *ei;
+		emitter.due += emitter.rate * dt;
+		const unsigned count = (unsigned)emitter.due;
+		emitter.due -= count;
+		if (count == 0) continue;
+
+		// Two axes spanning the disc across the velocity
+		const float speed = glm::length(emitter.velocity);
+		const glm::vec3 axis = speed > 0.f ? emitter.velocity / speed : glm::vec3(0.f, 1.f, 0.f);
+		const glm::vec3 side = glm::normalize(glm::cross(axis, std::fabs(axis.x) < 0.9f ? glm::vec3(1.f, 0.f, 0.f) : glm::vec3(0.f, 1.f, 0.f)));
+		const glm::vec3 up = glm::cross(axis, side);
+		simulator.AddParticles(count, [&](unsigned, ParticleRef p) {
+			// Uniform over the disc's area
+			const float r = emitter.radius * std::sqrt(NextRandom(emitter.seed));
+			const float angle = 6.2831853f * NextRandom(emitter.seed);
+			p.position = emitter.center + r * (std::cos(angle) * side + std::sin(angle) * up);
+			p.velocity = emitter.velocity;
+			p.mass = emitter.mass;
+			p.restDensity = emitter.restDensity;
+		});
+	}
+
+	if (scene.sinks.empty()) return;
+	ParticleStore& particles = simulator.GetParticles();
+	const unsigned n = particles.Size();
+	for (unsigned i = 0; i < n; i++) {
+		for (auto si = scene.sinks.begin(); si != scene.sinks.end(); si++) {
+			const glm::vec3 d = particles.position[i] - si->center;
+			if (glm::dot(d, d) < si->radius * si->radius) {
+				simulator.KillParticle(particles.GetHandle(i));
+				break;
+			}
+		}
+	}
+	simulator.RemoveKilledParticles();
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "fluidsimulator.h"
+
+// Adds particles at a steady rate while the simulation runs
+struct Emitter {
+	glm::vec3	center;
+	glm::vec3	velocity;		// Of the new particles; they leave from a disc facing along it
+	float		radius;			// Of the disc
+	float		rate;			// Particles per unit of time
+	float		mass;
+	float		restDensity;
+	float		due;			// Fraction of a particle left over from earlier steps
+	unsigned	seed;			// State of the generator placing particles on the disc
+};
+
+// Removes the particles that enter a sphere, a drain for the emitters to keep the particle count bounded
+struct Sink {
+	glm::vec3	center;
+	float		radius;
+};
+
+// What a scene file describes beyond the simulator's own state
+struct Scene {
+	std::vector<Emitter>	emitters;
+	std::vector<Sink>		sinks;
+};
+
+// Fills the simulator with the default block of fluid and the default bodies
+// Shared by the interactive and the headless executables
+void LoadDefaultScene(FluidSimulator& simulator);
+
+// Replaces the particles and bodies of the simulator with those of the scene file at path and applies its settings;
+// settings the file leaves out keep their current values. See scenes/default.scene for the format
+// Returns false with the first problem in error, leaving the simulator and scene as they were, if the file could not be read
+bool LoadScene(const std::string& path, FluidSimulator& simulator, Scene& scene, std::string& error);
+
+// Adds the particles the emitters owe after dt more time and removes the particles inside the sinks
+void UpdateScene(FluidSimulator& simulator, Scene& scene, float dt);
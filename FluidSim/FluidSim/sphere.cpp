@@ -1,6 +1,5 @@
 #include "sphere.h"
 #include "util.h"
-#include <glload/gl_3_3.h>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
 
@@ -56,6 +55,11 @@ bool Sphere::collision(const glm::vec3& position, const glm::vec3& displacement,
 }
 
 
+void Sphere::GetBounds(glm::vec3& low, glm::vec3& high){
+	low = center - glm::vec3(size);
+	high = center + glm::vec3(size);
+}
+
 glm::vec3 Sphere::AbsoluteContactPoint(glm::vec3& relposition){
 	return center + relposition;
 
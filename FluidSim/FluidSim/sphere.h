@@ -1,10 +1,10 @@
 #pragma once
 
 #include <glm/glm.hpp>
-#include "body.h"
+#include "Body.h"
 
 // rigid (or solid) shpere
-class Sphere : public Body {
+class Sphere final : public Body {
 public:
 	Sphere(glm::vec3 pos, float size, float m);
 
@@ -13,6 +13,7 @@ public:
 	glm::vec3 AbsoluteContactPoint(glm::vec3& relposition);
 
 	bool collision(const glm::vec3& position, const glm::vec3& displacement, glm::vec3& contactPoint, float& penDepth, glm::vec3& normal);
+	void GetBounds(glm::vec3& low, glm::vec3& high);
 
 	float size;
 };
@@ -0,0 +1,152 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+// Normalisation coefficients of the SPH kernels for one smoothing length h
+struct SphKernelCoefficients {
+	float h;
+	float hs;					// h^2
+	float invHs;				// 1 / h^2
+	float invH3;				// 1 / h^3
+	float poly6;				// 315 / (64 pi h^9)
+	float poly6Gradient;		// -945 / (32 pi h^9), also used for the laplacian
+	float spiky;				// 15 / (pi h^6)
+	float spikyGradient;		// -45 / (pi h^6)
+	float spikyLaplacian;		// -90 / (pi h^6)
+	float viscosity;			// 15 / (2 pi h^3)
+	float viscosityLaplacian;	// 45 / (pi h^6)
+};
+
+inline SphKernelCoefficients MakeSphKernelCoefficients(float h) {
+	const float pi = 3.141592654f;
+	const float h3 = h*h*h;
+	const float h6 = h3*h3;
+	const float h9 = h6*h3;
+
+	SphKernelCoefficients c;
+	c.h = h;
+	c.hs = h*h;
+	c.invHs = 1.f / c.hs;
+	c.invH3 = 1.f / h3;
+	c.poly6 = 315.f / (64.f * pi * h9);
+	c.poly6Gradient = -945.f / (32.f * pi * h9);
+	c.spiky = 15.f / (pi * h6);
+	c.spikyGradient = -45.f / (pi * h6);
+	c.spikyLaplacian = -90.f / (pi * h6);
+	c.viscosity = 15.f / (2.f * pi * h3);
+	c.viscosityLaplacian = 45.f / (pi * h6);
+	return c;
+}
+
+// The kernel formulas, shared by SphKernelSet and FixedSphKernelSet
+// lr = |r| and lrs = |r|^2 are passed in by the caller, who usually knows them already
+// Every kernel is 0 for lr outside [0, h]
+
+inline float SphPoly6(const SphKernelCoefficients& c, float lrs) {
+	if (lrs < 0.f || lrs > c.hs) return 0.f;
+	const float d = c.hs - lrs;
+	return c.poly6 * d*d*d;
+}
+
+inline glm::vec3 SphPoly6Gradient(const SphKernelCoefficients& c, const glm::vec3& r, float lr) {
+	if (lr < 0.f || lr > c.h) return glm::vec3(0.f, 0.f, 0.f);
+	const float d = c.hs - lr*lr;
+	return (c.poly6Gradient * d*d) * r;
+}
+
+inline float SphPoly6Laplacian(const SphKernelCoefficients& c, float lr) {
+	if (lr < 0.f || lr > c.h) return 0.f;
+	const float lrs = lr*lr;
+	return c.poly6Gradient * (c.hs - lrs) * (3.f * c.hs - 7.f * lrs);
+}
+
+inline glm::vec3 SphPoly6GradientLaplacian(const SphKernelCoefficients& c, const glm::vec3& r, float lr, float& laplac) {
+	if (lr < 0.f || lr > c.h) {
+		laplac = 0.f;
+		return glm::vec3(0.f, 0.f, 0.f);
+	}
+	const float lrs = lr*lr;
+	const float d = c.hs - lrs;
+	laplac = c.poly6Gradient * d * (3.f * c.hs - 7.f * lrs);
+	return (c.poly6Gradient * d*d) * r;
+}
+
+inline float SphSpiky(const SphKernelCoefficients& c, float lr) {
+	if (lr < 0.f || lr > c.h) return 0.f;
+	const float d = c.h - lr;
+	return c.spiky * d*d*d;
+}
+
+inline glm::vec3 SphSpikyGradient(const SphKernelCoefficients& c, const glm::vec3& r, float lr) {
+	if (lr < 0.f || lr > c.h) return glm::vec3(0.f, 0.f, 0.f);
+	const float d = c.h - lr;
+	return (c.spikyGradient * d*d / lr) * r;
+}
+
+inline float SphSpikyLaplacian(const SphKernelCoefficients& c, float lr) {
+	if (lr < 0.f || lr > c.h) return 0.f;
+	return c.spikyLaplacian * (1.f / lr) * (c.h - lr) * (c.h - 2.f * lr);
+}
+
+inline float SphViscosity(const SphKernelCoefficients& c, float lr) {
+	if (lr < 0.f || lr > c.h) return 0.f;
+	const float term = -0.5f * lr*lr*lr * c.invH3 + lr*lr * c.invHs + c.h / (2.f * lr) - 1.f;
+	return c.viscosity * term;
+}
+
+inline glm::vec3 SphViscosityGradient(const SphKernelCoefficients& c, const glm::vec3& r, float lr) {
+	if (lr < 0.f || lr > c.h) return glm::vec3(0.f, 0.f, 0.f);
+	const float term = -1.5f * lr * c.invH3 + 2.f * c.invHs - c.h / (2.f * lr*lr*lr);
+	return (c.viscosity * term) * r;
+}
+
+inline float SphViscosityLaplacian(const SphKernelCoefficients& c, float lr) {
+	if (lr < 0.f || lr > c.h) return 0.f;
+	return c.viscosityLaplacian * (c.h - lr);
+}
+
+// The SPH kernels for one smoothing length, with all coefficients computed once up front
+// Construct it whenever h changes instead of passing h to every kernel call
+class SphKernelSet {
+public:
+	explicit SphKernelSet(float h = 1.f) : c(MakeSphKernelCoefficients(h)) {}
+
+	void		SetH(float h) { c = MakeSphKernelCoefficients(h); }
+	float		GetH() const { return c.h; }
+	const SphKernelCoefficients&	GetCoefficients() const { return c; }
+
+	float		Poly6(float lrs) const { return SphPoly6(c, lrs); }
+	glm::vec3	Poly6Gradient(const glm::vec3& r, float lr) const { return SphPoly6Gradient(c, r, lr); }
+	float		Poly6Laplacian(float lr) const { return SphPoly6Laplacian(c, lr); }
+	glm::vec3	Poly6GradientLaplacian(const glm::vec3& r, float lr, float& laplac) const { return SphPoly6GradientLaplacian(c, r, lr, laplac); }
+	float		Spiky(float lr) const { return SphSpiky(c, lr); }
+	glm::vec3	SpikyGradient(const glm::vec3& r, float lr) const { return SphSpikyGradient(c, r, lr); }
+	float		SpikyLaplacian(float lr) const { return SphSpikyLaplacian(c, lr); }
+	float		Viscosity(float lr) const { return SphViscosity(c, lr); }
+	glm::vec3	ViscosityGradient(const glm::vec3& r, float lr) const { return SphViscosityGradient(c, r, lr); }
+	float		ViscosityLaplacian(float lr) const { return SphViscosityLaplacian(c, lr); }
+
+private:
+	SphKernelCoefficients	c;
+};
+
+// The same kernels for a smoothing length H fixed at compile time
+// The coefficients are rebuilt from the constant H inside every inlined call, so the compiler folds
+// them into immediates; this stands in for constexpr, which the VS2012 toolset does not have
+template <int H>
+class FixedSphKernelSet {
+public:
+	static float		GetH() { return (float)H; }
+	static SphKernelCoefficients	GetCoefficients() { return MakeSphKernelCoefficients((float)H); }
+
+	static float		Poly6(float lrs) { return SphPoly6(GetCoefficients(), lrs); }
+	static glm::vec3	Poly6Gradient(const glm::vec3& r, float lr) { return SphPoly6Gradient(GetCoefficients(), r, lr); }
+	static float		Poly6Laplacian(float lr) { return SphPoly6Laplacian(GetCoefficients(), lr); }
+	static glm::vec3	Poly6GradientLaplacian(const glm::vec3& r, float lr, float& laplac) { return SphPoly6GradientLaplacian(GetCoefficients(), r, lr, laplac); }
+	static float		Spiky(float lr) { return SphSpiky(GetCoefficients(), lr); }
+	static glm::vec3	SpikyGradient(const glm::vec3& r, float lr) { return SphSpikyGradient(GetCoefficients(), r, lr); }
+	static float		SpikyLaplacian(float lr) { return SphSpikyLaplacian(GetCoefficients(), lr); }
+	static float		Viscosity(float lr) { return SphViscosity(GetCoefficients(), lr); }
+	static glm::vec3	ViscosityGradient(const glm::vec3& r, float lr) { return SphViscosityGradient(GetCoefficients(), r, lr); }
+	static float		ViscosityLaplacian(float lr) { return SphViscosityLaplacian(GetCoefficients(), lr); }
+};
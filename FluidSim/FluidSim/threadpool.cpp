@@ -0,0 +1,119 @@
+#include "threadpool.h"
+
+#include <algorithm>
+
+// threadCount includes the calling thread, which works along during ParallelFor
+ThreadPool::ThreadPool(unsigned threadCount) :
+	generation(0),
+	busyWorkers(0),
+	stop(false),
+	body(0),
+	count(0),
+	blockSize(1) {
+	if (threadCount < 1) threadCount = 1;
+	for (unsigned i = 0; i < threadCount; i++)
+		queues.push_back(new BlockQueue());
+	for (unsigned i = 1; i < threadCount; i++)
+		threads.push_back(std::thread(&ThreadPool::WorkerLoop, this, i));
+}
+
+ThreadPool::~ThreadPool() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stop = true;
+	}
+	wake.notify_all();
+	for (auto ti = threads.begin(); ti != threads.end(); ti++)
+		ti->join();
+	for (auto qi = queues.begin(); qi != queues.end(); qi++)
+		delete *qi;
+}
+
+// Calls body(begin, end) for consecutive blocks of at most blockSize covering [0, count)
+// Returns when every block is done
+void ThreadPool::ParallelFor(unsigned count, unsigned blockSize, const std::function<void(unsigned, unsigned)>& body) {
+	if (count == 0) return;
+	if (blockSize == 0) blockSize = 1;
+	const unsigned blocks = (count + blockSize - 1) / blockSize;
+
+	// Not worth waking anyone up
+	if (threads.empty() || blocks == 1) {
+		for (unsigned b = 0; b < blocks; b++)
+			body(b * blockSize, std::min(count, (b + 1) * blockSize));
+		return;
+	}
+
+	// Hand every worker a contiguous share of the blocks, stealing evens out the rest
+	const unsigned workers = (unsigned)queues.size();
+	for (unsigned w = 0; w < workers; w++) {
+		BlockQueue& queue = *queues[w];
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		for (unsigned b = blocks * w / workers; b < blocks * (w + 1) / workers; b++)
+			queue.blocks.push_back(b);
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		this->body = &body;
+		this->count = count;
+		this->blockSize = blockSize;
+		busyWorkers = (unsigned)threads.size();
+		generation++;
+	}
+	wake.notify_all();
+
+	RunBlocks(0);
+
+	// Wait until no worker can still touch the job
+	std::unique_lock<std::mutex> lock(mutex);
+	while (busyWorkers > 0)
+		done.wait(lock);
+	this->body = 0;
+}
+
+void ThreadPool::WorkerLoop(unsigned worker) {
+	unsigned seen = 0;
+	for (;;) {
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			while (!stop && generation == seen)
+				wake.wait(lock);
+			if (stop) return;
+			seen = generation;
+		}
+
+		RunBlocks(worker);
+
+		std::lock_guard<std::mutex> lock(mutex);
+		if (--busyWorkers == 0)
+			done.notify_one();
+	}
+}
+
+void ThreadPool::RunBlocks(unsigned worker) {
+	unsigned block;
+	while (PopBlock(worker, block) || StealBlock(worker, block))
+		(*body)(block * blockSize, std::min(count, (block + 1) * blockSize));
+}
+
+bool ThreadPool::PopBlock(unsigned worker, unsigned& block) {
+	BlockQueue& queue = *queues[worker];
+	std::lock_guard<std::mutex> lock(queue.mutex);
+	if (queue.blocks.empty()) return false;
+	block = queue.blocks.back();
+	queue.blocks.pop_back();
+	return true;
+}
+
+bool ThreadPool::StealBlock(unsigned worker, unsigned& block) {
+	const unsigned workers = (unsigned)queues.size();
+	for (unsigned i = 1; i < workers; i++) {
+		BlockQueue& queue = *queues[(worker + i) % workers];
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		if (queue.blocks.empty()) continue;
+		block = queue.blocks.front();
+		queue.blocks.pop_front();
+		return true;
+	}
+	return false;
+}
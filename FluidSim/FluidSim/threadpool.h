@@ -0,0 +1,51 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads for splitting loops over particles into blocks
+// Every worker gets its own deque of blocks and steals from the others once it runs dry,
+// so blocks with many more neighbours than others do not leave cores idle
+class ThreadPool {
+public:
+	// threadCount includes the calling thread, which works along during ParallelFor
+	explicit ThreadPool(unsigned threadCount);
+	~ThreadPool();
+
+	unsigned	GetThreadCount() const { return (unsigned)queues.size(); }
+
+	// Calls body(begin, end) for consecutive blocks of at most blockSize covering [0, count)
+	// Returns when every block is done
+	void		ParallelFor(unsigned count, unsigned blockSize, const std::function<void(unsigned, unsigned)>& body);
+
+private:
+	// Deque of block indices owned by one worker; the owner pops from the back, thieves from the front
+	struct BlockQueue {
+		std::mutex				mutex;
+		std::deque<unsigned>	blocks;
+	};
+
+	void		WorkerLoop(unsigned worker);
+	void		RunBlocks(unsigned worker);
+	bool		PopBlock(unsigned worker, unsigned& block);
+	bool		StealBlock(unsigned worker, unsigned& block);
+
+	std::vector<std::thread>	threads;
+	std::vector<BlockQueue*>	queues;			// One per thread, index 0 belongs to the calling thread
+
+	std::mutex					mutex;			// Guards the job fields below
+	std::condition_variable		wake;			// Signals a new job or shutdown to the workers
+	std::condition_variable		done;			// Signals the caller that all workers are idle
+	unsigned					generation;		// Incremented for every job
+	unsigned					busyWorkers;	// Background workers still inside the current job
+	bool						stop;
+
+	// The current job
+	const std::function<void(unsigned, unsigned)>*	body;
+	unsigned					count;
+	unsigned					blockSize;
+};
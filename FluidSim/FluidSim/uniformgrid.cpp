@@ -0,0 +1,242 @@
+#include "uniformgrid.h"
+
+#include <algorithm>
+#include <cmath>
+#include <utility>
+
+// Hashed cells lie within this many cells of the origin along each axis, so the keys fit in 21 bits per axis
+const int hashedCellRange = 1 << 20;
+// Key of no cell, marks the empty slots of the table
+const unsigned long long emptyKey = ~0ull;
+const unsigned minTableSlots = 64;
+
+// Spreads the low 21 bits of v out to every third bit
+static unsigned long long SpreadBits(unsigned v) {
+	unsigned long long x = v & 0x1fffff;
+	x = (x | x << 32) & 0x1f00000000ffffull;
+	x = (x | x << 16) & 0x1f0000ff0000ffull;
+	x = (x | x << 8) & 0x100f00f00f00f00full;
+	x = (x | x << 4) & 0x10c30c30c30c30c3ull;
+	x = (x | x << 2) & 0x1249249249249249ull;
+	return x;
+}
+
+// Position of cell (x, y, z) along the Morton curve: the bits of the three coordinates interleaved
+// The coordinates are offset to make them positive, which keeps the order of the cells within the bounding box
+static unsigned long long CellKey(int x, int y, int z) {
+	return SpreadBits((unsigned)(x + hashedCellRange)) | SpreadBits((unsigned)(y + hashedCellRange)) << 1
+		| SpreadBits((unsigned)(z + hashedCellRange)) << 2;
+}
+
+// Fibonacci hashing: the top bits of the key times 2^64 over the golden ratio pick the slot
+static unsigned HashKey(unsigned long long key, unsigned shift) {
+	return (unsigned)((key * 0x9e3779b97f4a7c15ull) >> shift);
+}
+
+UniformGrid::UniformGrid() :
+	storage(DenseGrid),
+	origin(0.f, 0.f, 0.f),
+	cellSize(1.f),
+	invCellSize(1.f),
+	dimensions(0, 0, 0),
+	slotShift(64),
+	inOrder(false) {
+}
+
+// Covers boundingBox with cells of size cellSize, plus one empty cell on each side
+void UniformGrid::Init(const AABoundingBox& boundingBox, float cellSize, GridStorage storage) {
+	this->storage = storage;
+	this->cellSize = cellSize;
+	invCellSize = 1.f / cellSize;
+
+	const glm::vec3 low(std::min(boundingBox.left, boundingBox.right),
+		std::min(boundingBox.bottom, boundingBox.top),
+		std::min(boundingBox.back, boundingBox.front));
+	origin = low - glm::vec3(cellSize, cellSize, cellSize);
+	dimensions.x = 3 + (int)floor(fabs(boundingBox.right - boundingBox.left) * invCellSize);
+	dimensions.y = 3 + (int)floor(fabs(boundingBox.top - boundingBox.bottom) * invCellSize);
+	dimensions.z = 3 + (int)floor(fabs(boundingBox.front - boundingBox.back) * invCellSize);
+
+	// Nothing is sorted into the new cells yet
+	order.clear();
+	inOrder = false;
+	if (storage == HashedGrid) {
+		// Build sizes the table for the particles
+		cellStart.clear();
+		cellEnd.clear();
+		slotKey.clear();
+		rankCell.clear();
+		slotShift = 64;
+		return;
+	}
+
+	const unsigned cells = (unsigned)(dimensions.x * dimensions.y * dimensions.z);
+	cellStart.assign(cells, 0);
+	cellEnd.assign(cells, 0);
+
+	// Rank the cells along the Morton curve once, so Build sorts by rank with the same counting sort as by cell
+	std::vector<std::pair<unsigned long long, unsigned>> codes(cells);
+	for (int z = 0; z < dimensions.z; z++)
+		for (int y = 0; y < dimensions.y; y++)
+			for (int x = 0; x < dimensions.x; x++) {
+				const unsigned c = (unsigned)(x + (y + z * dimensions.y) * dimensions.x);
+				codes[c] = std::make_pair(CellKey(x, y, z), c);
+			}
+	std::sort(codes.begin(), codes.end());
+	rankCell.resize(cells);
+	for (unsigned r = 0; r < cells; r++)
+		rankCell[r] = codes[r].second;
+}
+
+// Cell that contains position; a dense grid clamps positions outside of it to the border cells
+glm::ivec3 UniformGrid::CellCoord(const glm::vec3& position) const {
+	const glm::vec3 local = (position - origin) * invCellSize;
+	glm::ivec3 cell;
+	for (int a = 0; a < 3; a++) {
+		// Compare as float first, so huge or non-finite positions cannot overflow the int cast
+		// Hashed cells stop one short of the key range, so the cells around them still have keys of their own
+		const float c = local[a];
+		const int low = storage == HashedGrid ? 1 - hashedCellRange : 0;
+		const int high = storage == HashedGrid ? hashedCellRange - 2 : dimensions[a] - 1;
+		if (!(c >= (float)low)) cell[a] = low;
+		else if (c >= (float)high) cell[a] = high;
+		else cell[a] = (int)floor(c);
+	}
+	return cell;
+}
+
+unsigned UniformGrid::CellIndex(const glm::vec3& position) const {
+	const glm::ivec3 cell = CellCoord(position);
+	return (unsigned)(cell.x + (cell.y + cell.z * dimensions.y) * dimensions.x);
+}
+
+// Slot of the cell with the given key, or the empty slot where it would go
+unsigned UniformGrid::FindSlot(unsigned long long key) const {
+	const unsigned mask = (unsigned)slotKey.size() - 1;
+	unsigned slot = HashKey(key, slotShift);
+	while (slotKey[slot] != key && slotKey[slot] != emptyKey)
+		slot = (slot + 1) & mask;
+	return slot;
+}
+
+// Sets the range of particles in cell (x, y, z), returns false if the cell is not part of the grid
+bool UniformGrid::CellRange(int x, int y, int z, unsigned& begin, unsigned& end) const {
+	if (storage == HashedGrid) {
+		if (slotKey.empty()) return false;
+		const unsigned slot = FindSlot(CellKey(x, y, z));
+		if (slotKey[slot] == emptyKey) return false;
+		begin = cellStart[slot];
+		end = cellEnd[slot];
+		return true;
+	}
+
+	if (x < 0 || y < 0 || z < 0 || x >= dimensions.x || y >= dimensions.y || z >= dimensions.z)
+		return false;
+	const unsigned c = (unsigned)(x + (y + z * dimensions.y) * dimensions.x);
+	begin = cellStart[c];
+	end = cellEnd[c];
+	return true;
+}
+
+// Finds the table slot of every particle's cell and ranks the occupied slots along the Morton curve
+void UniformGrid::HashCells(const ParticleStore& particles) {
+	const unsigned n = particles.Size();
+
+	// There is at most one cell per particle, so the table is never more than half full
+	unsigned slots = 1;
+	slotShift = 64;
+	while (slots < minTableSlots || slots < 2 * n) {
+		slots *= 2;
+		slotShift--;
+	}
+	slotKey.assign(slots, emptyKey);
+	cellStart.assign(slots, 0);
+	cellEnd.resize(slots);
+
+	rankCell.clear();
+	for (unsigned i = 0; i < n; i++) {
+		const glm::ivec3 cell = CellCoord(particles.position[i]);
+		const unsigned long long key = CellKey(cell.x, cell.y, cell.z);
+		const unsigned slot = FindSlot(key);
+		if (slotKey[slot] == emptyKey) {
+			slotKey[slot] = key;
+			rankCell.push_back(slot);
+		}
+		particleCell[i] = slot;
+	}
+	std::sort(rankCell.begin(), rankCell.end(), [&](unsigned a, unsigned b) { return slotKey[a] < slotKey[b]; });
+}
+
+// Sorts particles by cell and fills in the cell ranges
+void UniformGrid::Build(ParticleStore& particles, bool reorder) {
+	const unsigned n = particles.Size();
+
+	particleCell.resize(n);
+	if (storage == HashedGrid) HashCells(particles);
+	else {
+		for (unsigned i = 0; i < n; i++)
+			particleCell[i] = CellIndex(particles.position[i]);
+	}
+
+	// Count the particles in every cell
+	std::fill(cellEnd.begin(), cellEnd.end(), 0);
+	for (unsigned i = 0; i < n; i++)
+		cellEnd[particleCell[i]]++;
+
+	// Exclusive prefix sum along the Morton curve gives the start of every cell
+	const unsigned cells = (unsigned)rankCell.size();
+	unsigned sum = 0;
+	for (unsigned r = 0; r < cells; r++) {
+		const unsigned c = rankCell[r];
+		cellStart[c] = sum;
+		sum += cellEnd[c];
+		cellEnd[c] = cellStart[c];
+	}
+
+	// Scatter the particles into their cells, cellEnd doubles as the insertion cursor
+	order.resize(n);
+	for (unsigned i = 0; i < n; i++)
+		order[cellEnd[particleCell[i]]++] = i;
+
+	// Particles that have not left their cells since the last reorder need no permutation
+	inOrder = true;
+	for (unsigned k = 0; k < n && inOrder; k++)
+		inOrder = order[k] == k;
+	if (reorder && !inOrder) {
+		particles.Permute(order);
+		for (unsigned i = 0; i < n; i++)
+			order[i] = i;
+		inOrder = true;
+	}
+}
+
+// Drops the removed particles from the cells and renumbers the rest after ParticleStore::Remove
+void UniformGrid::Remove(const std::vector<unsigned>& remap) {
+	// particleCell is only needed during Build, it holds the sorted particles kept before every position here
+	const unsigned n = (unsigned)order.size();
+	particleCell.resize(n + 1);
+	unsigned kept = 0;
+	for (unsigned k = 0; k < n; k++) {
+		particleCell[k] = kept;
+		const unsigned i = order[k] < remap.size() ? remap[order[k]] : removedParticle;
+		if (i != removedParticle) order[kept++] = i;
+	}
+	particleCell[n] = kept;
+	order.resize(kept);
+
+	for (unsigned c = 0; c < cellStart.size(); c++) {
+		cellStart[c] = particleCell[std::min(cellStart[c], n)];
+		cellEnd[c] = particleCell[std::min(cellEnd[c], n)];
+	}
+}
+
+// Number of cells holding particles and the most particles in a single cell, after Build
+void UniformGrid::GetOccupancy(unsigned& occupiedCells, unsigned& maxPerCell) const {
+	occupiedCells = 0;
+	maxPerCell = 0;
+	for (unsigned c = 0; c < cellStart.size(); c++) {
+		const unsigned count = cellEnd[c] - cellStart[c];
+		if (count > 0) occupiedCells++;
+		if (count > maxPerCell) maxPerCell = count;
+	}
+}
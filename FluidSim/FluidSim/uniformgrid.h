@@ -0,0 +1,125 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <vector>
+#include "boundingbox.h"
+#include "particlestore.h"
+
+// How the grid stores its cells
+enum GridStorage {
+	DenseGrid,		// An array over every cell of the bounding box; positions outside of it are clamped to the border cells
+	HashedGrid		// A hash table over the cells holding particles only, its memory follows the particles instead of the box
+};
+
+// Uniform grid for finding the particles within the SPH radius of a position
+// It is rebuilt every step with a counting sort of the particles by cell, so each cell is a single range
+// [cellStart, cellEnd) of the sorted order. The cells are numbered along a Morton (Z-order) curve for the sort,
+// which keeps cells that are close in space close in the order as well.
+// The sorted order is kept as a list of particle indices; Build can also move the particles themselves into it,
+// after which particles close in space are close in memory
+//
+// A hashed grid keeps the ranges in an open addressing table keyed by cell, rebuilt by every Build with twice as many
+// slots as there are particles. Its cells go on past the bounding box, up to a million cells out along each axis
+class UniformGrid {
+public:
+	UniformGrid();
+
+	// Covers boundingBox with cells of size cellSize, plus one empty cell on each side
+	void		Init(const AABoundingBox& boundingBox, float cellSize, GridStorage storage);
+
+	// Sorts particles by cell and fills in the cell ranges
+	// With reorder set the particles are permuted into the sorted order as well, otherwise they stay where they are
+	void		Build(ParticleStore& particles, bool reorder);
+
+	// Drops the removed particles from the cells and renumbers the rest after ParticleStore::Remove
+	void		Remove(const std::vector<unsigned>& remap);
+
+	// Cell that contains position; a dense grid clamps positions outside of it to the border cells
+	glm::ivec3	CellCoord(const glm::vec3& position) const;
+
+	// Sets the range of particles in cell (x, y, z), returns false if the cell is not part of the grid
+	bool		CellRange(int x, int y, int z, unsigned& begin, unsigned& end) const;
+
+	// Calls f(j) for every particle j in the 27 cells around position
+	template <typename F>
+	void		ForEachNeighbour(const glm::vec3& position, F f) const;
+
+	// Calls f(j) for the particles j of a half stencil around particle i at position: the particles after i in its own
+	// cell and all particles in the 13 of the 26 cells around it that come after it in x, then y, then z order
+	// Called for every particle, it visits every unordered pair of particles in neighbouring cells exactly once
+	template <typename F>
+	void		ForEachHalfNeighbour(unsigned i, const glm::vec3& position, F f) const;
+
+	GridStorage	GetStorage() const { return storage; }
+	float		GetCellSize() const { return cellSize; }
+	// Corner of the first cell and the number of cells covering the bounding box along each axis, also when hashed
+	glm::vec3	GetOrigin() const { return origin; }
+	glm::ivec3	GetDimensions() const { return dimensions; }
+	// Cells or table slots the ranges are stored for
+	unsigned	GetCellCount() const { return (unsigned)cellStart.size(); }
+
+	// Number of cells holding particles and the most particles in a single cell, after Build
+	void		GetOccupancy(unsigned& occupiedCells, unsigned& maxPerCell) const;
+
+private:
+	unsigned	CellIndex(const glm::vec3& position) const;
+	// Finds the table slot of every particle's cell and ranks the occupied slots along the Morton curve
+	void		HashCells(const ParticleStore& particles);
+	unsigned	FindSlot(unsigned long long key) const;
+
+	GridStorage				storage;
+	glm::vec3				origin;			// Corner of the first cell
+	float					cellSize;
+	float					invCellSize;
+	glm::ivec3				dimensions;		// Number of cells along each axis
+	std::vector<unsigned>	cellStart;		// First sorted particle in each cell or table slot
+	std::vector<unsigned>	cellEnd;		// One past the last sorted particle in each cell or table slot
+	std::vector<unsigned long long>	slotKey;	// Key of the cell in each table slot, when hashed
+	unsigned				slotShift;		// 64 minus log2 of the table size
+	std::vector<unsigned>	rankCell;		// Cell or slot at each position along the Morton curve
+	std::vector<unsigned>	particleCell;	// Cell or slot of each particle, before sorting
+	std::vector<unsigned>	order;			// Particle indices sorted by cell
+	bool					inOrder;		// True if the particles themselves are sorted, order is then the identity
+};
+
+template <typename F>
+void UniformGrid::ForEachNeighbour(const glm::vec3& position, F f) const {
+	const glm::ivec3 cell = CellCoord(position);
+	unsigned begin, end;
+	for (int z = cell.z - 1; z <= cell.z + 1; z++) {
+		for (int y = cell.y - 1; y <= cell.y + 1; y++) {
+			for (int x = cell.x - 1; x <= cell.x + 1; x++) {
+				if (!CellRange(x, y, z, begin, end)) continue;
+				if (inOrder) {
+					for (unsigned j = begin; j < end; j++)
+						f(j);
+				} else {
+					for (unsigned k = begin; k < end; k++)
+						f(order[k]);
+				}
+			}
+		}
+	}
+}
+
+template <typename F>
+void UniformGrid::ForEachHalfNeighbour(unsigned i, const glm::vec3& position, F f) const {
+	const glm::ivec3 cell = CellCoord(position);
+	unsigned begin, end;
+	// Offsets (x, y, z) that come after (0, 0, 0) with z most significant: z = 1, or z = 0 and y = 1, or z = y = 0 and x = 1
+	for (int dz = 0; dz <= 1; dz++) {
+		for (int dy = dz == 0 ? 0 : -1; dy <= 1; dy++) {
+			for (int dx = dz == 0 && dy == 0 ? 0 : -1; dx <= 1; dx++) {
+				if (!CellRange(cell.x + dx, cell.y + dy, cell.z + dz, begin, end)) continue;
+				const bool own = dx == 0 && dy == 0 && dz == 0;
+				if (inOrder) {
+					for (unsigned j = own ? i + 1 : begin; j < end; j++)
+						f(j);
+				} else {
+					for (unsigned k = begin; k < end; k++)
+						if (!own || order[k] > i) f(order[k]);
+				}
+			}
+		}
+	}
+}